@@ -165,6 +165,12 @@ int main(int argc, char **argv) {
         if(check_start())
             break;
 
+#ifdef PGO_GENERATE
+        /* Training runs end once the benchmark has settled */
+        if(phase == PHASE_FINAL)
+            break;
+#endif
+
         printf(" \r");
         do_frame();
         running_stats();
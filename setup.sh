@@ -76,7 +76,7 @@ sed_path () {
 # Function to extract value from argument
 # @param[in] $1 input string e.g. --flagname=value
 arg_value () {
-  echo $1 | sed -e "s/--[a-z]*=\(.*\)/\1/"
+  echo $1 | sed -e "s/--[a-z-]*=\(.*\)/\1/"
 }
 
 # Function that faults if a directory doesn't exist
@@ -157,6 +157,89 @@ else
   exec_sha_checksum="false"
 fi
 
+# GNU time reports peak RSS, otherwise stages are timed with "date" and "times"
+if $(detect "/usr/bin/time")
+then
+  exec_time="/usr/bin/time"
+elif $(detect "gtime")
+then
+  exec_time="gtime"
+else
+  exec_time="false"
+fi
+
+# Function to print the current wall-clock time in seconds
+now () {
+  date +%s.%N | sed -e "s/\.N$//"
+}
+
+# Function to mark the start of a profiled stage
+profile_begin () {
+  rm -f "${profile_sample}"
+  times > "${profile_sample}.begin"
+  profile_start=$(now)
+}
+
+# Function to record the resources used by a profiled stage
+
+# @param[in] $1 stage name
+# @param[in] $2 stage status
+profile_end () {
+  profile_stop=$(now)
+  times > "${profile_sample}.end"
+
+  if [ -s "${profile_sample}" ]
+  then
+    # GNU time output: <wall> <user> <sys> <peak RSS in KiB>
+    sample=$(tail -n 1 "${profile_sample}")
+  else
+    # second line of "times" is the CPU time used by waited-for children
+    sample=$(awk -v start=${profile_start} -v stop=${profile_stop} '
+      FNR == 2 {
+        gsub(/[ms]/, " ")
+        user = $1 * 60 + $2
+        sys  = $3 * 60 + $4
+        if (NR == FNR) { user0 = user; sys0 = sys }
+        else { printf "%.2f %.2f %.2f -\n", stop - start, user - user0, sys - sys0 }
+      }' "${profile_sample}.begin" "${profile_sample}.end")
+  fi
+  echo "$1 $2 ${sample}" >> "${profile_records}"
+  rm -f "${profile_sample}" "${profile_sample}.begin" "${profile_sample}.end"
+}
+
+# Function to write the JSON profile and print the slowest stages
+profile_report () {
+  if [ ! -s "${profile_records}" ]
+  then
+    return 0
+  fi
+
+  awk -v makejobs=${makejobs} -v timing=$([ "${exec_time}" = "false" ] && echo "times" || echo "gnu-time") '
+    BEGIN {
+      printf "{\n  \"makejobs\": %d,\n  \"timing\": \"%s\",\n  \"stages\": [", makejobs, timing
+    }
+    {
+      cpu = $4 + $5
+      printf "%s\n    { \"stage\": \"%s\", \"status\": \"%s\", \"wall\": %.2f, \"user\": %.2f, \"sys\": %.2f, \"maxrss_kb\": %s, \"parallelism\": %.2f }",
+             sep, $1, $2, $3, $4, $5, ($6 == "-" ? "null" : $6), ($3 > 0 ? cpu / $3 : 0)
+      sep = ","
+      wall += $3; user += $4; sys += $5
+      if ($6 != "-" && $6 > rss) rss = $6
+    }
+    END {
+      printf "\n  ],\n  \"total\": { \"wall\": %.2f, \"user\": %.2f, \"sys\": %.2f, \"maxrss_kb\": %s, \"parallelism\": %.2f }\n}\n",
+             wall, user, sys, (rss == "" ? "null" : rss), (wall > 0 ? (user + sys) / wall : 0)
+    }' "${profile_records}" > "${profile}"
+
+  announce "\n======= [ Slowest stages ] ======="
+  sort -k 3 -n -r "${profile_records}" | head -n 10 | awk '
+    BEGIN { printf "%-40s %10s %10s %10s %12s %8s\n", "stage", "wall(s)", "user(s)", "sys(s)", "maxrss(KiB)", "cpu/wall" }
+    { printf "%-40s %10.2f %10.2f %10.2f %12s %8.2f\n", $1, $3, $4, $5, $6, ($3 > 0 ? ($4 + $5) / $3 : 0) }' | tee -a ${log}
+  awk '{ wall += $3; cpu += $4 + $5 }
+    END { printf "total: %.2fs wall, %.2fs cpu, parallelism %.2f with %d jobs\n", wall, cpu, (wall > 0 ? cpu / wall : 0), '"${makejobs}"' }' "${profile_records}" | tee -a ${log}
+  announce "Profile written to: ${profile}"
+}
+
 
 
 # Function to download a file
@@ -620,6 +703,9 @@ build_sh4_c_toolchain=true
 build_sh4_libc=true
 build_sh4_cpp_compiler=true
 build_libraries=true
+lto=false
+pgo=false
+target_optimization=""
 
 platform="dreamcast"
 git_transport_prefix="https://github.com"
@@ -628,6 +714,7 @@ gnu_url="ftp://gcc.gnu.org/pub"
 basedir=$(absolutedir $(dirname $0))
 builddir=$(absolutedir "${basedir}/builds")
 installdir="/usr/local"
+profile=""
 libraries=""
 
 usage=$(concat \
@@ -638,6 +725,7 @@ usage=$(concat \
       "\n                  [--clean]" \
       "\n                  [--clone | --download]" \
       "\n                  [--makejobs=<number>]" \
+      "\n                  [--profile=<file>]" \
       "\n                  [--no-patch]" \
       "\n                  [--no-build]" \
       "\n                  [--no-arm-toolchain]" \
@@ -645,6 +733,9 @@ usage=$(concat \
       "\n                  [--no-sh4-libc]" \
       "\n                  [--no-sh4-c++]" \
       "\n                  [--no-libraries]" \
+      "\n                  [--lto]" \
+      "\n                  [--pgo]" \
+      "\n                  [--target-optimization=<O2 | Os>]" \
       "\n                  [--help | -h]" \
       )
 help=$(concat \
@@ -693,6 +784,10 @@ do
       makejobs=$(arg_value ${option})
     ;;
 
+    --profile=*)
+      profile=$(absolutedir $(arg_value ${option}))
+    ;;
+
 
     --no-patch)
       patch=false
@@ -729,13 +824,25 @@ do
       build_libraries=false
     ;;
 
+    --lto)
+      lto=true
+    ;;
+
+    --pgo)
+      pgo=true
+    ;;
+
+    --target-optimization=*)
+      target_optimization=$(arg_value ${option})
+    ;;
+
     -h|--help)
       echo "${usage}"
       echo "${help}"
       exit 0
     ;;
     ?*)
-      option=$(echo ${option} | sed -e "s/\(--[a-z]*\)=.*/\1/")
+      option=$(echo ${option} | sed -e "s/\(--[a-z-]*\)=.*/\1/")
       echo "\nunrecognized option: ${option}"
       echo "${usage}"
       exit 1
@@ -790,14 +897,17 @@ fi
 
 echo "\n======= [ Initializing ] =======\n"
 
-# Determine the number of processes to use for building
-makejobs=$(nproc --all)
-if [ $? -ne 0 ]
+# Determine the number of processes to use for building unless --makejobs was given
+if [ "x${makejobs}" = "x" ]
 then
-  makejobs=$(sysctl hw.ncpu | cut -f2 -d' ')
+  makejobs=$(nproc --all)
   if [ $? -ne 0 ]
   then
-    makejobs="1"
+    makejobs=$(sysctl hw.ncpu | cut -f2 -d' ')
+    if [ $? -ne 0 ]
+    then
+      makejobs="1"
+    fi
   fi
 fi
 
@@ -847,10 +957,20 @@ fi
 log="${builddir}/build.log"
 rm -f "${log}"
 
+# Set up the per-stage timing records
+if [ "x${profile}" = "x" ]
+then
+  profile="${builddir}/profile.json"
+fi
+profile_records="${builddir}/profile.records"
+profile_sample="${builddir}/profile.sample"
+rm -f "${profile_records}"
+
 echo "build   dir: ${builddir}"
 echo "install dir: ${installdir}"
 echo "C++ compiler: ${CXX}"
 echo "Logging to: ${log}"
+echo "Profiling to: ${profile}"
 
 
 if ! $(detect "tar")
@@ -923,14 +1043,26 @@ step_template() {
   command=$3
   logfile=$4
   olddir=$(pwd)
+  stage="$(basename ${dir})/$(echo ${logfile} | sed -e "s/\.log$//")"
+
+  if [ "${exec_time}" = "false" ]
+  then
+    timer=""
+  else
+    timer="${exec_time} -o ${profile_sample} -f '%e %U %S %M'"
+  fi
 
   announce "${message}"
   cd ${dir}
-  if ! eval "${command} > ${logfile} 2>&1"
+  profile_begin
+  if ! eval "${timer} ${command} > ${logfile} 2>&1"
   then
+    profile_end "${stage}" "failed"
     announce "FAILED!\nSee ${dir}/${logfile} for details."
+    profile_report
     exit 1
   fi
+  profile_end "${stage}" "ok"
   cd ${olddir}
 }
 
@@ -965,6 +1097,13 @@ configure_and_make () {
 # === FOR ALL TARGETS ===
 library_options="--with-newlib --disable-libssp --disable-tls"
 
+# Optimization level for libgcc, newlib and libstdc++ in every multilib
+if [ "x${target_optimization}" != "x" ]
+then
+  export CFLAGS_FOR_TARGET="-${target_optimization} -g"
+  export CXXFLAGS_FOR_TARGET="-${target_optimization} -g"
+fi
+
 # === ARM TARGET ===
 target="arm-eabi"
 target_dir=${installdir}/${platform}/${target}
@@ -990,15 +1129,25 @@ target="sh-elf"
 target_dir=${installdir}/${platform}/${target}
 cpu_options="--with-endian=little --with-cpu=m4-single-only --with-multilib-list=m4-single-only,m4-nofpu,m4"
 
+# LTO needs plugin support in binutils and the lto-plugin for the linker
+if ${lto}
+then
+  binutils_options="--enable-plugins --enable-lto"
+  lto_options="--enable-lto --enable-plugin"
+else
+  binutils_options=""
+  lto_options=""
+fi
+
 # <=== BUILD SH4 C TOOLCHAIN ===>
 if ${build_sh4_c_toolchain}
 then
-  configure_and_make "${binutils_dir}" "${target}"
+  configure_and_make "${binutils_dir}" "${target}" "${binutils_options}"
   if [ -e "${gdb_dir}" ]
   then
     configure_and_make "${gdb_dir}" "${target}"
   fi
-  configure_and_make "${gcc_dir}" "${target}" "${cpu_options} ${library_options} --enable-languages=c --without-headers"
+  configure_and_make "${gcc_dir}" "${target}" "${cpu_options} ${library_options} ${lto_options} --enable-languages=c --without-headers"
 fi
 # </=== BUILD SH4 C COMPILER ===>
 
@@ -1040,13 +1189,30 @@ then
   assert_dir "KOS" "${kos_dir}"
   step_template "${builddir}/${kos_dir}" "Installing headers to build SH4 C++ compiler." "sudo ${make_tool} ${environment} install_headers"  "install_headers.log"
 
-  configure_and_make "${gcc_dir}" "${target}" "${cpu_options} ${library_options} --enable-languages=c,c++ --enable-threads=kos"
+  # libgcov only gets file I/O (and so can write .gcda files) when gcc
+  # sees the newlib headers, otherwise --with-newlib stubs it out
+  if ${pgo}
+  then
+    pgo_options="--with-headers=${target_dir}/include"
+  else
+    pgo_options=""
+  fi
+
+  configure_and_make "${gcc_dir}" "${target}" "${cpu_options} ${library_options} ${lto_options} ${pgo_options} --enable-languages=c,c++ --enable-threads=kos"
 
   sudo sh -c "cat ${basedir}/scripts/$(target_name ${target}).specs | sed -e s/$(to_upper $(to_variable $(target_name ${target})_include_path))/$(sed_path ${target_dir}/include)/g > ${target_dir}/lib/specs"
 #  sudo cp ${basedir}/scripts/$(target_name ${target}).specs ${target_dir}/lib/specs
   sudo rm ${target_dir}/lib/ldscripts/shlelf.*
-  sudo cp ${basedir}/scripts/shlelf.* ${target_dir}/lib/ldscripts/
-  sudo sh -c "cat ${basedir}/scripts/shlelf.x | sed -e s/$(to_upper $(to_variable $(target_name ${target})_lib_path))/$(sed_path ${target_dir}/lib)/g > ${target_dir}/lib/ldscripts/shlelf.x"
+  for script in ${basedir}/scripts/shlelf.*
+  do
+    sudo sh -c "cat ${script} | sed -e s/$(to_upper $(to_variable $(target_name ${target})_lib_path))/$(sed_path ${target_dir}/lib)/g > ${target_dir}/lib/ldscripts/$(basename ${script})"
+  done
+  # Empty function order for shlelf.xo, replaced per project by genorder output
+  sudo sh -c "echo '/* No profile-guided function order */' > ${target_dir}/lib/text-order.ld"
+  if ${lto}
+  then
+    sudo cp ${basedir}/scripts/$(target_name ${target})-lto.specs ${target_dir}/lib/
+  fi
 
 fi
 # </=== BUILD SH4 C++ COMPILER ===>
@@ -1073,6 +1239,8 @@ then
 fi
 # </=== BUILD LIBRARIES ===>
 
+profile_report
+
 echo "\n======= [ Installation complete! ] ======="
 
 exit 0
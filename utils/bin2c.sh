@@ -1,5 +1,13 @@
 #!/bin/sh
 
+# Hand off to the native tool when it has been built; it is much faster.
+# It keeps to the array this script has always written; run utils/bin2c
+# itself for the forms that are quicker to compile.
+native=`dirname $0`/bin2c/bin2c
+if [ -x "${native}" ]; then
+  exec "${native}" --format=bytes "$@"
+fi
+
 # Function to extract value from argument
 # @param[in] $1 input string e.g. --flagname=value
 arg_value () {
@@ -36,13 +44,23 @@ until
     --name=*)
       name=$(arg_value $1)
     ;;
-    ?*)
+    -*)
       echo "Usage: bin2c.sh <infile> <outfile> <array_name>"
       echo "       bin2c.sh -i file -o file -n name"
       echo "       bin2c.sh --input=<file> --output=<file> --name=<array name>"
       exit 1
     ;;
 
+    ?*)
+      if [ -z "${infile}" ]; then
+        infile=$1
+      elif [ -z "${outfile}" ]; then
+        outfile=$1
+      else
+        name=$1
+      fi
+    ;;
+
     *)
     ;;
   esac
@@ -53,10 +71,10 @@ done
 
 size=`stat -c %s ${infile}`
 header=`echo ${outfile} | sed -e "s/\([a-z]\)/\U\1/g" -e "s/[^0-9a-zA-Z]/_/g"`
-echo "#ifndef _${header}_" >> ${outfile}
+echo "#ifndef _${header}_" > ${outfile}
 echo "#define _${header}_" >> ${outfile}
 echo "" >> ${outfile}
-echo "const int ${name}_size = ${size}" >> ${outfile}
+echo "const int ${name}_size = ${size};" >> ${outfile}
 echo "const unsigned char ${name}_data[${size}] = {" >> ${outfile}
 od -t x1 ${infile} | sed -e "s/[0-9a-fA-F]\{7,9\}//" -e "s/ \([0-9a-fA-F][0-9a-fA-F]\)/0x\1, /g" >> ${outfile}
 echo "};" >> ${outfile}
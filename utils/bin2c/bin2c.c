@@ -0,0 +1,423 @@
+/* KallistiOS ##version##
+
+   bin2c.c
+
+   Native replacement for utils/bin2c.sh: turns a binary file into C source
+   declaring <name>_data and <name>_size. The input is streamed, so files
+   of any size (or a pipe) go through in one pass, and the data is written
+   as string literals or 32/64-bit words rather than one "0x.., " per byte,
+   which is several times less for the compiler to chew through. For really
+   big blobs it can write an assembler stub around .incbin instead, which
+   costs the compiler nothing at all.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#define uint8 unsigned char
+#define uint32 unsigned int
+
+enum { FMT_STRING, FMT_BYTES, FMT_WORDS32, FMT_WORDS64, FMT_ASM };
+
+static const char *format_names[] = {
+    "string", "bytes", "words32", "words64", "asm"
+};
+
+static uint8 inbuf[65536];
+static char outbuf[1 << 18];
+
+static void usage() {
+    printf("bin2c - writes a binary file as a C array\n");
+    printf("usage: bin2c [options] <infile> <outfile> <array name>\n");
+    printf("       bin2c [options] -i <infile> -o <outfile> -n <array name>\n");
+    printf("       bin2c [options] --input=<infile> --output=<outfile> --name=<array name>\n\n");
+    printf("  -f, --format=<format>  how to write the data (default string):\n");
+    printf("      string   string literals, the fastest to compile; the array\n");
+    printf("               has a NUL after the data, use <name>_size\n");
+    printf("      bytes    one 0x.. per byte, as bin2c.sh did\n");
+    printf("      words32  32-bit little-endian words, padded with zeros\n");
+    printf("      words64  64-bit little-endian words, padded with zeros\n");
+    printf("      asm      an assembler file using .incbin, nothing to compile\n");
+    printf("  -s, --asm              the same as --format=asm\n");
+    printf("  -p, --prefix=<prefix>  symbol prefix for asm (default _, as on SH)\n");
+    printf("\nAn <infile> of - reads standard input, except with asm.\n");
+}
+
+/* The include guard bin2c.sh made: the output name in upper case, with
+   anything that isn't alphanumeric turned into _ */
+static void write_guard(FILE *out, const char *outfile, int end) {
+    char *guard = strdup(outfile);
+    char *p;
+
+    for(p = guard; *p; p++)
+        *p = isalnum((uint8)*p) ? toupper((uint8)*p) : '_';
+
+    if(end)
+        fprintf(out, "\n#endif /* _%s_ */\n", guard);
+    else
+        fprintf(out, "#ifndef _%s_\n#define _%s_\n\n", guard, guard);
+
+    free(guard);
+}
+
+/* Writes one chunk as string literal text. Printable characters go as they
+   are; everything else becomes a three digit octal escape, which can't run
+   into a digit after it the way a \x escape would. Lines break every so
+   often at a literal boundary. */
+static void put_string(FILE *out, const uint8 *p, size_t len, int *col) {
+    static const char oct[] = "01234567";
+    char line[512];
+    int n = 0;
+    uint8 c;
+
+    while(len--) {
+        c = *p++;
+
+        if(*col == 0) {
+            line[n++] = ' ';
+            line[n++] = ' ';
+            line[n++] = ' ';
+            line[n++] = ' ';
+            line[n++] = '"';
+            *col = 5;
+        }
+
+        /* ? too, so that no trigraph can ever form */
+        if(c < 0x20 || c > 0x7e || c == '"' || c == '\\' || c == '?') {
+            line[n++] = '\\';
+            line[n++] = oct[c >> 6];
+            line[n++] = oct[(c >> 3) & 7];
+            line[n++] = oct[c & 7];
+            *col += 4;
+        }
+        else {
+            line[n++] = c;
+            (*col)++;
+        }
+
+        if(*col >= 76) {
+            line[n++] = '"';
+            line[n++] = '\n';
+            *col = 0;
+        }
+
+        if(n > (int)sizeof(line) - 16) {
+            fwrite(line, 1, n, out);
+            n = 0;
+        }
+    }
+
+    fwrite(line, 1, n, out);
+}
+
+static void put_bytes(FILE *out, const uint8 *p, size_t len, int *col) {
+    static const char hex[] = "0123456789abcdef";
+    char line[512];
+    int n = 0;
+
+    while(len--) {
+        line[n++] = *col ? ' ' : '\t';
+        line[n++] = '0';
+        line[n++] = 'x';
+        line[n++] = hex[*p >> 4];
+        line[n++] = hex[*p++ & 15];
+        line[n++] = ',';
+
+        if(++*col == 16) {
+            line[n++] = '\n';
+            *col = 0;
+        }
+
+        if(n > (int)sizeof(line) - 16) {
+            fwrite(line, 1, n, out);
+            n = 0;
+        }
+    }
+
+    fwrite(line, 1, n, out);
+}
+
+/* Words are assembled little-endian from the bytes, whatever the host */
+static void put_words(FILE *out, const uint8 *p, size_t len, int wordsize,
+                      int *col) {
+    static const char hex[] = "0123456789abcdef";
+    char line[512];
+    int n = 0, i;
+
+    for(; len; len -= wordsize, p += wordsize) {
+        line[n++] = *col ? ' ' : '\t';
+        line[n++] = '0';
+        line[n++] = 'x';
+
+        for(i = wordsize - 1; i >= 0; i--) {
+            line[n++] = hex[p[i] >> 4];
+            line[n++] = hex[p[i] & 15];
+        }
+
+        if(wordsize == 8) {
+            line[n++] = 'U';
+            line[n++] = 'L';
+            line[n++] = 'L';
+        }
+
+        line[n++] = ',';
+
+        if(++*col == 64 / wordsize) {
+            line[n++] = '\n';
+            *col = 0;
+        }
+
+        if(n > (int)sizeof(line) - 32) {
+            fwrite(line, 1, n, out);
+            n = 0;
+        }
+    }
+
+    fwrite(line, 1, n, out);
+}
+
+static int write_c(FILE *in, FILE *out, const char *outfile, const char *name,
+                   int format) {
+    struct stat st;
+    unsigned long long total = 0;
+    size_t len, have = 0;
+    int col = 0, wordsize = 0;
+
+    write_guard(out, outfile, 0);
+
+    switch(format) {
+        case FMT_STRING:
+            /* room for the literal's NUL too, or C++ won't have it */
+            if(!fstat(fileno(in), &st) && S_ISREG(st.st_mode))
+                fprintf(out, "const unsigned char %s_data[%lld] =\n",
+                        name, (long long)st.st_size + 1);
+            else
+                fprintf(out, "const unsigned char %s_data[] =\n", name);
+
+            break;
+        case FMT_BYTES:
+            fprintf(out, "const unsigned char %s_data[] = {\n", name);
+            break;
+        case FMT_WORDS32:
+        case FMT_WORDS64:
+            wordsize = format == FMT_WORDS32 ? 4 : 8;
+            fprintf(out, "const %s %s_words[] = {\n",
+                    wordsize == 4 ? "unsigned int" : "unsigned long long", name);
+            break;
+    }
+
+    while((len = fread(inbuf + have, 1, sizeof(inbuf) - have, in)) > 0) {
+        total += len;
+        len += have;
+        have = 0;
+
+        switch(format) {
+            case FMT_STRING:
+                put_string(out, inbuf, len, &col);
+                break;
+            case FMT_BYTES:
+                put_bytes(out, inbuf, len, &col);
+                break;
+            default:
+                /* hold back a partial word for the next chunk */
+                have = len % wordsize;
+                put_words(out, inbuf, len - have, wordsize, &col);
+                memmove(inbuf, inbuf + len - have, have);
+                break;
+        }
+    }
+
+    if(ferror(in)) {
+        perror("read");
+        return -1;
+    }
+
+    if(have) {
+        memset(inbuf + have, 0, wordsize - have);
+        put_words(out, inbuf, wordsize, wordsize, &col);
+    }
+
+    switch(format) {
+        case FMT_STRING:
+            if(col)
+                fputs("\"", out);
+            else if(!total)
+                fputs("    \"\"", out);
+
+            fputs(";\n", out);
+            break;
+        case FMT_BYTES:
+        case FMT_WORDS32:
+        case FMT_WORDS64:
+            /* an empty initializer list isn't C */
+            if(!total)
+                fputs("\t0,", out);
+
+            fputs(col ? "\n};\n" : "};\n", out);
+            break;
+    }
+
+    if(wordsize)
+        fprintf(out, "#define %s_data ((const unsigned char *)%s_words)\n",
+                name, name);
+
+    fprintf(out, "const int %s_size = %llu;\n", name, total);
+    write_guard(out, outfile, 1);
+    return 0;
+}
+
+/* An assembler stub pulling the file in with .incbin; the C side declares
+   extern const unsigned char <name>_data[]; extern const int <name>_size; */
+static int write_asm(FILE *out, const char *infile, const char *name,
+                     const char *prefix) {
+    const char *p;
+
+    fprintf(out, "! Generated by bin2c from %s\n\n", infile);
+    fprintf(out, "\t.section .rodata\n");
+    fprintf(out, "\t.balign 32\n");
+    fprintf(out, "\t.globl %s%s_data\n", prefix, name);
+    fprintf(out, "%s%s_data:\n", prefix, name);
+    fprintf(out, "\t.incbin \"");
+
+    for(p = infile; *p; p++) {
+        if(*p == '"' || *p == '\\')
+            fputc('\\', out);
+
+        fputc(*p, out);
+    }
+
+    fprintf(out, "\"\n");
+    fprintf(out, "%s%s_data_end:\n", prefix, name);
+    fprintf(out, "\t.balign 4\n");
+    fprintf(out, "\t.globl %s%s_size\n", prefix, name);
+    fprintf(out, "%s%s_size:\n", prefix, name);
+    fprintf(out, "\t.long %s%s_data_end - %s%s_data\n", prefix, name, prefix, name);
+    return 0;
+}
+
+/* --opt=value or -o value */
+static const char *opt_value(int argc, char **argv, int *i, const char *s,
+                             const char *l) {
+    size_t n = strlen(l);
+
+    if(!strcmp(argv[*i], s)) {
+        if(*i + 1 >= argc)
+            return NULL;
+
+        return argv[++*i];
+    }
+
+    if(!strncmp(argv[*i], l, n) && argv[*i][n] == '=')
+        return argv[*i] + n + 1;
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *infile = NULL, *outfile = NULL, *name = NULL, *v;
+    const char *prefix = "_", *pos[3];
+    FILE *in, *out;
+    int i, f, npos = 0, format = FMT_STRING, rv;
+
+    for(i = 1; i < argc; i++) {
+        if((v = opt_value(argc, argv, &i, "-i", "--input")))
+            infile = v;
+        else if((v = opt_value(argc, argv, &i, "-o", "--output")))
+            outfile = v;
+        else if((v = opt_value(argc, argv, &i, "-n", "--name")))
+            name = v;
+        else if((v = opt_value(argc, argv, &i, "-p", "--prefix")))
+            prefix = v;
+        else if((v = opt_value(argc, argv, &i, "-f", "--format"))) {
+            for(f = 0; f <= FMT_ASM; f++) {
+                if(!strcmp(v, format_names[f]))
+                    break;
+            }
+
+            if(f > FMT_ASM) {
+                fprintf(stderr, "unknown format %s\n", v);
+                return 1;
+            }
+
+            format = f;
+        }
+        else if(!strcmp(argv[i], "-s") || !strcmp(argv[i], "--asm"))
+            format = FMT_ASM;
+        else if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage();
+            return 0;
+        }
+        else if((argv[i][0] != '-' || !argv[i][1]) && npos < 3)
+            pos[npos++] = argv[i];
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    if(npos == 3 && !infile && !outfile && !name) {
+        infile = pos[0];
+        outfile = pos[1];
+        name = pos[2];
+    }
+    else if(npos) {
+        usage();
+        return 1;
+    }
+
+    if(!infile || !outfile || !name) {
+        usage();
+        return 1;
+    }
+
+    if(format == FMT_ASM) {
+        if(!strcmp(infile, "-")) {
+            fprintf(stderr, ".incbin needs a file, not standard input\n");
+            return 1;
+        }
+
+        /* make sure there is something for the assembler to find */
+        if(!(in = fopen(infile, "rb"))) {
+            perror(infile);
+            return 1;
+        }
+
+        fclose(in);
+        in = NULL;
+    }
+    else if(!strcmp(infile, "-"))
+        in = stdin;
+    else if(!(in = fopen(infile, "rb"))) {
+        perror(infile);
+        return 1;
+    }
+
+    if(!(out = fopen(outfile, "w"))) {
+        perror(outfile);
+        return 1;
+    }
+
+    setvbuf(out, outbuf, _IOFBF, sizeof(outbuf));
+
+    if(format == FMT_ASM)
+        rv = write_asm(out, infile, name, prefix);
+    else
+        rv = write_c(in, out, outfile, name, format);
+
+    if(in && in != stdin)
+        fclose(in);
+
+    if(fclose(out) || rv < 0) {
+        if(rv == 0)
+            perror(outfile);
+
+        remove(outfile);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,391 @@
+/* KallistiOS ##version##
+
+   bin2elf.c
+
+   Writes binary blobs straight into an elf32-shl relocatable object, the
+   same thing utils/bin2o/bin2o produces with as + ld + objcopy. Each blob
+   lands in a read-only .rodata section between the symbols _<sym> and
+   _<sym>_end. Batch mode packs any number of blobs into one object so a
+   whole asset directory costs a single process launch.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define uint8 unsigned char
+#define uint16 unsigned short
+#define uint32 unsigned int
+
+/* ELF constants for an SH little-endian relocatable object */
+#define ET_REL      1
+#define EM_SH       42
+#define SHT_PROGBITS    1
+#define SHT_SYMTAB  2
+#define SHT_STRTAB  3
+#define SHF_ALLOC   2
+#define STB_LOCAL   0
+#define STB_GLOBAL  1
+#define STT_NOTYPE  0
+#define STT_SECTION 3
+#define ELF32_ST_INFO(b, t) (((b) << 4) + ((t) & 0x0f))
+
+#define EHDR_SIZE   52
+#define SHDR_SIZE   40
+#define SYM_SIZE    16
+
+/* Section indices in the output object */
+enum { SEC_NULL, SEC_RODATA, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB, SEC_COUNT };
+
+static const char shstrtab[] = "\0.rodata\0.symtab\0.strtab\0.shstrtab";
+#define SHSTR_RODATA    1
+#define SHSTR_SYMTAB    9
+#define SHSTR_STRTAB    17
+#define SHSTR_SHSTRTAB  25
+
+typedef struct {
+    char    *file;
+    char    *sym;
+    uint32  offset;     /* Offset within .rodata */
+    uint32  size;
+    uint32  name;       /* _sym in the string table; _sym_end follows it */
+} blob_t;
+
+static blob_t *blobs;
+static int blob_cnt, blob_max;
+
+static void usage() {
+    printf("bin2elf - writes binary files into an elf32-shl object\n");
+    printf("usage: bin2elf [-a <align>] <input file> <symbol> <output file>\n");
+    printf("       bin2elf [-a <align>] -b <list file> <output file>\n\n");
+    printf("  -a <align>   alignment of each blob in bytes (default 4)\n");
+    printf("  -b <list>    batch mode; each line of <list> is \"<input file> <symbol>\"\n");
+}
+
+static void add_blob(const char *file, const char *sym) {
+    if(blob_cnt == blob_max) {
+        blob_max = blob_max ? blob_max * 2 : 64;
+        blobs = realloc(blobs, blob_max * sizeof(blob_t));
+
+        if(!blobs) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    blobs[blob_cnt].file = strdup(file);
+    blobs[blob_cnt].sym = strdup(sym);
+    blob_cnt++;
+}
+
+static int read_list(const char *listfile) {
+    FILE *f;
+    char line[4096], file[4096], sym[1024];
+    int lineno = 0;
+
+    if(!strcmp(listfile, "-"))
+        f = stdin;
+    else if(!(f = fopen(listfile, "r"))) {
+        perror(listfile);
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        lineno++;
+
+        if(line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        if(sscanf(line, "%4095s %1023s", file, sym) != 2) {
+            fprintf(stderr, "%s:%d: expected \"<input file> <symbol>\"\n", listfile, lineno);
+            return -1;
+        }
+
+        add_blob(file, sym);
+    }
+
+    if(f != stdin)
+        fclose(f);
+
+    return 0;
+}
+
+static void put16(uint8 *p, uint16 v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(uint8 *p, uint32 v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static int pad(FILE *f, uint32 cnt) {
+    static const uint8 zeros[64];
+    uint32 n;
+
+    while(cnt) {
+        n = cnt < sizeof(zeros) ? cnt : sizeof(zeros);
+
+        if(fwrite(zeros, 1, n, f) != n)
+            return -1;
+
+        cnt -= n;
+    }
+
+    return 0;
+}
+
+static void put_shdr(uint8 *p, uint32 name, uint32 type, uint32 flags, uint32 offset,
+                     uint32 size, uint32 link, uint32 info, uint32 align, uint32 entsize) {
+    put32(p + 0, name);
+    put32(p + 4, type);
+    put32(p + 8, flags);
+    put32(p + 12, 0);
+    put32(p + 16, offset);
+    put32(p + 20, size);
+    put32(p + 24, link);
+    put32(p + 28, info);
+    put32(p + 32, align);
+    put32(p + 36, entsize);
+}
+
+static void put_sym(uint8 *p, uint32 name, uint32 value, uint8 info, uint16 shndx) {
+    put32(p + 0, name);
+    put32(p + 4, value);
+    put32(p + 8, 0);
+    p[12] = info;
+    p[13] = 0;
+    put16(p + 14, shndx);
+}
+
+/* Copy one input file into the object, checking it hasn't changed size */
+static int copy_blob(FILE *out, blob_t *b) {
+    static uint8 buf[65536];
+    FILE *f;
+    size_t n;
+    uint32 total = 0;
+
+    if(!(f = fopen(b->file, "rb"))) {
+        perror(b->file);
+        return -1;
+    }
+
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        if(fwrite(buf, 1, n, out) != n) {
+            perror("write");
+            fclose(f);
+            return -1;
+        }
+
+        total += n;
+    }
+
+    fclose(f);
+
+    if(total != b->size) {
+        fprintf(stderr, "%s changed size while being read\n", b->file);
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32 align_up(uint32 v, uint32 a) {
+    return (v + a - 1) & ~(a - 1);
+}
+
+static int write_object(const char *outfile, uint32 align) {
+    FILE *f;
+    uint8 hdr[EHDR_SIZE], shdrs[SEC_COUNT * SHDR_SIZE], *strtab, *symtab;
+    uint32 rodata_off, rodata_size, shstr_off, sym_off, sym_size, str_off, str_size, sh_off;
+    uint32 pos;
+    int i, nsyms;
+
+    /* Lay out the blobs and the string table */
+    rodata_size = 0;
+    str_size = 1;
+
+    for(i = 0; i < blob_cnt; i++) {
+        FILE *in = fopen(blobs[i].file, "rb");
+
+        if(!in) {
+            perror(blobs[i].file);
+            return -1;
+        }
+
+        fseek(in, 0, SEEK_END);
+        blobs[i].size = ftell(in);
+        fclose(in);
+
+        rodata_size = align_up(rodata_size, align);
+        blobs[i].offset = rodata_size;
+        rodata_size += blobs[i].size;
+
+        /* "_sym\0_sym_end\0" */
+        blobs[i].name = str_size;
+        str_size += 2 * strlen(blobs[i].sym) + 8;
+    }
+
+    strtab = calloc(1, str_size);
+    nsyms = 2 + 2 * blob_cnt;
+    symtab = calloc(nsyms, SYM_SIZE);
+
+    if(!strtab || !symtab) {
+        perror("calloc");
+        return -1;
+    }
+
+    /* Null symbol, then the .rodata section symbol, then the globals */
+    put_sym(symtab + SYM_SIZE, 0, 0, ELF32_ST_INFO(STB_LOCAL, STT_SECTION), SEC_RODATA);
+
+    for(i = 0; i < blob_cnt; i++) {
+        char *s = (char *)strtab + blobs[i].name;
+        uint32 end_name = blobs[i].name + strlen(blobs[i].sym) + 2;
+
+        sprintf(s, "_%s", blobs[i].sym);
+        sprintf(s + strlen(s) + 1, "_%s_end", blobs[i].sym);
+
+        put_sym(symtab + (2 + 2 * i) * SYM_SIZE, blobs[i].name, blobs[i].offset,
+                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), SEC_RODATA);
+        put_sym(symtab + (3 + 2 * i) * SYM_SIZE, end_name, blobs[i].offset + blobs[i].size,
+                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), SEC_RODATA);
+    }
+
+    /* File layout: header, .rodata, .shstrtab, .symtab, .strtab, section headers */
+    rodata_off = align_up(EHDR_SIZE, align);
+    shstr_off = rodata_off + rodata_size;
+    sym_off = align_up(shstr_off + sizeof(shstrtab), 4);
+    sym_size = nsyms * SYM_SIZE;
+    str_off = sym_off + sym_size;
+    sh_off = align_up(str_off + str_size, 4);
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "\177ELF", 4);
+    hdr[4] = 1;             /* ELFCLASS32 */
+    hdr[5] = 1;             /* ELFDATA2LSB */
+    hdr[6] = 1;             /* EV_CURRENT */
+    put16(hdr + 16, ET_REL);
+    put16(hdr + 18, EM_SH);
+    put32(hdr + 20, 1);
+    put32(hdr + 32, sh_off);
+    put32(hdr + 36, 0);     /* No ISA flags; the object holds no code */
+    put16(hdr + 40, EHDR_SIZE);
+    put16(hdr + 46, SHDR_SIZE);
+    put16(hdr + 48, SEC_COUNT);
+    put16(hdr + 50, SEC_SHSTRTAB);
+
+    memset(shdrs, 0, sizeof(shdrs));
+    put_shdr(shdrs + SEC_RODATA * SHDR_SIZE, SHSTR_RODATA, SHT_PROGBITS, SHF_ALLOC,
+             rodata_off, rodata_size, 0, 0, align, 0);
+    put_shdr(shdrs + SEC_SYMTAB * SHDR_SIZE, SHSTR_SYMTAB, SHT_SYMTAB, 0,
+             sym_off, sym_size, SEC_STRTAB, 2, 4, SYM_SIZE);
+    put_shdr(shdrs + SEC_STRTAB * SHDR_SIZE, SHSTR_STRTAB, SHT_STRTAB, 0,
+             str_off, str_size, 0, 0, 1, 0);
+    put_shdr(shdrs + SEC_SHSTRTAB * SHDR_SIZE, SHSTR_SHSTRTAB, SHT_STRTAB, 0,
+             shstr_off, sizeof(shstrtab), 0, 0, 1, 0);
+
+    if(!(f = fopen(outfile, "wb"))) {
+        perror(outfile);
+        return -1;
+    }
+
+    if(fwrite(hdr, 1, EHDR_SIZE, f) != EHDR_SIZE)
+        goto write_error;
+
+    pos = EHDR_SIZE;
+
+    for(i = 0; i < blob_cnt; i++) {
+        uint32 start = rodata_off + blobs[i].offset;
+
+        if(pad(f, start - pos) < 0 || copy_blob(f, blobs + i) < 0)
+            goto error;
+
+        pos = start + blobs[i].size;
+    }
+
+    if(pad(f, shstr_off - pos) < 0
+            || fwrite(shstrtab, 1, sizeof(shstrtab), f) != sizeof(shstrtab)
+            || pad(f, sym_off - shstr_off - sizeof(shstrtab)) < 0
+            || fwrite(symtab, 1, sym_size, f) != sym_size
+            || fwrite(strtab, 1, str_size, f) != str_size
+            || pad(f, sh_off - str_off - str_size) < 0
+            || fwrite(shdrs, 1, sizeof(shdrs), f) != sizeof(shdrs))
+        goto write_error;
+
+    if(fclose(f)) {
+        perror(outfile);
+        unlink(outfile);
+        return -1;
+    }
+
+    free(strtab);
+    free(symtab);
+    return 0;
+
+write_error:
+    perror(outfile);
+error:
+    fclose(f);
+    unlink(outfile);
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    const char *listfile = NULL;
+    uint32 align = 4;
+    int opt;
+
+    while((opt = getopt(argc, argv, "a:b:h")) != -1) {
+        switch(opt) {
+            case 'a':
+                align = strtoul(optarg, NULL, 0);
+
+                if(!align || (align & (align - 1))) {
+                    fprintf(stderr, "alignment must be a power of two\n");
+                    return 1;
+                }
+
+                break;
+            case 'b':
+                listfile = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(listfile) {
+        if(argc != 1) {
+            usage();
+            return 1;
+        }
+
+        if(read_list(listfile) < 0)
+            return 1;
+    }
+    else {
+        if(argc != 3) {
+            usage();
+            return 1;
+        }
+
+        add_blob(argv[0], argv[1]);
+        argv += 2;
+    }
+
+    if(!blob_cnt) {
+        fprintf(stderr, "nothing to do\n");
+        return 1;
+    }
+
+    return write_object(argv[0], align) < 0 ? 1 : 0;
+}
@@ -7,15 +7,23 @@
    exact functional duplicate of the routine in process/elf.c and is
    used for testing new changes first.
 
+   With -p it instead packs a relocatable module (ld -r output) into a
+   KLM file: the image, plus relocations that are already sorted, grouped
+   by type and resolved against the kernel's export lists, so the loader
+   makes one linear pass over them and never compares a string. -l does
+   that pass here, so a packed module can be checked against ld.
+
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 
 #define uint8 unsigned char
 #define uint16 unsigned short
-#define uint32 unsigned long
-#define int32 long
+#define uint32 unsigned int
+#define int32 int
 
 /* ELF file header */
 struct elf_hdr_t {
@@ -121,11 +129,12 @@ struct elf_rela_t {
 #define ELF32_R_SYM(i) ((i) >> 8)
 #define ELF32_R_TYPE(i) ((uint8)(i))
 
-int find_sym(char *name, struct elf_sym_t* table, int tablelen) {
+int find_sym(char *name, struct elf_sym_t* table, int tablelen,
+             char *stringtab) {
     int i;
 
     for(i = 0; i < tablelen; i++) {
-        if(!strcmp((char*)table[i].name, name))
+        if(!strcmp(stringtab + table[i].name, name))
             return i;
     }
 
@@ -156,7 +165,7 @@ void *elf_load(FILE *f, uint32 vma, int* outsz) {
     /* Header is at the front */
     hdr = (struct elf_hdr_t *)(img + 0);
 
-    if(hdr->ident[0] != 0x7f || strncmp(hdr->ident + 1, "ELF", 3)) {
+    if(hdr->ident[0] != 0x7f || strncmp((char *)hdr->ident + 1, "ELF", 3)) {
         printf("File is not a valid ELF file\n");
         return NULL;
     }
@@ -220,11 +229,9 @@ void *elf_load(FILE *f, uint32 vma, int* outsz) {
     symtab = (struct elf_sym_t *)(img + symtabhdr->offset);
     symtabsize = symtabhdr->size / sizeof(struct elf_sym_t);
 
-    /* Relocate symtab entries for quick access */
     for(i = 0; i < symtabsize; i++) {
-        symtab[i].name = (uint32)(stringtab + symtab[i].name);
         printf("SYM: %s / %08x / %08x / %d\r\n",
-               (char*)symtab[i].name, symtab[i].value,
+               stringtab + symtab[i].name, symtab[i].value,
                symtab[i].size, symtab[i].shndx);
     }
 
@@ -320,21 +327,21 @@ void *elf_load(FILE *f, uint32 vma, int* outsz) {
     {
         int mainsym, getsvcsym, notifysym;
 
-        mainsym = find_sym("_ko_main", symtab, symtabsize);
+        mainsym = find_sym("_ko_main", symtab, symtabsize, stringtab);
 
         if(mainsym < 0) {
             printf("ELF contains no _ko_main\n");
             return NULL;
         }
 
-        getsvcsym = find_sym("_ko_get_svc", symtab, symtabsize);
+        getsvcsym = find_sym("_ko_get_svc", symtab, symtabsize, stringtab);
 
         if(mainsym < 0) {
             printf("ELF contains no _ko_get_svc\n");
             return NULL;
         }
 
-        notifysym = find_sym("_ko_notify", symtab, symtabsize);
+        notifysym = find_sym("_ko_notify", symtab, symtabsize, stringtab);
 
         if(notifysym < 0) {
             printf("ELF contains no _ko_notify\n");
@@ -355,22 +362,649 @@ void *elf_load(FILE *f, uint32 vma, int* outsz) {
     return (void*)imgout;
 }
 
-void main(int argc, char **argv) {
+/* Module packing */
+
+/* Special section indices */
+#define SHN_UNDEF   0
+#define SHN_ABS     0xfff1
+#define SHN_COMMON  0xfff2
+
+#define ET_REL      1       /* Relocatable file */
+
+/* Machines, and the relocations of theirs that a module may need. The
+   x86-64 ones are there for x32 (ELF32) objects, so that a packed module
+   can be checked against the host's ld. */
+#define EM_SH       0x2a
+#define EM_X86_64   0x3e
+#define R_SH_REL32      2
+#define R_X86_64_PC32   2
+#define R_X86_64_PLT32  4
+#define R_X86_64_32     10
+#define R_X86_64_32S    11
+
+/* KLM file layout: a header, then nimports imports, ngroups groups,
+   nrelocs relocations and finally filesize bytes of image, all little
+   endian. The relocations are sorted by type and then offset; each group
+   says how many of the next ones have its type. */
+#define KLM_MAGIC   0x314d4c4b  /* "KLM1" */
+#define KLM_NONE    0xffffffff
+
+struct klm_hdr_t {
+    uint32      magic;
+    uint32      imagesize;  /* Bytes the module takes once loaded */
+    uint32      filesize;   /* Bytes of it in the file; the rest is zero */
+    uint32      align;      /* Alignment the load address needs */
+    uint32      entry;      /* Offset of the entry point, or KLM_NONE */
+    uint32      nimports;
+    uint32      ngroups;
+    uint32      nrelocs;
+};
+
+/* Where an import lives: the index in the table made by genexports from
+   the table'th export list, which is sorted by name */
+struct klm_import_t {
+    uint16      table;
+    uint16      index;
+};
+
+#define KLM_R_ABS32 1       /* P += S + A */
+#define KLM_R_REL32 2       /* P += S + A - P */
+
+struct klm_group_t {
+    uint32      type;       /* KLM_R_* */
+    uint32      count;
+};
+
+struct klm_reloc_t {
+    uint32      offset;     /* Offset within the image */
+    uint32      sym;        /* 0 for the load address, else import + 1 */
+    int32       addend;
+};
+
+#define KLM_MAX_TABLES  8
+
+/* An export list, as given to genexports */
+struct exports_t {
+    char        *text;
+    char        **names;
+    int         count;
+    int         *import;    /* Import index for each name, or -1 */
+};
+
+/* Unaligned little endian access; x86 relocations needn't be aligned */
+static uint32 rd32(const uint8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+static void wr32(uint8 *p, uint32 v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void *read_file(const char *fn, int *outsz) {
+    FILE *f;
+    char *buf;
+    long sz;
+
+    if(!(f = fopen(fn, "rb"))) {
+        perror(fn);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(sz + 1);
+
+    if(!buf || fread(buf, 1, sz, f) != (size_t)sz) {
+        fprintf(stderr, "%s: can't read\n", fn);
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+
+    buf[sz] = 0;
+    fclose(f);
+    *outsz = sz;
+    return buf;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Reads an export list the way genexports.sh does: every word that isn't
+   on a # line, sorted in strcmp order, so that the position of a name
+   here is its index in the generated table */
+static int read_exports(const char *fn, struct exports_t *ex) {
+    char *line, *next, *word;
+    int sz, alloc = 256;
+
+    if(!(ex->text = read_file(fn, &sz)))
+        return -1;
+
+    ex->names = malloc(alloc * sizeof(char *));
+    ex->count = 0;
+
+    for(line = ex->text; *line; line = next) {
+        if((next = strchr(line, '\n')))
+            *next++ = 0;
+        else
+            next = line + strlen(line);
+
+        if(*line == '#')
+            continue;
+
+        for(word = strtok(line, " \t\r"); word; word = strtok(NULL, " \t\r")) {
+            if(ex->count == alloc) {
+                alloc *= 2;
+                ex->names = realloc(ex->names, alloc * sizeof(char *));
+            }
+
+            ex->names[ex->count++] = word;
+        }
+    }
+
+    qsort(ex->names, ex->count, sizeof(char *), cmp_name);
+
+    if(ex->count > 65535) {
+        fprintf(stderr, "%s: too many exports\n", fn);
+        return -1;
+    }
+
+    ex->import = malloc((ex->count + 1) * sizeof(int));
+    memset(ex->import, 0xff, (ex->count + 1) * sizeof(int));
+    return 0;
+}
+
+static int reloc_kind(int machine, int type) {
+    if(machine == EM_SH) {
+        if(type == R_SH_DIR32)
+            return KLM_R_ABS32;
+        else if(type == R_SH_REL32)
+            return KLM_R_REL32;
+    }
+    else if(machine == EM_X86_64) {
+        if(type == R_X86_64_32 || type == R_X86_64_32S)
+            return KLM_R_ABS32;
+        else if(type == R_X86_64_PC32 || type == R_X86_64_PLT32)
+            return KLM_R_REL32;
+    }
+
+    return -1;
+}
+
+static int cmp_reloc(const void *a, const void *b) {
+    const struct klm_reloc_t *ra = a, *rb = b;
+
+    /* the type was parked in the top of sym while sorting */
+    if((ra->sym >> 24) != (rb->sym >> 24))
+        return (ra->sym >> 24) < (rb->sym >> 24) ? -1 : 1;
+
+    if(ra->offset != rb->offset)
+        return ra->offset < rb->offset ? -1 : 1;
+
+    return 0;
+}
+
+/* Packs the relocatable module in fn into a KLM file. Relocations within
+   the module are done here, except for the load address: absolute ones
+   become load address plus a constant, PC relative ones are finished.
+   Undefined symbols, less the compiler's prefix, must be in one of the
+   export lists. */
+int klm_pack(const char *fn, const char *outfn, const char *entry,
+             const char *prefix, struct exports_t *ex, int ntables) {
+    uint8               *img, *image;
+    struct elf_hdr_t    *hdr;
+    struct elf_shdr_t   *shdrs;
+    struct elf_sym_t    *symtab = NULL, *sym;
+    struct elf_rela_t   *rela;
+    char                *stringtab = NULL, *name;
+    struct klm_hdr_t    khdr;
+    struct klm_import_t *imports;
+    struct klm_group_t  groups[4];
+    struct klm_reloc_t  *relocs;
+    int                 sz, i, j, t, n, kind, nrelocs = 0, relalloc = 1024;
+    int                 nimports = 0, impalloc = 64, symtabsize = 0;
+    uint32              addr, align = 4, filesize = 0, s, p;
+    FILE                *f;
+
+    if(!(img = read_file(fn, &sz)))
+        return -1;
+
+    hdr = (struct elf_hdr_t *)img;
+
+    if(sz < (int)sizeof(*hdr) || hdr->ident[0] != 0x7f
+            || strncmp((char *)hdr->ident + 1, "ELF", 3)
+            || hdr->ident[4] != 1 || hdr->ident[5] != 1) {
+        fprintf(stderr, "%s: not a 32-bit little endian ELF file\n", fn);
+        return -1;
+    }
+
+    if(hdr->type != ET_REL) {
+        fprintf(stderr, "%s: not a relocatable file (link it with -r)\n", fn);
+        return -1;
+    }
+
+    if(hdr->machine != EM_SH && hdr->machine != EM_X86_64) {
+        fprintf(stderr, "%s: unsupported machine %02x\n", fn, hdr->machine);
+        return -1;
+    }
+
+    shdrs = (struct elf_shdr_t *)(img + hdr->shoff);
+
+    /* Lay out the resident sections, in file order */
+    addr = 0;
+
+    for(i = 0; i < hdr->shnum; i++) {
+        if(!(shdrs[i].flags & SHF_ALLOC))
+            continue;
+
+        if(shdrs[i].addralign > align)
+            align = shdrs[i].addralign;
+
+        if(shdrs[i].addralign > 1)
+            addr = (addr + shdrs[i].addralign - 1) & ~(shdrs[i].addralign - 1);
+
+        shdrs[i].addr = addr;
+        addr += shdrs[i].size;
+
+        if(shdrs[i].type != SHT_NOBITS)
+            filesize = addr;
+    }
+
+    image = calloc(addr + 1, 1);
+
+    for(i = 0; i < hdr->shnum; i++) {
+        if((shdrs[i].flags & SHF_ALLOC) && shdrs[i].type != SHT_NOBITS)
+            memcpy(image + shdrs[i].addr, img + shdrs[i].offset, shdrs[i].size);
+
+        if(shdrs[i].type == SHT_SYMTAB) {
+            symtab = (struct elf_sym_t *)(img + shdrs[i].offset);
+            symtabsize = shdrs[i].size / sizeof(struct elf_sym_t);
+            stringtab = (char *)(img + shdrs[shdrs[i].link].offset);
+        }
+    }
+
+    if(!symtab) {
+        fprintf(stderr, "%s: no symbol table\n", fn);
+        return -1;
+    }
+
+    relocs = malloc(relalloc * sizeof(struct klm_reloc_t));
+    imports = malloc(impalloc * sizeof(struct klm_import_t));
+
+    for(i = 0; i < hdr->shnum; i++) {
+        if(shdrs[i].type == SHT_REL && (shdrs[shdrs[i].info].flags & SHF_ALLOC)) {
+            fprintf(stderr, "%s: REL relocations aren't supported\n", fn);
+            return -1;
+        }
+
+        if(shdrs[i].type != SHT_RELA || !(shdrs[shdrs[i].info].flags & SHF_ALLOC))
+            continue;
+
+        rela = (struct elf_rela_t *)(img + shdrs[i].offset);
+        n = shdrs[i].size / sizeof(struct elf_rela_t);
+
+        for(j = 0; j < n; j++) {
+            kind = reloc_kind(hdr->machine, ELF32_R_TYPE(rela[j].info));
+
+            if(kind < 0) {
+                fprintf(stderr, "%s: unsupported relocation type %02x\n",
+                        fn, ELF32_R_TYPE(rela[j].info));
+                return -1;
+            }
+
+            sym = symtab + ELF32_R_SYM(rela[j].info);
+            name = stringtab + sym->name;
+            p = shdrs[shdrs[i].info].addr + rela[j].offset;
+
+            if(sym->shndx == SHN_UNDEF) {
+                struct klm_reloc_t *r;
+                char **found = NULL;
+
+                /* the export lists have the names as C spells them */
+                if(strncmp(name, prefix, strlen(prefix))) {
+                    fprintf(stderr, "%s: unresolved symbol %s (no %s prefix)\n",
+                            fn, name, prefix);
+                    return -1;
+                }
+
+                name += strlen(prefix);
+
+                for(t = 0; t < ntables; t++) {
+                    found = bsearch(&name, ex[t].names, ex[t].count,
+                                    sizeof(char *), cmp_name);
+
+                    if(found)
+                        break;
+                }
+
+                if(!found) {
+                    fprintf(stderr, "%s: unresolved symbol %s\n", fn, name);
+                    return -1;
+                }
+
+                s = found - ex[t].names;
+
+                if(ex[t].import[s] < 0) {
+                    if(nimports == impalloc) {
+                        impalloc *= 2;
+                        imports = realloc(imports,
+                                          impalloc * sizeof(struct klm_import_t));
+                    }
+
+                    imports[nimports].table = t;
+                    imports[nimports].index = s;
+                    ex[t].import[s] = nimports++;
+                }
+
+                if(nrelocs == relalloc) {
+                    relalloc *= 2;
+                    relocs = realloc(relocs, relalloc * sizeof(struct klm_reloc_t));
+                }
+
+                r = relocs + nrelocs++;
+                r->offset = p;
+                r->sym = (kind << 24) | (ex[t].import[s] + 1);
+                r->addend = rela[j].addend;
+            }
+            else if(sym->shndx == SHN_COMMON) {
+                fprintf(stderr, "%s: common symbol %s (use -fno-common or "
+                        "ld -d)\n", fn, name);
+                return -1;
+            }
+            else if(sym->shndx == SHN_ABS && kind == KLM_R_ABS32) {
+                wr32(image + p, rd32(image + p) + sym->value + rela[j].addend);
+            }
+            else if(sym->shndx < hdr->shnum
+                    && (shdrs[sym->shndx].flags & SHF_ALLOC)) {
+                s = shdrs[sym->shndx].addr + sym->value;
+
+                if(kind == KLM_R_REL32) {
+                    /* the distance doesn't depend on where it loads */
+                    wr32(image + p, rd32(image + p) + s + rela[j].addend - p);
+                }
+                else {
+                    if(nrelocs == relalloc) {
+                        relalloc *= 2;
+                        relocs = realloc(relocs,
+                                         relalloc * sizeof(struct klm_reloc_t));
+                    }
+
+                    relocs[nrelocs].offset = p;
+                    relocs[nrelocs].sym = kind << 24;
+                    relocs[nrelocs].addend = s + rela[j].addend;
+                    nrelocs++;
+                }
+            }
+            else {
+                fprintf(stderr, "%s: can't relocate against %s\n", fn, name);
+                return -1;
+            }
+        }
+    }
+
+    /* Sort by type, then offset, and count the groups */
+    qsort(relocs, nrelocs, sizeof(struct klm_reloc_t), cmp_reloc);
+    n = 0;
+
+    for(j = 0; j < nrelocs; j++) {
+        kind = relocs[j].sym >> 24;
+        relocs[j].sym &= 0xffffff;
+
+        if(!n || groups[n - 1].type != (uint32)kind) {
+            groups[n].type = kind;
+            groups[n++].count = 0;
+        }
+
+        groups[n - 1].count++;
+    }
+
+    khdr.magic = KLM_MAGIC;
+    khdr.imagesize = addr;
+    khdr.filesize = filesize;
+    khdr.align = align;
+    khdr.entry = KLM_NONE;
+    khdr.nimports = nimports;
+    khdr.ngroups = n;
+    khdr.nrelocs = nrelocs;
+
+    for(i = 0; entry && i < symtabsize; i++) {
+        if(symtab[i].shndx != SHN_UNDEF && symtab[i].shndx < hdr->shnum
+                && (shdrs[symtab[i].shndx].flags & SHF_ALLOC)
+                && !strcmp(stringtab + symtab[i].name, entry)) {
+            khdr.entry = shdrs[symtab[i].shndx].addr + symtab[i].value;
+            break;
+        }
+    }
+
+    if(!(f = fopen(outfn, "wb"))) {
+        perror(outfn);
+        return -1;
+    }
+
+    fwrite(&khdr, sizeof(khdr), 1, f);
+    fwrite(imports, sizeof(struct klm_import_t), nimports, f);
+    fwrite(groups, sizeof(struct klm_group_t), n, f);
+    fwrite(relocs, sizeof(struct klm_reloc_t), nrelocs, f);
+    fwrite(image, 1, filesize, f);
+
+    if(fclose(f)) {
+        perror(outfn);
+        remove(outfn);
+        return -1;
+    }
+
+    printf("%s: %d bytes (%d in file), %d imports, %d relocations in %d "
+           "groups\n", outfn, addr, filesize, nimports, nrelocs, n);
+
+    free(relocs);
+    free(imports);
+    free(image);
+    free(img);
+    return 0;
+}
+
+/* Applies a KLM file's relocations to its image, loaded at vma, with
+   impaddr[] holding the address of each of its imports: the whole job of
+   the loader once the imports are looked up by index */
+void klm_relocate(uint8 *image, uint32 vma, const struct klm_hdr_t *hdr,
+                  const struct klm_group_t *groups,
+                  const struct klm_reloc_t *r, const uint32 *impaddr) {
+    const struct klm_reloc_t *end;
+    uint32 g;
+    uint8 *p;
+
+    for(g = 0; g < hdr->ngroups; g++) {
+        end = r + groups[g].count;
+
+        switch(groups[g].type) {
+            case KLM_R_ABS32:
+                for(; r < end; r++) {
+                    p = image + r->offset;
+                    wr32(p, rd32(p) + (r->sym ? impaddr[r->sym - 1] : vma)
+                         + r->addend);
+                }
+
+                break;
+            case KLM_R_REL32:
+                for(; r < end; r++) {
+                    p = image + r->offset;
+                    wr32(p, rd32(p) + impaddr[r->sym - 1] + r->addend
+                         - (vma + r->offset));
+                }
+
+                break;
+        }
+    }
+}
+
+/* Loads a KLM file at vma the way the target would and writes the image
+   out, taking the kernel's symbol addresses from nm output */
+int klm_load(const char *fn, const char *outfn, uint32 vma, const char *mapfn,
+             const char *prefix, struct exports_t *ex, int ntables) {
+    uint8               *buf, *image;
+    char                *map, *line, *name;
+    struct klm_hdr_t    *hdr;
+    struct klm_import_t *imports;
+    struct klm_group_t  *groups;
+    struct klm_reloc_t  *relocs;
+    uint32              *impaddr, i, *addrs[KLM_MAX_TABLES];
+    unsigned long       val;
+    char                **found;
+    int                 sz, t, mapsz;
+    FILE                *f;
+
+    if(!(buf = read_file(fn, &sz)) || !(map = read_file(mapfn, &mapsz)))
+        return -1;
+
+    hdr = (struct klm_hdr_t *)buf;
+
+    if(sz < (int)sizeof(*hdr) || hdr->magic != KLM_MAGIC) {
+        fprintf(stderr, "%s: not a KLM file\n", fn);
+        return -1;
+    }
+
+    imports = (struct klm_import_t *)(hdr + 1);
+    groups = (struct klm_group_t *)(imports + hdr->nimports);
+    relocs = (struct klm_reloc_t *)(groups + hdr->ngroups);
+
+    /* "address type name" lines, as nm prints them */
+    for(t = 0; t < ntables; t++)
+        addrs[t] = calloc(ex[t].count + 1, sizeof(uint32));
+
+    for(line = strtok(map, "\n"); line; line = strtok(NULL, "\n")) {
+        char type, sym[256];
+
+        if(sscanf(line, "%lx %c %255s", &val, &type, sym) != 3
+                || strncmp(sym, prefix, strlen(prefix)))
+            continue;
+
+        name = sym + strlen(prefix);
+
+        for(t = 0; t < ntables; t++) {
+            if((found = bsearch(&name, ex[t].names, ex[t].count,
+                                sizeof(char *), cmp_name)))
+                addrs[t][found - ex[t].names] = val;
+        }
+    }
+
+    impaddr = malloc((hdr->nimports + 1) * sizeof(uint32));
+
+    for(i = 0; i < hdr->nimports; i++) {
+        if(imports[i].table >= ntables
+                || imports[i].index >= ex[imports[i].table].count) {
+            fprintf(stderr, "%s: import %u is out of range\n", fn, i);
+            return -1;
+        }
+
+        impaddr[i] = addrs[imports[i].table][imports[i].index];
+    }
+
+    image = calloc(hdr->imagesize + 1, 1);
+    memcpy(image, relocs + hdr->nrelocs, hdr->filesize);
+    klm_relocate(image, vma, hdr, groups, relocs, impaddr);
+
+    if(hdr->entry != KLM_NONE)
+        printf("entry point %08x\n", vma + hdr->entry);
+
+    if(!(f = fopen(outfn, "wb"))) {
+        perror(outfn);
+        return -1;
+    }
+
+    fwrite(image, 1, hdr->imagesize, f);
+    fclose(f);
+
+    for(t = 0; t < ntables; t++)
+        free(addrs[t]);
+
+    free(impaddr);
+    free(image);
+    free(map);
+    free(buf);
+    return 0;
+}
+
+static void usage() {
+    printf("usage: bincnv <elf> <bin>\n");
+    printf("       bincnv -p [-s entry] [-x prefix] <module> <klm> <exports> [exports..]\n");
+    printf("       bincnv -l [-x prefix] <klm> <bin> <vma> <nm output> <exports> [exports..]\n\n");
+    printf("  -p  pack a relocatable module, resolving its imports against\n");
+    printf("      the export lists given to genexports, in table order\n");
+    printf("  -s  the entry point symbol (default _main)\n");
+    printf("  -x  the prefix the compiler puts on C names, dropped before\n");
+    printf("      they are looked up in the export lists (default _, as\n");
+    printf("      for sh-elf; use \"\" for targets without one)\n");
+    printf("  -l  load a KLM file at vma and write the image out, taking\n");
+    printf("      the exports' addresses from nm output for the kernel\n");
+}
+
+int main(int argc, char **argv) {
     FILE *f;
     void *out;
-    int sz;
+    int sz, i, ntables;
+    const char *entry = "_main", *prefix = "_";
+    struct exports_t ex[KLM_MAX_TABLES];
+
+    if(argc > 1 && (!strcmp(argv[1], "-p") || !strcmp(argv[1], "-l"))) {
+        for(i = 2; i + 1 < argc && argv[i][0] == '-' && argv[i][1]
+                && argv[i][2] == 0; i += 2) {
+            if(argv[i][1] == 's' && argv[1][1] == 'p')
+                entry = argv[i + 1];
+            else if(argv[i][1] == 'x')
+                prefix = argv[i + 1];
+            else {
+                usage();
+                return 1;
+            }
+        }
+
+        /* the files before the export lists */
+        i += argv[1][1] == 'p' ? 2 : 4;
+        ntables = argc - i;
+
+        if(ntables < 1 || ntables > KLM_MAX_TABLES) {
+            usage();
+            return 1;
+        }
+
+        for(sz = 0; sz < ntables; sz++) {
+            if(read_exports(argv[i + sz], ex + sz) < 0)
+                return 1;
+        }
+
+        if(argv[1][1] == 'p')
+            return klm_pack(argv[i - 2], argv[i - 1], entry, prefix, ex,
+                            ntables) < 0;
+        else
+            return klm_load(argv[i - 4], argv[i - 3],
+                            strtoul(argv[i - 2], NULL, 0), argv[i - 1], prefix,
+                            ex, ntables) < 0;
+    }
+
+    if(argc != 3) {
+        usage();
+        return 1;
+    }
 
     f = fopen(argv[1], "r");
 
     if(!f) {
         perror("Can't open input file");
-        return;
+        return 1;
     }
 
     out = elf_load(f, 0x8c010000, &sz);
 
+    if(!out)
+        return 1;
+
     f = fopen(argv[2], "w");
     fwrite(out, sz, 1, f);
     fclose(f);
+    return 0;
 }
-
@@ -0,0 +1,96 @@
+#!/bin/sh
+
+# klmtest.sh
+# Checks bincnv -p/-l against ld: builds the module in test/, packs it,
+# loads it at a fixed base and compares the image with what ld makes of
+# the same objects linked at that base against the same kernel.
+# By default this uses the host gcc with -mx32, which gives ELF32 objects
+# bincnv takes, and -fleading-underscore so the symbols get the same _
+# prefix as sh-elf's; for SH, set CC, LD, NM, OBJCOPY, CFLAGS and
+# LDEMU=shlelf, and PREFIX="" for a target without a prefix.
+
+usage() {
+	echo 'klmtest.sh [<work dir>]'
+}
+
+if [ $# -gt 1 ]; then
+	usage
+	exit 1
+fi
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=${1:-/tmp/klmtest$$}
+base=0x400000
+cc=${CC:-gcc}
+ld=${LD:-ld}
+nm=${NM:-nm}
+objcopy=${OBJCOPY:-objcopy}
+cflags=${CFLAGS:--mx32 -O1 -fno-pic -fno-common -fno-stack-protector -mcmodel=small -fleading-underscore}
+ldemu=${LDEMU:-elf32_x86_64}
+prefix=${PREFIX-_}
+bincnv=$here/bincnv
+tables="$here/test/exports.txt $here/test/arch.txt"
+
+if [ ! -x "$bincnv" ]; then
+	echo "build bincnv first"
+	exit 1
+fi
+
+mkdir -p "$work" || exit 1
+cd "$work" || exit 1
+
+if ! $cc $cflags -c "$here/test/kernel.c" -o kernel.o 2> /dev/null; then
+	echo "$cc can't build the test objects with \"$cflags\", skipped"
+	exit 0
+fi
+
+# The kernel, and its symbols as the loader gets them
+$ld -m $ldemu -static -Ttext=0x100000 -e ${prefix}_start kernel.o -o kernel.elf || exit 1
+$nm kernel.elf > kernel.map || exit 1
+
+# The module, as the build makes one
+$cc $cflags -c "$here/test/mod1.c" -o mod1.o || exit 1
+$cc $cflags -c "$here/test/mod2.c" -o mod2.o || exit 1
+$ld -m $ldemu -r mod1.o mod2.o -o mod.o || exit 1
+
+"$bincnv" -p -s "${prefix}main" -x "$prefix" mod.o mod.klm $tables > pack.log || exit 1
+"$bincnv" -l -x "$prefix" mod.klm klm.bin $base kernel.map $tables > load.log || exit 1
+
+# ld lays the allocated sections out the same way, in file order, one
+# after another at their alignment, filling the gaps with zeros
+{
+	echo "SECTIONS { . = $base; .all : {"
+	readelf -SW mod.o | sed -n -e 's/^ *\[ *[0-9]*\] //p' | \
+		awk '$7 ~ /A/ { print "  mod.o(" $1 ")" }'
+	echo "} =0 /DISCARD/ : { *(*) } }"
+} > link.ld
+
+$ld -m $ldemu -T link.ld --just-symbols=kernel.elf mod.o -o mod.elf || exit 1
+$objcopy -O binary -j .all mod.elf ld.bin || exit 1
+
+# Trailing bss is only in one of them, depending on the objcopy
+cmp_image() {
+	len=$(wc -c < "$1")
+	reflen=$(wc -c < "$2")
+
+	if [ $len -gt $reflen ]; then
+		tail -c +$((reflen + 1)) "$1" | tr -d '\000' | grep -q . && return 1
+		len=$reflen
+	fi
+
+	cmp -n $len "$1" "$2"
+}
+
+if cmp_image klm.bin ld.bin && cmp_image ld.bin klm.bin; then
+	echo "klmtest: ok, $(sed -n -e 's/^[^:]*: //p' pack.log)"
+	status=0
+else
+	echo "klmtest: the loaded image differs from ld's, see $work"
+	status=1
+fi
+
+if [ $# -eq 0 ] && [ $status -eq 0 ]; then
+	rm -rf "${work:?}"
+fi
+
+exit $status
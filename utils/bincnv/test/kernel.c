@@ -0,0 +1,26 @@
+/* KallistiOS ##version##
+
+   kernel.c
+
+   Stand-in kernel for klmtest.sh, exporting the symbols the test module
+   imports.
+
+*/
+
+int kvar = 5;
+int ktab[16];
+
+int kfunc(int a) {
+    return a + kvar;
+}
+
+void kput(const char *s) {
+    (void)s;
+}
+
+int kother(void) {
+    return 3;
+}
+
+void _start(void) {
+}
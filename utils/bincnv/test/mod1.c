@@ -0,0 +1,29 @@
+/* KallistiOS ##version##
+
+   mod1.c
+
+   First half of the klmtest.sh module: calls and data references into
+   the kernel, string constants, pointers to its own data and bss, and a
+   call into the other half.
+
+*/
+
+extern int kvar, ktab[];
+int kfunc(int a);
+void kput(const char *s);
+int helper(int x);
+
+static const char *msgs[] = { "hello", "world", 0 };
+int counter;
+static int big[100];
+int *ptrs[] = { &kvar, &ktab[3], &counter, &big[7] };
+
+int main(void) {
+    int i;
+
+    for(i = 0; msgs[i]; i++)
+        kput(msgs[i]);
+
+    counter = kfunc(3) + helper(ktab[2]);
+    return big[1] + *ptrs[1];
+}
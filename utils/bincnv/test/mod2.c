@@ -0,0 +1,19 @@
+/* KallistiOS ##version##
+
+   mod2.c
+
+   Second half of the klmtest.sh module, so the test covers relocations
+   between objects that ld -r merged, and a kernel function taken by
+   address.
+
+*/
+
+int kother(void);
+extern int counter;
+
+int (*fp)(void) = kother;
+int *cp = &counter;
+
+int helper(int x) {
+    return x * kother() + *cp;
+}
@@ -23,17 +23,9 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
-
-/* TODO:
- * With this utility included, there are now three utilities
- * (the other two being "vqenc" and "kmgenc") using common texture
- * operations such as twiddling and loading of png and jpeg images.
- * Maybe it is time to break that stuff out into its own library
- * or create a megatool consisting of all the tree tools in one
- * executable.
- */
-#include "get_image.h"
+#include "dctex.h"
 
 void printUsage() {
 	printf("dcbumpgen - Dreamcast bumpmap generator v0.1\n");
@@ -41,83 +33,97 @@ void printUsage() {
 	printf("usage: dcbumpgen <infile.png/.jpg> <outfile.raw>\n");
 }
 
-/* twiddling stuff copied from kmgenc.c */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-	((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
+/* the image is streamed in; only the previous row is kept around */
+typedef struct bump_state {
+	int w, h;
+	unsigned char *prev;
+	unsigned char *buffer;
+} bump_state_t;
+
+static int bump_begin(void *user, int w, int h) {
+	bump_state_t *bs = (bump_state_t *) user;
+
+	bs->w = w;
+	bs->h = h;
+	bs->prev = malloc(4 * w);
+	bs->buffer = malloc(2 * w * h);
+	return (bs->prev == NULL || bs->buffer == NULL) ? -1 : 0;
+}
+
+static int bump_row(void *user, int y, const unsigned char *row) {
+	bump_state_t *bs = (bump_state_t *) user;
+	unsigned char *dest = bs->buffer + 2 * y * bs->w;
+	int x, imgpos;
+
+	imgpos = 1; /* 1 to skip the alpha-channel */
+	for (x = 0; x < bs->w; x++, imgpos += 4) {
+		double diffy = 0;
+		double diffx = 0;
+		if (y > 0 && x > 0) {
+			diffy = (bs->prev[imgpos] - row[imgpos]) / 255.0;
+			diffx = (row[imgpos - 4] - row[imgpos]) / 255.0;
+		}
+
+		/* Rotation = R
+		   0 -> almost 360 degrees */
+		double rot = atan2(diffy, diffx);
+		int rotation = (int) ((rot / (2 * 3.1415927)) * 255);
+
+		/* Elevation = S
+		   0 -> almost 90 degrees */
+		int elevation = (int) (255 * (1 - fabs(diffx) - fabs(diffy)));
+		if (elevation < 0) elevation = 0;
+
+		*dest++ = rotation;
+		*dest++ = elevation;
+	}
+
+	memcpy(bs->prev, row, 4 * bs->w);
+	return 0;
+}
 
 int main(int argc, char **argv) {
-	image_t img;
+	bump_state_t bs;
+	image_reader_t rd;
 	FILE *fp;
-	int y, x;
 	unsigned char *buffer;
-	int imgpos, dest;
 
 	if (argc != 3) {
 		printUsage();
 		exit(1);
 	}
 
-	if (get_image(argv[1], &img) < 0) {
+	bs.prev = NULL;
+	bs.buffer = NULL;
+	rd.begin = bump_begin;
+	rd.row = bump_row;
+	rd.user = &bs;
+
+	if (read_image(argv[1], &rd) < 0) {
 		fprintf(stderr, "couldn't open %s\n", argv[1]);
+		free(bs.prev);
+		free(bs.buffer);
 		return -1;
 	}
 
+	free(bs.prev);
+	buffer = bs.buffer;
+
 	/* TODO:
 	 * - error-checking for missing files and other file failures
 	 * - check that image is power of two
 	 */
 	fp = fopen(argv[2], "wb");
-	buffer = malloc(2 * img.w * img.h);
 
-	imgpos = 1; /* 1 to skip the alpha-channel */
-	dest = 0;
-	for (y = 0; y < img.h; y++) {
-		for (x = 0; x < img.w; x++, imgpos += 4) {
-			double diffy = 0;
-			double diffx = 0;
-			if (y > 0 && x > 0) {
-				diffy = (img.data[imgpos - img.stride] - img.data[imgpos]) / 255.0;
-				diffx = (img.data[imgpos - 4] - img.data[imgpos]) / 255.0;
-			}
-
-			/* Rotation = R
-			   0 -> almost 360 degrees */
-			double rot = atan2(diffy, diffx);
-			int rotation = (int) ((rot / (2 * 3.1415927)) * 255);
-
-			/* Elevation = S
-			   0 -> almost 90 degrees */
-			int elevation = (int) (255 * (1 - fabs(diffx) - fabs(diffy)));
-			if (elevation < 0) elevation = 0;
-
-			buffer[dest] = rotation; dest++;
-			buffer[dest] = elevation; dest++;
-		}
-	}
-
-	/* twiddle code based on code from kmgenc.c */
-	int min = MIN(img.w, img.h);
-	int mask = min-1;
-	short *sbuffer = (short*) buffer;
-	short *twidbuffer = malloc(2 * img.w * img.h);
-	for (y=0; y<img.h; y++) {
-		int yout = y;
-		for (x=0; x<img.w; x++) {
-			twidbuffer[TWIDOUT(x&mask, yout&mask) +
-				(x/min + yout/min)*min*min] = sbuffer[y*img.w+x];
-		}
-	}
+	/* twiddle using the same code as kmgenc */
+	uint16 *twidbuffer = malloc(2 * bs.w * bs.h);
+	dctex_twiddle16((uint16 *) buffer, bs.w, bs.h, twidbuffer);
 
-	fwrite(twidbuffer, 1, 2* img.w * img.h, fp);
+	fwrite(twidbuffer, 1, 2* bs.w * bs.h, fp);
 	fclose(fp);
 
 	free(buffer);
 	free(twidbuffer);
-	if (img.data) {
-		free(img.data);
-	}
 	return 0;
 }
 
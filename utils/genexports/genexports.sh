@@ -15,13 +15,14 @@ inpfile=$1
 outpfile=$2
 outpsym=$3
 
-# Get the list of export names
-names=`cat $inpfile | grep -v '^#' | grep -v '^$' | sort`
+# Get the list of export names, in strcmp() order
+names=`cat $inpfile | grep -v '^#' | grep -v '^$' | LC_ALL=C sort`
 
 # Write out a header
 rm -f $outpfile
 echo '/* This is a generated file, do not edit!! */' > $outpfile
 echo '#define __EXPORTS_FILE' >> $outpfile
+echo '#include <string.h>' >> $outpfile
 echo '#include <kos/exports.h>' >> $outpfile
 
 # Write out "extern" declarations
@@ -38,3 +39,51 @@ done
 echo "	{ 0, 0 }" >> $outpfile
 echo "};" >> $outpfile
 
+
+# An open addressed hash table over the names, so that a module's imports
+# resolve in O(1) each rather than with a scan of the whole table. Slot i
+# holds the index of a symbol plus one, or 0 when empty; the table is at
+# least twice the size of the symbol list, so probes stay short. The hash
+# is h * 33 + c from 5381, which awk can work out exactly in a double.
+for i in $names; do
+	echo $i
+done | awk -v sym=$outpsym '
+BEGIN {
+	for(i = 1; i < 256; i++)
+		ord[sprintf("%c", i)] = i
+}
+{
+	name[n++] = $0
+}
+END {
+	size = 2
+	while(size < n * 2)
+		size *= 2
+
+	for(i = 0; i < n; i++) {
+		h = 5381
+		for(j = 1; j <= length(name[i]); j++)
+			h = (h * 33 + ord[substr(name[i], j, 1)]) % 4294967296
+		h %= size
+		while(h in slot)
+			h = (h + 1) % size
+		slot[h] = i + 1
+	}
+
+	printf("\nconst unsigned int %s_count = %d;\n\n", sym, n)
+	printf("static const unsigned %s %s_hash[%d] = {", \
+		n < 65535 ? "short" : "int", sym, size)
+	for(i = 0; i < size; i++)
+		printf("%s%d,", i % 16 ? " " : "\n\t", (i in slot) ? slot[i] : 0)
+	printf("\n};\n\n")
+
+	printf("export_sym_t *%s_lookup(const char *name) {\n", sym)
+	printf("\tconst unsigned char *p = (const unsigned char *)name;\n")
+	printf("\tunsigned int h = 5381, i;\n\n")
+	printf("\twhile(*p)\n\t\th = h * 33 + *p++;\n\n")
+	printf("\tfor(h &= %d; (i = %s_hash[h]); h = (h + 1) & %d) {\n", \
+		size - 1, sym, size - 1)
+	printf("\t\tif(!strcmp(%s[i - 1].name, name))\n", sym)
+	printf("\t\t\treturn %s + i - 1;\n\t}\n\n", sym)
+	printf("\treturn 0;\n}\n")
+}' >> $outpfile
@@ -0,0 +1,88 @@
+#!/bin/sh
+
+usage() {
+	echo 'genorder.sh [-c <coverage %>] [-n <max functions>] [-u] <inpfile> <outpfile>'
+	echo ''
+	echo 'Converts a profile into a text-order.ld fragment for shlelf.xo.'
+	echo '<inpfile> may be a gprof flat profile, "perf report --stdio" output,'
+	echo 'lines of "<samples> <symbol>", or one sampled symbol per line.'
+	echo 'Use mangled names (gprof/perf --no-demangle) so they match the'
+	echo 'section names emitted by -ffunction-sections.'
+	echo '  -c  stop once the listed functions cover this share of samples (99)'
+	echo '  -n  list at most this many functions (unlimited)'
+	echo '  -u  strip one leading underscore from symbols (raw SH symbol tables)'
+}
+
+coverage=99
+maxfuncs=0
+strip_underscore=0
+
+while getopts "c:n:uh" opt; do
+	case $opt in
+		c) coverage=$OPTARG ;;
+		n) maxfuncs=$OPTARG ;;
+		u) strip_underscore=1 ;;
+		*) usage; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+# Check for enough parameters
+if [ $# != 2 ]; then
+	echo "Not enough parameters: need 2, got $#"
+	usage
+	exit 1
+fi
+
+inpfile=$1
+outpfile=$2
+
+# Sum the samples per symbol, accepting any of the supported formats
+weights=`awk -v strip=$strip_underscore '
+	/^Flat profile/ { gprof = 1; next }
+	/^Call graph/   { gprof = 0; exit }
+	/^#/ || NF == 0 { next }
+	{
+		if (gprof) {
+			# %time cumulative self [calls self/call total/call] name
+			if ($1 !~ /^[0-9.]+$/) next
+			weight = $3; name = $NF
+		} else if ($1 ~ /^[0-9.]+%$/) {
+			# perf: overhead command object [.] symbol
+			weight = $1; sub(/%$/, "", weight); name = $NF
+		} else if (NF >= 2 && $1 ~ /^[0-9.]+$/) {
+			weight = $1; name = $2
+		} else if (NF == 1) {
+			weight = 1; name = $1
+		} else
+			next
+		sub(/\+0x[0-9a-fA-F]+$/, "", name)
+		if (strip) sub(/^_/, "", name)
+		if (name !~ /^[A-Za-z_.$][A-Za-z0-9_.$]*$/) next
+		samples[name] += weight
+	}
+	END { for (name in samples) if (samples[name] > 0) print samples[name], name }
+' $inpfile | sort -k 1,1gr -k 2,2`
+
+if [ "x$weights" = "x" ]; then
+	echo "No samples found in $inpfile"
+	exit 1
+fi
+
+# Write out a header
+rm -f $outpfile
+echo '/* This is a generated file, do not edit!! */' > $outpfile
+echo "/* Hot functions from $inpfile, hottest first */" >> $outpfile
+
+# Emit input section patterns until the requested coverage is reached
+echo "$weights" | awk -v coverage=$coverage -v maxfuncs=$maxfuncs '
+	{ weight[NR] = $1; name[NR] = $2; total += $1 }
+	END {
+		for (i = 1; i <= NR; i++) {
+			if (maxfuncs > 0 && i > maxfuncs) break
+			if (sum * 100 >= total * coverage) break
+			sum += weight[i]
+			printf "*(.text.hot.%s .text.%s)\n", name[i], name[i]
+		}
+		printf "/* %d of %d functions, %.1f%% of samples */\n", i - 1, NR, sum * 100 / total
+	}' >> $outpfile
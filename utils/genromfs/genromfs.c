@@ -54,6 +54,10 @@
  * -A N,/name force named file(s) (shell globbing applied against the filenames)
  *       to be aligned on N bytes boundary
  * In both cases, N must be a power of two.
+ * --compress PATTERN  store files matching PATTERN compressed (see below)
+ * -j N  read the source tree with N threads (default: one per processor)
+ * --update IMG  update IMG in place rather than writing a new image with -f
+ * -o OBJ  write the image into an SH ELF object (--elf-symbol names it)
  */
 
 /*
@@ -71,6 +75,9 @@
 #include <unistd.h> /* Userland prototypes of the Unix std system calls    */
 #include <fcntl.h>  /* Flag value for file handling functions              */
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <getopt.h>
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #   include <getopt.h>
 #else
@@ -79,6 +86,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <zlib.h>
 
 #include <netinet/in.h> /* Consts & structs defined by the internet system */
 
@@ -87,6 +95,18 @@
 #include <sys/sysmacros.h>
 #endif
 
+/* stat times in nanoseconds: Apple calls the fields st_[mc]timespec, and
+   native Windows only has whole seconds */
+#if defined(__APPLE__)
+#define STAT_NS(sb, t) ((sb)->st_##t##timespec.tv_sec * 1000000000LL \
+                        + (sb)->st_##t##timespec.tv_nsec)
+#elif defined(_WIN32) && !defined(__CYGWIN__)
+#define STAT_NS(sb, t) ((sb)->st_##t##time * 1000000000LL)
+#else
+#define STAT_NS(sb, t) ((sb)->st_##t##tim.tv_sec * 1000000000LL \
+                        + (sb)->st_##t##tim.tv_nsec)
+#endif
+
 
 struct romfh {
     int32_t nextfh;
@@ -106,6 +126,25 @@ struct romfh {
 #define ROMFH_FIF 7
 #define ROMFH_EXEC 8
 
+/*
+ * Compressed regular files (a KallistiOS extension, the Linux romfs
+ * driver doesn't know it) are ROMFH_REG nodes with ROMFH_ZLIB in
+ * spec.info.  The size in the header is the stored size, so anything
+ * walking the chain is unaffected.  The data is split into blocks of
+ * the same uncompressed size which are deflated independently, and
+ * starts with a table to find them (all big endian like the rest):
+ *
+ *   0   uncompressed size of the file
+ *   4   block size
+ *   8   offset of each block from the start of the data, and one
+ *       more for the end of the last block
+ *
+ * A block that wouldn't get smaller is stored as it is, which shows
+ * as its stored length being equal to its uncompressed length.
+ */
+#define ROMFH_ZLIB 0x7a6c6962   /* "zlib" */
+#define ROMFS_ZBLOCK 8192
+
 struct filenode;
 
 struct filehdr {
@@ -134,6 +173,15 @@ struct filenode {
     unsigned int offset;
     unsigned int size;
     unsigned int pad;
+    char *zdata;    /* the stored data of a compressed file */
+    struct filenode *hnext;     /* next in the same linktab bucket */
+    char *path;     /* inside the image */
+    struct oldnode *reuse;      /* --update: the data is in the old image */
+    unsigned int srcsize;
+    long long mtime;    /* in nanoseconds */
+    long long ctime;
+    uint64_t hash;
+    int hashed;
 };
 
 struct aligns {
@@ -147,6 +195,18 @@ struct excludes {
     char pattern[0];
 };
 
+/* a node of the image --update started from */
+struct oldnode {
+    struct oldnode *hnext;      /* next in the same oldtab bucket */
+    char *path;
+    unsigned int offset;        /* of the header */
+    unsigned int data;          /* of the data after the name */
+    unsigned int end;           /* of the data padded to 16 bytes */
+    unsigned int type;
+    unsigned int spec;
+    unsigned int size;
+};
+
 void initlist(struct filehdr *fh, struct filenode *owner) {
     fh->head = (struct filenode *)&fh->tail;
     fh->tail = NULL;
@@ -196,7 +256,10 @@ static int atoffs = 0;
 static int align = 16;
 struct aligns *alignlist = NULL;
 struct excludes *excludelist = NULL;
+struct excludes *compresslist = NULL;
 int realbase;
+static unsigned char *oldimg = NULL;    /* the image --update started from */
+static unsigned int oldsize = 0;
 
 /* helper function to match an exclusion or align pattern */
 
@@ -277,8 +340,15 @@ void dumpdata(void *addr, int len, FILE *f) {
 }
 
 void dumpzero(int len, FILE *f) {
-    memset(bigbuf, 0, len);
-    dumpdata(bigbuf, len, f);
+    int avail;
+
+    memset(bigbuf, 0, sizeof(bigbuf));
+
+    while(len > 0) {
+        avail = len < sizeof(bigbuf) ? len : sizeof(bigbuf);
+        dumpdata(bigbuf, avail, f);
+        len -= avail;
+    }
 }
 
 void dumpdataa(void *addr, int len, FILE *f) {
@@ -365,6 +435,18 @@ void dumpnode(struct filenode *node, FILE *f) {
         readlink(node->realname, bigbuf, node->size);
         dumpdataa(bigbuf, node->size, f);
     }
+    else if(S_ISREG(node->modes) && node->reuse) {
+        ri.nextfh |= htonl(ROMFH_REG);
+        ri.spec = htonl(node->reuse->spec);
+        dumpri(&ri, node, f);
+        dumpdataa(oldimg + node->reuse->data, node->size, f);
+    }
+    else if(S_ISREG(node->modes) && node->zdata) {
+        ri.nextfh |= htonl(ROMFH_REG);
+        ri.spec = htonl(ROMFH_ZLIB);
+        dumpri(&ri, node, f);
+        dumpdataa(node->zdata, node->size, f);
+    }
     else if(S_ISREG(node->modes)) {
         int offset, len, fd, max, avail;
         ri.nextfh |= htonl(ROMFH_REG);
@@ -450,6 +532,160 @@ void dumpall(struct filenode *node, int lastoff, FILE *f) {
         dumpzero(1024 - (lastoff & 1023), f);
 }
 
+/* ELF output
+ *
+ * With -o the image goes straight into an elf32-shl relocatable object,
+ * as bin2o (or bin2elf) would make of it: a read-only .rodata section
+ * holding the image between the symbols _SYM and _SYM_end, which is what
+ * KOS_INIT_ROMDISK(SYM) refers to.  The size of the image is known once
+ * it is laid out, so the ELF header goes out before the image and the
+ * symbols and section headers after it.
+ */
+
+#define EHDR_SIZE   52
+#define SHDR_SIZE   40
+#define SYM_SIZE    16
+#define EM_SH       42
+
+/* sections: null, .rodata, .symtab, .strtab, .shstrtab */
+static const char elfshstrtab[] = "\0.rodata\0.symtab\0.strtab\0.shstrtab";
+
+struct elflayout {
+    unsigned int align;         /* of .rodata */
+    unsigned int size;          /* of the image */
+    unsigned int rodata;        /* where things are in the file */
+    unsigned int shstr;
+    unsigned int sym;
+    unsigned int str;
+    unsigned int strsize;
+    unsigned int sh;
+};
+
+void put16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+void put32(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+void elfpad(FILE *f, unsigned int len) {
+    static const char zeros[64];
+    unsigned int n;
+
+    while(len) {
+        n = len < sizeof(zeros) ? len : sizeof(zeros);
+        fwrite(zeros, n, 1, f);
+        len -= n;
+    }
+}
+
+/* Works out where everything goes; the section is aligned to the biggest
+ * alignment asked for, so the file data stays aligned once linked
+ */
+void elflayout(struct elflayout *l, unsigned int size, const char *sym) {
+    struct aligns *pa;
+
+    l->align = align;
+
+    for(pa = alignlist; pa; pa = pa->next) {
+        if(pa->align > l->align)
+            l->align = pa->align;
+    }
+
+    l->size = size;
+    l->rodata = (EHDR_SIZE + l->align - 1) & ~(l->align - 1);
+    l->shstr = l->rodata + size;
+    l->sym = (l->shstr + sizeof(elfshstrtab) + 3) & ~3;
+    l->str = l->sym + 4 * SYM_SIZE;
+    l->strsize = 2 * strlen(sym) + 8;      /* "\0_sym\0_sym_end\0" */
+    l->sh = (l->str + l->strsize + 3) & ~3;
+}
+
+void elfhead(struct elflayout *l, FILE *f) {
+    unsigned char hdr[EHDR_SIZE];
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "\177ELF", 4);
+    hdr[4] = 1;                 /* ELFCLASS32 */
+    hdr[5] = 1;                 /* ELFDATA2LSB */
+    hdr[6] = 1;                 /* EV_CURRENT */
+    put16(hdr + 16, 1);         /* ET_REL */
+    put16(hdr + 18, EM_SH);
+    put32(hdr + 20, 1);
+    put32(hdr + 32, l->sh);
+    put16(hdr + 40, EHDR_SIZE);
+    put16(hdr + 46, SHDR_SIZE);
+    put16(hdr + 48, 5);
+    put16(hdr + 50, 4);         /* .shstrtab */
+
+    fwrite(hdr, sizeof(hdr), 1, f);
+    elfpad(f, l->rodata - EHDR_SIZE);
+}
+
+void elfshdr(unsigned char *p, unsigned int name, unsigned int type,
+             unsigned int flags, unsigned int offset, unsigned int size,
+             unsigned int link, unsigned int info, unsigned int align,
+             unsigned int entsize) {
+    put32(p + 0, name);
+    put32(p + 4, type);
+    put32(p + 8, flags);
+    put32(p + 16, offset);
+    put32(p + 20, size);
+    put32(p + 24, link);
+    put32(p + 28, info);
+    put32(p + 32, align);
+    put32(p + 36, entsize);
+}
+
+void elftail(struct elflayout *l, const char *sym, FILE *f) {
+    unsigned char syms[4 * SYM_SIZE], shdrs[5 * SHDR_SIZE];
+    char *str;
+    int len = strlen(sym);
+
+    str = calloc(1, l->strsize);
+
+    if(!str) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    sprintf(str + 1, "_%s", sym);
+    sprintf(str + len + 3, "_%s_end", sym);
+
+    /* null, the section, then _sym and _sym_end */
+    memset(syms, 0, sizeof(syms));
+    syms[SYM_SIZE + 12] = 3;    /* STB_LOCAL, STT_SECTION */
+    put16(syms + SYM_SIZE + 14, 1);
+    put32(syms + 2 * SYM_SIZE, 1);
+    syms[2 * SYM_SIZE + 12] = 0x10;     /* STB_GLOBAL, STT_NOTYPE */
+    put16(syms + 2 * SYM_SIZE + 14, 1);
+    put32(syms + 3 * SYM_SIZE, len + 3);
+    put32(syms + 3 * SYM_SIZE + 4, l->size);
+    syms[3 * SYM_SIZE + 12] = 0x10;
+    put16(syms + 3 * SYM_SIZE + 14, 1);
+
+    memset(shdrs, 0, sizeof(shdrs));
+    elfshdr(shdrs + SHDR_SIZE, 1, 1, 2, l->rodata, l->size, 0, 0, l->align, 0);
+    elfshdr(shdrs + 2 * SHDR_SIZE, 9, 2, 0, l->sym, 4 * SYM_SIZE, 3, 2, 4,
+            SYM_SIZE);
+    elfshdr(shdrs + 3 * SHDR_SIZE, 17, 3, 0, l->str, l->strsize, 0, 0, 1, 0);
+    elfshdr(shdrs + 4 * SHDR_SIZE, 25, 3, 0, l->shstr, sizeof(elfshstrtab),
+            0, 0, 1, 0);
+
+    fwrite(elfshstrtab, sizeof(elfshstrtab), 1, f);
+    elfpad(f, l->sym - l->shstr - sizeof(elfshstrtab));
+    fwrite(syms, sizeof(syms), 1, f);
+    fwrite(str, l->strsize, 1, f);
+    elfpad(f, l->sh - l->str - l->strsize);
+    fwrite(shdrs, sizeof(shdrs), 1, f);
+    free(str);
+}
+
 /* Node manipulating functions */
 
 void freenode(struct filenode *n) {
@@ -462,7 +698,7 @@ void setnode(struct filenode *n, dev_t dev, ino_t ino, mode_t um) {
     n->modes = um;
 }
 
-struct filenode *newnode(const char *base, const char *name, int curroffset) {
+struct filenode *newnode(const char *base, const char *name, int isroot) {
     struct filenode *node;
     int len;
     char *str;
@@ -485,7 +721,7 @@ struct filenode *newnode(const char *base, const char *name, int curroffset) {
     strcpy(str, name);
     node->name = str;
 
-    if(!curroffset) {
+    if(isroot) {
         len = 1;
         name = ".";
     }
@@ -518,30 +754,60 @@ struct filenode *newnode(const char *base, const char *name, int curroffset) {
     node->size = 0;
     node->devnode = 0;
     node->orig_link = NULL;
-    node->offset = curroffset;
+    node->offset = 0;
     node->pad = 0;
+    node->zdata = NULL;
+    node->hnext = NULL;
+    node->path = NULL;
+    node->reuse = NULL;
+    node->srcsize = 0;
+    node->mtime = 0;
+    node->ctime = 0;
+    node->hash = 0;
+    node->hashed = 0;
 
     return node;
 }
 
-struct filenode *findnode(struct filenode *node, dev_t dev, ino_t ino) {
-    struct filenode *found, *p;
+/* Hard links are found through this hash table, keyed by device and
+ * inode.  Nodes are entered in image order, so the one a lookup finds is
+ * the first with that inode, like a search of the tree built so far.
+ */
+static struct filenode **linktab;
+static unsigned int linkmask;
+
+void initlinks(int count) {
+    unsigned int size = 64;
 
-    /* scan the whole tree */
-    if(node->ondev == dev && node->onino == ino)
-        return node;
+    while(size < (unsigned int)count * 2)
+        size <<= 1;
 
-    p = node->dirlist.head;
+    linktab = calloc(size, sizeof(*linktab));
 
-    while(p->next) {
-        found = findnode(p, dev, ino);
+    if(!linktab) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
 
-        if(found)
-            return found;
+    linkmask = size - 1;
+}
 
-        p = p->next;
+/* Returns the node n is a hard link to, or enters n if it is the first */
+struct filenode *findlink(struct filenode *n) {
+    struct filenode *p, **bucket;
+    uint64_t h;
+
+    h = (uint64_t)n->ondev * 0x9e3779b97f4a7c15ULL ^ (uint64_t)n->onino;
+    h *= 0xff51afd7ed558ccdULL;
+    bucket = &linktab[(h ^ (h >> 32)) & linkmask];
+
+    for(p = *bucket; p; p = p->hnext) {
+        if(p->ondev == n->ondev && p->onino == n->onino)
+            return p;
     }
 
+    n->hnext = *bucket;
+    *bucket = n;
     return NULL;
 }
 
@@ -566,37 +832,651 @@ int alignnode(struct filenode *node, int curroffset, int extraspace) {
     return curroffset;
 }
 
-int processdir(int level, const char *base, const char *dirname, struct stat *sb,
-               struct filenode *dir, struct filenode *root, int curroffset) {
+/* Replaces the data of a file matching --compress with its compressed
+ * form, unless that wouldn't be any smaller.  This has to happen while
+ * the offsets are laid out, since they depend on the stored size.
+ */
+void compressnode(struct filenode *node) {
+    struct excludes *pc;
+    unsigned char *raw, *out;
+    unsigned int nblocks, i, pos, len, total;
+    uLongf zlen;
+    FILE *fp;
+
+    for(pc = compresslist; pc; pc = pc->next) {
+        if(!nodematch(pc->pattern, node))
+            break;
+    }
+
+    if(!pc || !node->size)
+        return;
+
+    raw = malloc(node->size);
+    fp = fopen(node->realname, "rb");
+
+    if(!raw || !fp || fread(raw, node->size, 1, fp) != 1) {
+        fprintf(stderr, "storing '%s' uncompressed (read failed)\n",
+                node->realname);
+
+        if(fp)
+            fclose(fp);
+
+        free(raw);
+        return;
+    }
+
+    fclose(fp);
+
+    nblocks = (node->size + ROMFS_ZBLOCK - 1) / ROMFS_ZBLOCK;
+    total = 8 + 4 * (nblocks + 1);
+    out = malloc(total + compressBound(ROMFS_ZBLOCK) * nblocks);
+
+    if(!out) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for(i = 0; i < nblocks; i++) {
+        pos = i * ROMFS_ZBLOCK;
+        len = node->size - pos < ROMFS_ZBLOCK ? node->size - pos : ROMFS_ZBLOCK;
+        zlen = compressBound(ROMFS_ZBLOCK);
+
+        if(compress2(out + total, &zlen, raw + pos, len,
+                     Z_BEST_COMPRESSION) != Z_OK || zlen >= len) {
+            memcpy(out + total, raw + pos, len);
+            zlen = len;
+        }
+
+        ((int32_t *)out)[2 + i] = htonl(total);
+        total += zlen;
+    }
+
+    ((int32_t *)out)[0] = htonl(node->size);
+    ((int32_t *)out)[1] = htonl(ROMFS_ZBLOCK);
+    ((int32_t *)out)[2 + nblocks] = htonl(total);
+    free(raw);
+
+    if(total >= node->size) {
+        free(out);
+        return;
+    }
+
+    node->zdata = (char *)out;
+    node->size = total;
+}
+
+/* Incremental updates
+ *
+ * With --update the previous image is read back and the new one is laid
+ * out over it.  Nodes keep their old places for as long as they still
+ * fit there: the same name and type in the same order, data no bigger
+ * than the old 16 byte padded slot, and the alignment still met.  From
+ * the first node that doesn't fit on, everything is laid out afresh.
+ * The image is then built in memory and only the parts that differ from
+ * the old one are written back to the file.
+ *
+ * A manifest next to the image keeps the size, mtime and hash of every
+ * regular file.  Files that still match it are copied from the old image
+ * instead of being read (and maybe compressed) again.  Its first line has
+ * the time the run that wrote it started, and a file whose mtime or ctime
+ * isn't well before that is hashed again whatever the manifest says: it
+ * may have been changed during that run or since in the same clock tick,
+ * or had its mtime put back by cp -p or rsync, which the ctime shows.
+ */
+
+struct manifest {
+    struct manifest *hnext;     /* next in the same mantab bucket */
+    uint64_t hash;
+    unsigned int size;
+    long long mtime;
+    int compress;               /* it matched --compress */
+    char path[0];
+};
+
+int updating = 0;
+static struct oldnode **oldnodes = NULL;
+static int oldcount = 0;
+static int oldkeep = -1;        /* next old node to place, -1 when done */
+static unsigned int oldfresh = 0;   /* where laying out afresh began */
+static struct oldnode **oldtab = NULL;
+static unsigned int oldmask;
+static struct manifest **mantab = NULL;
+static unsigned int manmask;
+static long long manstamp = 0;  /* when the manifest's run started */
+static long long runstamp;      /* when this run started */
+
+/* Timestamps in a filesystem can lag the clock by a tick or so */
+#define STAMP_SLACK 1000000000LL
+
+/* 64 bits of hash from the two checksums zlib has */
+uint64_t hashdata(uint64_t h, const void *data, unsigned int len) {
+    uLong crc = h >> 32, adler = h & 0xffffffff;
+
+    crc = crc32(crc, data, len);
+    adler = adler32(adler, data, len);
+    return (uint64_t)crc << 32 | adler;
+}
+
+#define HASH_INIT 1
+
+int hashfile(const char *name, uint64_t *hash) {
+    unsigned char buf[16384];
+    size_t len;
+    FILE *fp;
+
+    if(!(fp = fopen(name, "rb")))
+        return -1;
+
+    *hash = HASH_INIT;
+
+    while((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        *hash = hashdata(*hash, buf, len);
+
+    fclose(fp);
+    return 0;
+}
+
+unsigned int pathhash(const char *path) {
+    unsigned int h = 2166136261u;
+
+    while(*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+
+    return h;
+}
+
+void *maketab(int count, unsigned int *mask) {
+    unsigned int size = 64;
+    void *tab;
+
+    while(size < (unsigned int)count * 2)
+        size <<= 1;
+
+    if(!(tab = calloc(size, sizeof(void *)))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    *mask = size - 1;
+    return tab;
+}
+
+struct oldnode *findold(const char *path) {
+    struct oldnode *o;
+
+    if(!oldtab)
+        return NULL;
+
+    for(o = oldtab[pathhash(path) & oldmask]; o; o = o->hnext) {
+        if(!strcmp(o->path, path))
+            return o;
+    }
+
+    return NULL;
+}
+
+struct manifest *findmanifest(const char *path) {
+    struct manifest *m;
+
+    if(!mantab)
+        return NULL;
+
+    for(m = mantab[pathhash(path) & manmask]; m; m = m->hnext) {
+        if(!strcmp(m->path, path))
+            return m;
+    }
+
+    return NULL;
+}
+
+/* Records the headers in the chain starting at i, and those of the
+ * directories in it, in image order; returns -1 if they don't make sense
+ */
+int walkold(unsigned int i, const char *path) {
+    struct oldnode *o;
+    unsigned int next, namelen;
+
+    while(i) {
+        if(i + 16 >= oldsize || (oldcount && i <= oldnodes[oldcount - 1]->offset))
+            return -1;
+
+        namelen = strnlen((char *)oldimg + i + 16, oldsize - i - 16);
+
+        if(i + 16 + namelen >= oldsize)
+            return -1;
+
+        o = malloc(sizeof(*o));
+
+        if(o)
+            o->path = malloc(strlen(path) + namelen + 2);
+
+        if(!o || !o->path) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        next = ntohl(*(int32_t *)(oldimg + i));
+        sprintf(o->path, "%s/%s", path, oldimg + i + 16);
+        o->offset = i;
+        o->type = next & 7;
+        o->spec = ntohl(*(int32_t *)(oldimg + i + 4));
+        o->size = ntohl(*(int32_t *)(oldimg + i + 8));
+        o->data = i + 16 + ALIGNUP16(namelen + 1);
+        o->end = o->data;
+
+        if(o->type == ROMFH_REG || o->type == ROMFH_LNK)
+            o->end += ALIGNUP16(o->size);
+
+        if(o->end > oldsize || o->end < o->data)
+            return -1;
+
+        if(!(oldcount & 1023))
+            oldnodes = realloc(oldnodes, (oldcount + 1024) * sizeof(*oldnodes));
+
+        oldnodes[oldcount++] = o;
+
+        if(o->type == ROMFH_DIR && o->spec != i && walkold(o->spec, o->path))
+            return -1;
+
+        i = next & ~15;
+    }
+
+    return 0;
+}
+
+/* Reads the image to update; a missing one is simply built from scratch.
+ * Sets volname to the old volume name if it isn't set yet.
+ */
+void readold(const char *name, char **volname) {
+    struct oldnode *o;
+    struct stat sb;
+    FILE *fp;
+    int i;
+
+    if(!(fp = fopen(name, "rb")))
+        return;
+
+    if(fstat(fileno(fp), &sb) || sb.st_size < 512 ||
+            !(oldimg = malloc(sb.st_size)) ||
+            fread(oldimg, sb.st_size, 1, fp) != 1 ||
+            memcmp(oldimg, "-rom1fs-", 8)) {
+        fprintf(stderr, "%s: not a romfs image\n", name);
+        exit(1);
+    }
+
+    fclose(fp);
+    oldsize = sb.st_size;
+
+    if(!*volname)
+        *volname = strdup((char *)oldimg + 16);
+
+    if(walkold(16 + ALIGNUP16(strnlen((char *)oldimg + 16, 496) + 1), "")) {
+        fprintf(stderr, "%s: can't follow the headers, rebuilding it\n", name);
+        oldcount = 0;
+        return;
+    }
+
+    oldtab = maketab(oldcount, &oldmask);
+
+    for(i = 0; i < oldcount; i++) {
+        o = oldnodes[i];
+        o->hnext = oldtab[pathhash(o->path) & oldmask];
+        oldtab[pathhash(o->path) & oldmask] = o;
+    }
+
+    oldkeep = 0;
+}
+
+/* Reads the manifest, unless it belongs to another image than the old one */
+void readmanifest(const char *name) {
+    char line[4200];
+    struct manifest *m, **mans = NULL;
+    unsigned long long hash, imghash;
+    unsigned int size;
+    long long mtime;
+    int compress, pos, count = 0, i;
+    FILE *fp;
+
+    if(!oldimg || !(fp = fopen(name, "r")))
+        return;
+
+    /* a manifest without the time gets everything hashed again */
+    if(!fgets(line, sizeof(line), fp) ||
+            sscanf(line, "genromfs manifest %llx %lld", &imghash, &manstamp) < 1 ||
+            imghash != hashdata(HASH_INIT, oldimg, oldsize)) {
+        fprintf(stderr, "%s doesn't match the image, ignoring it\n", name);
+        fclose(fp);
+        return;
+    }
+
+    while(fgets(line, sizeof(line), fp)) {
+        if(sscanf(line, "%llx %u %lld %d %n", &hash, &size, &mtime,
+                  &compress, &pos) != 4)
+            continue;
+
+        line[strcspn(line, "\n")] = 0;
+        m = malloc(sizeof(*m) + strlen(line + pos) + 1);
+
+        if(!m) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        m->hash = hash;
+        m->size = size;
+        m->mtime = mtime;
+        m->compress = compress;
+        strcpy(m->path, line + pos);
+
+        if(!(count & 1023))
+            mans = realloc(mans, (count + 1024) * sizeof(*mans));
+
+        mans[count++] = m;
+    }
+
+    fclose(fp);
+
+    mantab = maketab(count, &manmask);
+
+    for(i = 0; i < count; i++) {
+        m = mans[i];
+        m->hnext = mantab[pathhash(m->path) & manmask];
+        mantab[pathhash(m->path) & manmask] = m;
+    }
+
+    free(mans);
+}
+
+int matchcompress(struct filenode *node) {
+    struct excludes *pc;
+
+    for(pc = compresslist; pc; pc = pc->next) {
+        if(!nodematch(pc->pattern, node))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Hashes a regular file for the manifest, unless the manifest says it
+ * hasn't changed since; returns 1 if its data can be copied from the old
+ * image, as stored there
+ */
+int reusenode(struct filenode *n) {
+    struct manifest *m = findmanifest(n->path);
+    struct oldnode *o = findold(n->path);
+
+    if(m && m->size == n->srcsize && m->mtime == n->mtime &&
+            n->mtime < manstamp - STAMP_SLACK && n->ctime < manstamp - STAMP_SLACK)
+        n->hash = m->hash;
+    else if(hashfile(n->realname, &n->hash))
+        return 0;
+
+    n->hashed = 1;
+
+    if(!m || !o || m->hash != n->hash || m->size != n->srcsize ||
+            m->compress != matchcompress(n) || o->type != ROMFH_REG)
+        return 0;
+
+    if(o->spec == ROMFH_ZLIB) {
+        if(o->data + 4 > oldsize ||
+                ntohl(*(int32_t *)(oldimg + o->data)) != n->srcsize)
+            return 0;
+    }
+    else if(o->spec != 0 || o->size != n->srcsize)
+        return 0;
+
+    n->reuse = o;
+    n->size = o->size;
+    return 1;
+}
+
+int nodetype(struct filenode *n) {
+    if(n->orig_link)
+        return ROMFH_HRD;
+    else if(S_ISDIR(n->modes))
+        return ROMFH_DIR;
+    else if(S_ISREG(n->modes))
+        return ROMFH_REG;
+    else if(S_ISLNK(n->modes))
+        return ROMFH_LNK;
+    else if(S_ISBLK(n->modes))
+        return ROMFH_BLK;
+    else if(S_ISCHR(n->modes))
+        return ROMFH_CHR;
+    else if(S_ISSOCK(n->modes))
+        return ROMFH_SCK;
+    else
+        return ROMFH_FIF;
+}
+
+/* Puts n where the node in the same place in the old image was, if it
+ * still fits there; returns 0 if it has to be laid out afresh, which then
+ * goes for everything after it too
+ */
+int placeold(struct filenode *n, int *curroffset) {
+    struct oldnode *o;
+    int type, extra;
+
+    if(oldkeep < 0)
+        return 0;
+
+    o = oldkeep < oldcount ? oldnodes[oldkeep] : NULL;
+    type = nodetype(n);
+    extra = type == ROMFH_REG ? 16 + ALIGNUP16(strlen(n->name) + 1) : 0;
+
+    /* the first header has no pointer to it; it follows the volume name */
+    if(!o || strcmp(o->path, n->path) || o->type != type ||
+            o->offset < *curroffset ||
+            (oldkeep == 0 && o->offset != *curroffset) ||
+            ALIGNUP16(n->size) > o->end - o->data ||
+            ((o->offset + extra) & (findalign(n) - 1))) {
+        oldkeep = -1;
+        oldfresh = *curroffset;
+        return 0;
+    }
+
+    n->offset = o->offset;
+    n->pad = o->offset - *curroffset;
+    *curroffset = o->offset + spaceneeded(n);
+    oldkeep++;
+    return 1;
+}
+
+/* Writes the parts of the new image that differ from the old one */
+void writeupdate(const char *name, const unsigned char *img, unsigned int size,
+                 int verbose) {
+    unsigned int i, len, written = 0;
+    int fd;
+
+    fd = open(name, O_WRONLY | O_CREAT
+#ifdef O_BINARY
+              | O_BINARY
+#endif
+              , 0666);
+
+    if(fd < 0) {
+        perror(name);
+        exit(1);
+    }
+
+    for(i = 0; i < size; i += len) {
+        len = size - i < 4096 ? size - i : 4096;
+
+        if(i + len <= oldsize && !memcmp(img + i, oldimg + i, len))
+            continue;
+
+        if(pwrite(fd, img + i, len, i) != len) {
+            perror(name);
+            exit(1);
+        }
+
+        written += len;
+    }
+
+    if(size < oldsize && ftruncate(fd, size)) {
+        perror(name);
+        exit(1);
+    }
+
+    close(fd);
+
+    if(verbose) {
+        if(oldkeep < 0)
+            fprintf(stderr, "laid out afresh from 0x%x, ", oldfresh);
+        else
+            fprintf(stderr, "everything kept its place, ");
+
+        fprintf(stderr, "wrote %u of %u bytes\n", written, size);
+    }
+}
+
+void manifestnode(struct filenode *node, FILE *f) {
+    struct filenode *p;
+
+    if(!node->orig_link && S_ISREG(node->modes) && node->hashed &&
+            !strchr(node->path, '\n'))
+        fprintf(f, "%016llx %u %lld %d %s\n", (unsigned long long)node->hash,
+                node->srcsize, node->mtime, matchcompress(node),
+                node->path);
+
+    for(p = node->dirlist.head; p->next; p = p->next)
+        manifestnode(p, f);
+}
+
+/* Writes the manifest of the new image, through a temporary file so a
+ * failed run doesn't leave one that seems to match
+ */
+void writemanifest(const char *name, struct filenode *root,
+                   const unsigned char *img, unsigned int size) {
+    char *tmp;
+    FILE *f;
+
+    tmp = malloc(strlen(name) + 5);
+    sprintf(tmp, "%s.tmp", name);
+
+    if(!(f = fopen(tmp, "w"))) {
+        perror(tmp);
+        exit(1);
+    }
+
+    fprintf(f, "genromfs manifest %016llx %lld\n",
+            (unsigned long long)hashdata(HASH_INIT, img, size), runstamp);
+    manifestnode(root, f);
+
+    if(fclose(f) || rename(tmp, name)) {
+        perror(name);
+        exit(1);
+    }
+
+    free(tmp);
+}
+
+/* Scanning the source tree
+ *
+ * The tree is read in parallel: each job reads one directory, builds the
+ * nodes for its entries in readdir order and queues the subdirectories
+ * it finds as new jobs, on as many threads as -j says.  Nothing here
+ * depends on the order the jobs run in; hard links, offsets and padding
+ * are only worked out afterwards by layoutdir(), in one pass over the
+ * finished tree, so the image comes out the same every time.
+ */
+
+struct scanjob {
+    struct scanjob *next;
+    struct filenode *dir;
+    char *base;
+    int level;
+};
+
+static struct scanjob *scanqueue = NULL;
+static int scanbusy = 0;
+static int scancount = 0;
+static pthread_mutex_t scanlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scancond = PTHREAD_COND_INITIALIZER;
+
+void queuedir(struct filenode *dir, char *base, int level) {
+    struct scanjob *job;
+
+    job = malloc(sizeof(*job));
+
+    if(!job) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    job->dir = dir;
+    job->base = base;
+    job->level = level;
+
+    pthread_mutex_lock(&scanlock);
+    job->next = scanqueue;
+    scanqueue = job;
+    pthread_cond_signal(&scancond);
+    pthread_mutex_unlock(&scanlock);
+}
+
+void setpath(struct filenode *n, struct filenode *dir) {
+    n->path = malloc(strlen(dir->path) + strlen(n->name) + 2);
+
+    if(!n->path) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    sprintf(n->path, "%s/%s", dir->path, n->name);
+}
+
+/* Is dir the same directory as one of the ones it is in?  Such a loop
+ * ends up as a hard link, so there is no point reading it (forever).
+ */
+int dirloop(struct filenode *dir) {
+    struct filenode *p;
+
+    for(p = dir->parent; ; p = p->parent) {
+        if(p->ondev == dir->ondev && p->onino == dir->onino)
+            return 1;
+
+        if(p->parent == p)
+            return 0;
+    }
+}
+
+/* Reads the entries of one directory into nodes; returns how many */
+int scandirnode(int level, const char *base, struct filenode *dir) {
     DIR *dirfd;
     struct dirent *dp;
     struct filenode *n, *link;
     struct excludes *pe;
+    struct stat sb[1];
+    char linkbuf[4096];
+    int count = 0;
 
     if(level <= 1) {
         /* Ok, to make sure . and .. are handled correctly
          * we add them first.  Note also that we alloc them
          * first to get to know the real name
          */
-        link = newnode(base, ".", curroffset);
+        link = newnode(base, ".", 0);
 
         if(!lstat(link->realname, sb)) {
             setnode(link, sb->st_dev, sb->st_ino, sb->st_mode);
+            setpath(link, dir);
             append(&dir->dirlist, link);
 
             /* special case for root node - '..'s in subdirs should link to
              *   '.' of root node, not root node itself.
              */
             dir->dirlist.owner = link;
-
-            curroffset = alignnode(link, curroffset, 0) + spaceneeded(link);
-            n = newnode(base, "..", curroffset);
+            n = newnode(base, "..", 0);
+            count++;
 
             if(!lstat(n->realname, sb)) {
                 setnode(n, sb->st_dev, sb->st_ino, sb->st_mode);
+                setpath(n, dir);
                 append(&dir->dirlist, n);
                 n->orig_link = link;
-                curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
+                count++;
             }
         }
     }
@@ -610,7 +1490,7 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
                  || strcmp(dp->d_name, "..") == 0))
             continue;
 
-        n = newnode(base, dp->d_name, curroffset);
+        n = newnode(base, dp->d_name, 0);
 
         /* Process exclude list. */
         for(pe = excludelist; pe; pe = pe->next) {
@@ -633,9 +1513,9 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
             if(S_ISLNK(sb->st_mode)) {
                 /* this is a link to follow at build time */
                 n->name = n->name + 1; /* strip off the leading @ */
-                memset(bigbuf, 0, sizeof(bigbuf));
-                readlink(n->realname, bigbuf, sizeof(bigbuf));
-                n->realname = strdup(bigbuf);
+                memset(linkbuf, 0, sizeof(linkbuf));
+                readlink(n->realname, linkbuf, sizeof(linkbuf));
+                n->realname = strdup(linkbuf);
 
                 if(lstat(n->realname, sb)) {
                     fprintf(stderr, "ignoring '%s' (lstat failed)\n",
@@ -689,56 +1569,156 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
             continue;
         }
 
-        /* Look up old links */
-        if(strcmp(n->name, ".") == 0) {
-            append(&dir->dirlist, n);
-            link = n->parent;
-        }
-        else if(strcmp(n->name, "..") == 0) {
-            append(&dir->dirlist, n);
-            link = n->parent->parent;
-        }
-        else {
-            link = findnode(root, n->ondev, n->onino);
-            append(&dir->dirlist, n);
-        }
+        setpath(n, dir);
+        append(&dir->dirlist, n);
+        count++;
 
-        if(link) {
-            n->orig_link = link;
-            curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
+        /* . and .. always turn out to be links */
+        if(strcmp(n->name, ".") == 0 || strcmp(n->name, "..") == 0)
             continue;
-        }
 
+        /* Anything else might be a link too, which isn't known until the
+         * layout; the size of a link is simply dropped then.
+         */
         if(S_ISREG(sb->st_mode)) {
-            curroffset = alignnode(n, curroffset, spaceneeded(n));
-            n->size = sb->st_size;
+            n->size = n->srcsize = sb->st_size;
+            n->mtime = STAT_NS(sb, m);
+            n->ctime = STAT_NS(sb, c);
+
+            if(!(updating && reusenode(n)))
+                compressnode(n);
         }
-        else
-            curroffset = alignnode(n, curroffset, 0);
 
         if(S_ISLNK(sb->st_mode)) {
             n->size = sb->st_size;
         }
 
-        curroffset += spaceneeded(n);
-
         if(S_ISCHR(sb->st_mode) || S_ISBLK(sb->st_mode)) {
             n->devnode = sb->st_rdev;
         }
 
-        if(S_ISDIR(sb->st_mode)) {
-            if(!strcmp(n->name, "..")) {
-                curroffset = processdir(level + 1, dir->realname, dp->d_name,
-                                        sb, dir, root, curroffset);
-            }
-            else {
-                curroffset = processdir(level + 1, n->realname, dp->d_name,
-                                        sb, n, root, curroffset);
-            }
+        if(S_ISDIR(sb->st_mode) && !dirloop(n)) {
+            queuedir(n, n->realname, level + 1);
         }
     }
 
     closedir(dirfd);
+    return count;
+}
+
+void *scanworker(void *arg) {
+    struct scanjob *job;
+    int count;
+
+    pthread_mutex_lock(&scanlock);
+
+    for(;;) {
+        while(!scanqueue && scanbusy)
+            pthread_cond_wait(&scancond, &scanlock);
+
+        if(!scanqueue)
+            break;
+
+        job = scanqueue;
+        scanqueue = job->next;
+        scanbusy++;
+        pthread_mutex_unlock(&scanlock);
+
+        count = scandirnode(job->level, job->base, job->dir);
+        free(job);
+
+        pthread_mutex_lock(&scanlock);
+        scancount += count;
+
+        if(--scanbusy == 0 && !scanqueue)
+            pthread_cond_broadcast(&scancond);
+    }
+
+    pthread_mutex_unlock(&scanlock);
+    return NULL;
+}
+
+/* Reads the whole tree under root on the given number of threads;
+ * returns the number of nodes found
+ */
+int scantree(struct filenode *root, char *base, int jobs) {
+    pthread_t *tids;
+    int i, n;
+
+    queuedir(root, base, 1);
+
+    tids = malloc(jobs * sizeof(*tids));
+
+    for(n = 1; n < jobs; n++) {
+        if(pthread_create(&tids[n], NULL, scanworker, NULL))
+            break;
+    }
+
+    scanworker(NULL);
+
+    for(i = 1; i < n; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    return scancount;
+}
+
+/* Works out hard links, offsets and padding for the entries of dir and
+ * everything below, in the order they go into the image; returns the
+ * offset following them
+ */
+int layoutdir(struct filenode *dir, int curroffset) {
+    struct filenode *n, *link;
+    unsigned int size;
+
+    for(n = dir->dirlist.head; n->next; n = n->next) {
+        n->offset = curroffset;
+
+        /* Look up old links */
+        if(n == dir->dirlist.owner) {   /* the root's . */
+            findlink(n);
+            link = NULL;
+        }
+        else if(n->orig_link) {         /* the root's .. */
+            findlink(n);
+            link = n->orig_link;
+        }
+        else if(strcmp(n->name, ".") == 0) {
+            findlink(n);
+            link = n->parent;
+        }
+        else if(strcmp(n->name, "..") == 0) {
+            findlink(n);
+            link = n->parent->parent;
+        }
+        else
+            link = findlink(n);
+
+        if(link) {
+            n->orig_link = link;
+            n->size = 0;
+            n->reuse = NULL;
+            free(n->zdata);
+            n->zdata = NULL;
+            initlist(&n->dirlist, n);
+        }
+
+        if(placeold(n, &curroffset))
+            ;
+        else if(!link && S_ISREG(n->modes)) {
+            size = n->size;
+            n->size = 0;
+            curroffset = alignnode(n, curroffset, spaceneeded(n));
+            n->size = size;
+            curroffset += spaceneeded(n);
+        }
+        else
+            curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
+
+        if(!link && S_ISDIR(n->modes))
+            curroffset = layoutdir(n, curroffset);
+    }
+
     return curroffset;
 }
 
@@ -748,12 +1728,17 @@ void showhelp(const char *argv0) {
     printf("Create a romfs filesystem image from a directory\n");
     printf("\n");
     printf("  -f IMAGE               Output the image into this file\n");
+    printf("  -o OBJECT              Output the image as an SH ELF object instead\n");
+    printf("  --elf-symbol SYM       Name the image _SYM in the object (default: romdisk)\n");
     printf("  -d DIRECTORY           Use this directory as source\n");
     printf("  -v                     (Too) verbose operation\n");
     printf("  -V VOLUME              Use the specified volume name\n");
     printf("  -a ALIGN               Align regular file data to ALIGN bytes\n");
     printf("  -A ALIGN,PATTERN       Align all objects matching pattern to at least ALIGN bytes\n");
     printf("  -x PATTERN             Exclude all objects matching pattern\n");
+    printf("  --update IMAGE         Update IMAGE in place instead of writing one with -f\n");
+    printf("  -j JOBS                Scan the source with JOBS threads (default: all cores)\n");
+    printf("  --compress PATTERN     Store regular files matching pattern compressed\n");
     printf("  -h                     Show this help\n");
     printf("\n");
     printf("Report bugs to chexum@shadow.banki.hu\n");
@@ -765,17 +1750,30 @@ int main(int argc, char *argv[]) {
     char *outf = NULL;
     char *volname = NULL;
     int verbose = 0;
+    int jobs = 0;
+    char *update = NULL, *manifest = NULL;
+    struct timespec ts;
+    char *elfout = NULL, *elfsym = "romdisk";
+    struct elflayout elf;
+    char *img;
+    size_t imgsize;
     char buf[256];
     struct filenode *root;
-    struct stat sb;
     int lastoff;
     int i;
     char *p;
     struct aligns *pa, *pa2;
-    struct excludes *pe, *pe2;
+    struct excludes *pe, *pe2, **list;
     FILE *f;
-
-    while((c = getopt(argc, argv, "V:vd:f:ha:A:x:")) != EOF) {
+    static const struct option longopts[] = {
+        { "compress", required_argument, NULL, 'z' },
+        { "update", required_argument, NULL, 'u' },
+        { "elf-symbol", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while((c = getopt_long(argc, argv, "V:vd:f:o:ha:A:x:j:", longopts,
+                           NULL)) != EOF) {
         switch(c) {
             case 'd':
                 dir = optarg;
@@ -783,6 +1781,15 @@ int main(int argc, char *argv[]) {
             case 'f':
                 outf = optarg;
                 break;
+            case 'u':
+                update = optarg;
+                break;
+            case 'o':
+                elfout = optarg;
+                break;
+            case 's':
+                elfsym = optarg;
+                break;
             case 'V':
                 volname = optarg;
                 break;
@@ -829,16 +1836,27 @@ int main(int argc, char *argv[]) {
                     pa2->next = pa;
                 }
 
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+
+                if(jobs < 1) {
+                    fprintf(stderr, "-j needs at least one job\n");
+                    exit(1);
+                }
+
                 break;
             case 'x':
+            case 'z':
+                list = c == 'x' ? &excludelist : &compresslist;
                 pe = (struct excludes *)malloc(sizeof(*pe) + strlen(optarg) + 1);
                 pe->next = NULL;
                 strcpy(pe->pattern, optarg);
 
-                if(!excludelist)
-                    excludelist = pe;
+                if(!*list)
+                    *list = pe;
                 else {
-                    for(pe2 = excludelist; pe2->next; pe2 = pe2->next)
+                    for(pe2 = *list; pe2->next; pe2 = pe2->next)
                         ;
 
                     pe2->next = pe;
@@ -850,18 +1868,51 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if(elfout) {
+        if(outf || update) {
+            fprintf(stderr, "%s: -o can't be used with -f or --update\n",
+                    argv[0]);
+            exit(1);
+        }
+
+        outf = elfout;
+    }
+
+    if(update) {
+        if(outf) {
+            fprintf(stderr, "%s: --update writes to the image it updates, "
+                    "there is no -f\n", argv[0]);
+            exit(1);
+        }
+
+        outf = update;
+        updating = 1;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        runstamp = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        readold(update, &volname);
+
+        manifest = malloc(strlen(update) + 10);
+        sprintf(manifest, "%s.manifest", update);
+        readmanifest(manifest);
+    }
+
     if(!volname) {
         sprintf(buf, "rom %08lx", time(NULL));
         volname = buf;
     }
 
     if(!outf) {
-        fprintf(stderr, "%s: you must specify the destination file\n", argv[0]);
+        fprintf(stderr, "%s: you must specify the destination file or object\n",
+                argv[0]);
         fprintf(stderr, "Try `%s -h' for more information\n", argv[0]);
         exit(1);
     }
 
-    if(strcmp(outf, "-") == 0) {
+    /* updates are built in memory to compare them with the old image */
+    if(updating) {
+        f = open_memstream(&img, &imgsize);
+    }
+    else if(strcmp(outf, "-") == 0) {
         f = fdopen(1, "wb");
     }
     else
@@ -873,14 +1924,42 @@ int main(int argc, char *argv[]) {
     }
 
     realbase = strlen(dir);
-    root = newnode(dir, volname, 0);
+
+    if(!jobs)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+               sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+    root = newnode(dir, volname, 1);
     root->parent = root;
-    lastoff = processdir(1, dir, dir, &sb, root, root, spaceneeded(root));
+    root->path = "";
+    initlinks(scantree(root, dir, jobs));
+    lastoff = layoutdir(root, spaceneeded(root));
 
     if(verbose)
         shownode(0, root, stderr);
 
+    if(elfout) {
+        elflayout(&elf, (lastoff + 1023) & ~1023, elfsym);
+        elfhead(&elf, f);
+    }
+
     dumpall(root, lastoff, f);
 
+    if(elfout) {
+        elftail(&elf, elfsym, f);
+
+        if(fclose(f)) {
+            perror(outf);
+            unlink(outf);
+            exit(1);
+        }
+    }
+
+    if(updating) {
+        fclose(f);
+        writeupdate(outf, (unsigned char *)img, imgsize, verbose);
+        writemanifest(manifest, root, (unsigned char *)img, imgsize);
+    }
+
     exit(0);
 }
@@ -0,0 +1,79 @@
+/* KallistiOS ##version##
+
+   get_image.c
+
+   Picks the decoder by file extension and builds whole-image loading on
+   top of the streaming readers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "get_image.h"
+
+int read_image(const char *filename, image_reader_t *rd) {
+    int len = strlen(filename);
+
+    if(len >= 3 && !strcmp(filename + len - 3, "png")) {
+        return read_image_png(filename, rd);
+    }
+    else if(len >= 3 && !strcmp(filename + len - 3, "jpg")) {
+        return read_image_jpg(filename, rd);
+    }
+    else {
+        fprintf(stderr, "FATAL: Unknown extension on input file '%s'\n", filename);
+        return -1;
+    }
+}
+
+static int whole_begin(void *user, int w, int h) {
+    image_t *image = (image_t *)user;
+
+    image->w = w;
+    image->h = h;
+    image->bpp = 4;
+    image->stride = 4 * w;
+    image->data = (unsigned char *)malloc(image->stride * h);
+
+    return image->data == NULL ? -ENOMEM : 0;
+}
+
+static int whole_row(void *user, int y, const unsigned char *argb) {
+    image_t *image = (image_t *)user;
+
+    memcpy(image->data + y * image->stride, argb, image->stride);
+    return 0;
+}
+
+int get_image(const char *filename, image_t *image) {
+    image_reader_t rd;
+    int rv;
+
+    image->data = NULL;
+    rd.begin = whole_begin;
+    rd.row = whole_row;
+    rd.user = image;
+
+    rv = read_image(filename, &rd);
+
+    if(rv < 0 && image->data != NULL) {
+        free(image->data);
+        image->data = NULL;
+    }
+
+    return rv;
+}
+
+/* Only needed by a libjpeg without JCS_EXT_ARGB; libpng's transforms and
+   libjpeg-turbo write ARGB rows themselves */
+void rgb_to_argb(const unsigned char *src, unsigned char *dst, int w) {
+    int i;
+
+    for(i = 0; i < w; i++) {
+        dst[i * 4 + 0] = 0xff;
+        dst[i * 4 + 1] = src[i * 3 + 0];
+        dst[i * 4 + 2] = src[i * 3 + 1];
+        dst[i * 4 + 3] = src[i * 3 + 2];
+    }
+}
@@ -0,0 +1,41 @@
+/* KallistiOS ##version##
+
+   get_image.h
+
+   PNG and JPEG loading shared by vqenc, kmgenc and dcbumpgen. Pixels are
+   always delivered as ARGB bytes, four per pixel.
+*/
+
+#ifndef __GET_IMAGE_H
+#define __GET_IMAGE_H
+
+typedef struct image_t {
+    int w;
+    int h;
+    int bpp;
+    int stride;
+    unsigned char *data;
+} image_t;
+
+/* Streaming interface: begin() is called once with the image size, then
+   row() once for every row, top to bottom, with w ARGB pixels that are
+   only valid during the call. Either one may return non-zero to stop
+   decoding, which makes read_image() fail. Only a few rows are held in
+   memory, except for interlaced PNGs, which need the whole image. */
+typedef struct image_reader {
+    int (*begin)(void *user, int w, int h);
+    int (*row)(void *user, int y, const unsigned char *argb);
+    void *user;
+} image_reader_t;
+
+int read_image(const char *filename, image_reader_t *rd);
+int read_image_jpg(const char *filename, image_reader_t *rd);
+int read_image_png(const char *filename, image_reader_t *rd);
+
+/* Loads the whole image into image->data, built on read_image() */
+int get_image(const char *filename, image_t *image);
+
+/* Expands w RGB pixels to opaque ARGB; src and dst must not overlap */
+void rgb_to_argb(const unsigned char *src, unsigned char *dst, int w);
+
+#endif
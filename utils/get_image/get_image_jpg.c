@@ -0,0 +1,102 @@
+/* KallistiOS ##version##
+
+   get_image_jpg.c
+
+   Based on Andrew's jpeg_to_texture routine. Decodes one scanline at a
+   time straight into the reader.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "get_image.h"
+
+/* libjpeg's default error handler exits the program; jump back instead */
+typedef struct jpg_error {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} jpg_error_t;
+
+static void jpg_error_exit(j_common_ptr cinfo) {
+    jpg_error_t *err = (jpg_error_t *)cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jmp, 1);
+}
+
+int read_image_jpg(const char *filename, image_reader_t *rd) {
+    struct jpeg_decompress_struct cinfo;
+    jpg_error_t jerr;
+    JSAMPARRAY buffer;
+    FILE *infile;
+    unsigned char *volatile argb = NULL;
+    int y, rv = -1;
+
+    infile = fopen(filename, "rb");
+
+    if(infile == NULL) {
+        return -errno;
+    }
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpg_error_exit;
+
+    if(setjmp(jerr.jmp)) {
+        goto out;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, infile);
+    (void)jpeg_read_header(&cinfo, TRUE);
+
+    /* libjpeg-turbo can write ARGB itself; otherwise ask for RGB (which
+       also expands grayscale) and shuffle each row */
+#ifdef JCS_EXTENSIONS
+    cinfo.out_color_space = JCS_EXT_ARGB;
+#else
+    cinfo.out_color_space = JCS_RGB;
+#endif
+
+    (void)jpeg_start_decompress(&cinfo);
+
+    if(rd->begin(rd->user, cinfo.output_width, cinfo.output_height) != 0) {
+        goto out;
+    }
+
+    buffer = (*cinfo.mem->alloc_sarray)
+             ((j_common_ptr) &cinfo, JPOOL_IMAGE,
+              cinfo.output_width * cinfo.output_components, 1);
+
+#ifndef JCS_EXTENSIONS
+    argb = (unsigned char *)malloc(cinfo.output_width * 4);
+
+    if(argb == NULL) {
+        goto out;
+    }
+#endif
+
+    while(cinfo.output_scanline < cinfo.output_height) {
+        y = cinfo.output_scanline;
+        (void)jpeg_read_scanlines(&cinfo, buffer, 1);
+
+        if(argb != NULL) {
+            rgb_to_argb(buffer[0], argb, cinfo.output_width);
+        }
+
+        if(rd->row(rd->user, y, argb != NULL ? argb : buffer[0]) != 0) {
+            goto out;
+        }
+    }
+
+    (void)jpeg_finish_decompress(&cinfo);
+    rv = 0;
+
+out:
+    jpeg_destroy_decompress(&cinfo);
+    free(argb);
+    fclose(infile);
+    return rv;
+}
@@ -0,0 +1,130 @@
+/* KallistiOS ##version##
+
+   get_image_png.c
+   (c)2002 Jeffrey McBeth, Dan Potter
+
+   Based on Jeff's png_load_texture and readpng routines. libpng is asked
+   to produce ARGB itself, so rows go to the reader as they are decoded.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <png.h>
+#include "get_image.h"
+
+int read_image_png(const char *filename, image_reader_t *rd) {
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    png_uint_32 width, height, y;
+    int bit_depth, color_type, passes;
+    png_bytep volatile rows = NULL;
+    png_bytep *volatile row_pointers = NULL;
+    unsigned char sig[8];
+    FILE *infile;
+    int rv = -1;
+
+    if((infile = fopen(filename, "rb")) == NULL) {
+        fprintf(stderr, "png_to_texture: can't open %s\n", filename);
+        return -errno;
+    }
+
+    if(fread(sig, 1, 8, infile) != 8 || png_sig_cmp(sig, 0, 8)) {
+        fclose(infile);
+        return -2;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+    if(png_ptr != NULL)
+        info_ptr = png_create_info_struct(png_ptr);
+
+    if(info_ptr == NULL) {
+        rv = -ENOMEM;
+        goto out;
+    }
+
+    /* libpng has already printed the reason */
+    if(setjmp(png_jmpbuf(png_ptr)))
+        goto out;
+
+    png_init_io(png_ptr, infile);
+    png_set_sig_bytes(png_ptr, 8);
+    png_read_info(png_ptr, info_ptr);
+
+    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+                 NULL, NULL, NULL);
+
+    /* expand palette, low-bit-depth gray and tRNS to 8-bit channels, and
+       gray to RGB */
+    if(color_type == PNG_COLOR_TYPE_PALETTE ||
+            (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) ||
+            png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+        png_set_expand(png_ptr);
+
+    if(bit_depth == 16)
+        png_set_strip_16(png_ptr);
+
+    if(color_type == PNG_COLOR_TYPE_GRAY ||
+            color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+
+    /* RGBA becomes ARGB, and RGB gets an opaque alpha in front */
+    if((color_type & PNG_COLOR_MASK_ALPHA) ||
+            png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+        png_set_swap_alpha(png_ptr);
+    else
+        png_set_filler(png_ptr, 0xff, PNG_FILLER_BEFORE);
+
+    passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+
+    if(rd->begin(rd->user, (int)width, (int)height) != 0)
+        goto out;
+
+    /* interlaced images only come together after the last pass, so they
+       have to be decoded whole; everything else streams one row at a time */
+    if(passes > 1) {
+        rows = (png_bytep)malloc((size_t)width * 4 * height);
+        row_pointers = (png_bytep *)malloc(height * sizeof(png_bytep));
+
+        if(rows == NULL || row_pointers == NULL) {
+            rv = -ENOMEM;
+            goto out;
+        }
+
+        for(y = 0; y < height; y++)
+            row_pointers[y] = rows + (size_t)y * width * 4;
+
+        png_read_image(png_ptr, row_pointers);
+
+        for(y = 0; y < height; y++) {
+            if(rd->row(rd->user, (int)y, row_pointers[y]) != 0)
+                goto out;
+        }
+    }
+    else {
+        if((rows = (png_bytep)malloc((size_t)width * 4)) == NULL) {
+            rv = -ENOMEM;
+            goto out;
+        }
+
+        for(y = 0; y < height; y++) {
+            png_read_row(png_ptr, rows, NULL);
+
+            if(rd->row(rd->user, (int)y, rows) != 0)
+                goto out;
+        }
+    }
+
+    png_read_end(png_ptr, NULL);
+    rv = 0;
+
+out:
+    png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+    free(row_pointers);
+    free(rows);
+    fclose(infile);
+    return rv;
+}
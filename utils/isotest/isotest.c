@@ -6,6 +6,12 @@
    Test ISO filesystem reader. This is a functional duplicate of fs_iso9660, but
    designed to run on a PC for testing.
 
+   It can also take a trace of the file reads a game makes and work out
+   how long they would take from a GD-ROM, with the files where they are
+   on the image and in a better order, which it writes out as a sort file
+   for mkisofs, and replay several streams at once through the asynchronous
+   reader to see how its request ordering does.
+
 */
 
 /*
@@ -20,6 +26,13 @@ In Linux, accessing the /dev device on a single-session CD puts the
 /****************************** LINUX SPECIFIC CODE ***********************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
 
 typedef unsigned char uint8;
 typedef unsigned short uint16;
@@ -28,6 +41,16 @@ typedef signed char int8;
 typedef signed short int16;
 typedef signed long int32;
 
+/* The disc (or an image of one) and the sector it starts at. An image
+   built for a GD-ROM's high density area with mkisofs -C 0,45000 holds
+   sectors from 45000 on, so that is subtracted out again here. */
+static const char *image_name = "/dev/scd0";
+static uint32 image_lba = 0;
+
+/* When set, reads are played against the GD-ROM model too */
+static int replay_active = 0;
+static void replay_access(uint32 sector, uint32 cnt);
+
 /* Low-level sector read (for Linux to emulate hardware/cd.c) */
 static int cdrom_read_sectors(char *buffer, uint32 sector, uint32 cnt) {
     FILE *f;
@@ -35,12 +58,21 @@ static int cdrom_read_sectors(char *buffer, uint32 sector, uint32 cnt) {
     /* Subtract out DC's LBA offset */
     sector -= 150;
 
-    f = fopen("/dev/scd0", "r");
+    if(sector < image_lba) return -1;
+
+    if(replay_active)
+        replay_access(sector, cnt);
+
+    f = fopen(image_name, "r");
 
     if(!f) return -1;
 
-    fseek(f, sector * 2048, SEEK_SET);
-    fread(buffer, cnt * 2048, 1, f);
+    fseek(f, (long)(sector - image_lba) * 2048, SEEK_SET);
+
+    if(fread(buffer, cnt * 2048, 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
 
     fclose(f);
     return 0;
@@ -56,7 +88,33 @@ int cdrom_read_toc(CDROM_TOC *toc, int session) {
     return 0;
 }
 uint32 cdrom_locate_data_track(CDROM_TOC *toc) {
-    return 150;
+    return 150 + image_lba;
+}
+
+/* Opens an image, working out from the root directory's extent whether it
+   was built to sit at the start of the disc or of the high density area */
+int image_open(const char *fn) {
+    unsigned char pvd[2048];
+    uint32 root;
+    FILE *f;
+
+    if(!(f = fopen(fn, "r"))) {
+        perror(fn);
+        return -1;
+    }
+
+    if(fseek(f, 16 * 2048, SEEK_SET) || fread(pvd, 2048, 1, f) != 1
+            || memcmp(pvd, "\01CD001", 6)) {
+        fprintf(stderr, "%s: not an ISO9660 image\n", fn);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    root = pvd[158] | (pvd[159] << 8) | (pvd[160] << 16) | ((uint32)pvd[161] << 24);
+    image_name = fn;
+    image_lba = root >= 45000 ? 45000 : 0;
+    return 0;
 }
 
 /* KOS VFS prims */
@@ -80,10 +138,57 @@ int fs_handler_remove(void *p) {
 }
 
 /* Thread prims */
-typedef int thd_mutex_t;
-void thd_mutex_reset(int *p) { }
-void thd_mutex_lock(int *p) { }
-void thd_mutex_unlock(int *p) { }
+typedef pthread_mutex_t thd_mutex_t;
+void thd_mutex_reset(thd_mutex_t *p) {
+    pthread_mutex_init(p, NULL);
+}
+void thd_mutex_lock(thd_mutex_t *p) {
+    pthread_mutex_lock(p);
+}
+void thd_mutex_unlock(thd_mutex_t *p) {
+    pthread_mutex_unlock(p);
+}
+
+typedef pthread_cond_t thd_cond_t;
+void thd_cond_reset(thd_cond_t *c) {
+    pthread_cond_init(c, NULL);
+}
+void thd_cond_wait(thd_cond_t *c, thd_mutex_t *m) {
+    pthread_cond_wait(c, m);
+}
+void thd_cond_signal(thd_cond_t *c) {
+    pthread_cond_signal(c);
+}
+void thd_cond_broadcast(thd_cond_t *c) {
+    pthread_cond_broadcast(c);
+}
+
+typedef struct {
+    pthread_t   tid;
+    void        (*routine)(void *);
+    void        *param;
+} kthread_t;
+static void *thd_trampoline(void *p) {
+    kthread_t *t = (kthread_t *)p;
+    t->routine(t->param);
+    return NULL;
+}
+kthread_t *thd_create(void (*routine)(void *), void *param) {
+    kthread_t *t = malloc(sizeof(kthread_t));
+    t->routine = routine;
+    t->param = param;
+
+    if(pthread_create(&t->tid, NULL, thd_trampoline, t)) {
+        free(t);
+        return NULL;
+    }
+
+    return t;
+}
+void thd_wait(kthread_t *t) {
+    pthread_join(t->tid, NULL);
+    free(t);
+}
 
 /* iso9660 defines */
 #define MAX_ISO_FILES 8
@@ -501,10 +606,13 @@ off_t iso_seek(uint32 fd, off_t offset, int whence) {
     switch(whence) {
         case SEEK_SET:
             fh[fd].ptr = offset;
+            break;
         case SEEK_CUR:
             fh[fd].ptr += offset;
+            break;
         case SEEK_END:
             fh[fd].ptr = fh[fd].size + offset;
+            break;
         default:
             return -1;
     }
@@ -595,6 +703,239 @@ dirent_t *iso_readdir(uint32 fd) {
     return &fh[fd].dirent;
 }
 
+/********************************************************************************/
+/* Asynchronous reads. Requests are queued and served by a single I/O
+   thread, a chunk at a time, in sweeps: the requests waiting when a sweep
+   starts are taken in sector order from where the head is, wrapping round
+   to the lowest (a one-way elevator, since the disc only reads forwards),
+   and anything submitted meanwhile waits for the next sweep. A request
+   gets at most ISO_AREAD_BATCH chunks per sweep, so a long read can't
+   starve a stream and a stream that keeps submitting just ahead of the
+   head can't starve the rest. The data goes straight to the caller's
+   buffer, never through the block cache or cache_mutex. */
+
+/* A read request. The caller fills in the first part, and must leave the
+   request alone from iso_submit() until it is done. */
+typedef struct iso_req {
+    uint32      fd;
+    void        *buf;
+    uint32      pos;        /* Offset in the file, in bytes */
+    size_t      bytes;
+    void        (*callback)(struct iso_req *req);   /* May be NULL */
+    void        *data;      /* For the callback */
+
+    /* Filled in by the reader */
+    volatile int done;
+    int         result;     /* Bytes read, or -1 */
+    uint32      extent;     /* The file's, as it was at submission */
+    uint32      left;       /* Bytes still to read */
+    int         run;        /* Chunks read for it in this sweep */
+    struct iso_req *next;
+} iso_req_t;
+
+/* Sectors read for a request before the queue is looked at again, and
+   chunks a request may have in one sweep */
+#define ISO_AREAD_CHUNK     32
+#define ISO_AREAD_BATCH     4
+
+/* 0 serves requests in submission order instead, for comparison */
+static int iso_elevator = 1;
+
+static iso_req_t    *aread_queue, *aread_tail;  /* Waiting for a sweep */
+static iso_req_t    *aread_sweep;               /* This sweep, in order */
+static thd_mutex_t  aread_mutex;
+static thd_cond_t   aread_cond;     /* The queue has something in it */
+static thd_cond_t   aread_done;     /* Some request has finished */
+static kthread_t    *aread_thd;
+static int          aread_quit;
+static uint32       aread_head;     /* Sector after the last one read */
+static uint32       aread_seeks;    /* Times the head had to move */
+
+/* Queue a read; the callback, if there is one, runs on the I/O thread
+   once it is done. Returns 0, or -1 if fd isn't an open file. */
+int iso_submit(iso_req_t *req) {
+    if(req->fd >= MAX_ISO_FILES || fh[req->fd].first_extent == 0
+            || fh[req->fd].dir)
+        return -1;
+
+    req->extent = fh[req->fd].first_extent;
+
+    if(req->pos > fh[req->fd].size)
+        req->left = 0;
+    else if(req->bytes > fh[req->fd].size - req->pos)
+        req->left = fh[req->fd].size - req->pos;
+    else
+        req->left = req->bytes;
+
+    req->result = req->left;
+    req->done = 0;
+    req->run = 0;
+    req->next = NULL;
+
+    thd_mutex_lock(&aread_mutex);
+
+    if(aread_tail)
+        aread_tail->next = req;
+    else
+        aread_queue = req;
+
+    aread_tail = req;
+    thd_cond_signal(&aread_cond);
+    thd_mutex_unlock(&aread_mutex);
+    return 0;
+}
+
+/* Nonzero once a request is done */
+int iso_poll(iso_req_t *req) {
+    return req->done;
+}
+
+/* Waits for a request to finish and returns the bytes read, or -1 */
+int iso_wait(iso_req_t *req) {
+    thd_mutex_lock(&aread_mutex);
+
+    while(!req->done)
+        thd_cond_wait(&aread_done, &aread_mutex);
+
+    thd_mutex_unlock(&aread_mutex);
+    return req->result;
+}
+
+/* How far the head has to go to get to a request, wrapping round */
+static uint32 aread_distance(iso_req_t *req) {
+    uint32 sector = req->extent + req->pos / 2048;
+
+    return sector >= aread_head ? sector - aread_head : sector + 0x80000000;
+}
+
+/* Picks the next request to serve, starting a sweep if need be; called
+   with aread_mutex held and something queued */
+static iso_req_t *aread_pick() {
+    iso_req_t *req, **pp;
+
+    if(!iso_elevator)
+        return aread_queue;
+
+    if(!aread_sweep) {
+        while((req = aread_queue)) {
+            aread_queue = req->next;
+
+            for(pp = &aread_sweep; *pp; pp = &(*pp)->next) {
+                if(aread_distance(req) < aread_distance(*pp))
+                    break;
+            }
+
+            req->next = *pp;
+            *pp = req;
+        }
+
+        aread_tail = NULL;
+    }
+
+    return aread_sweep;
+}
+
+/* Reads the next chunk of a request into its buffer */
+static int aread_chunk(iso_req_t *req) {
+    static uint8 bounce[2048];
+    uint32 sector, off, n;
+
+    sector = req->extent + req->pos / 2048;
+    off = req->pos % 2048;
+
+    if(sector != aread_head)
+        aread_seeks++;
+
+    if(off || req->left < 2048) {
+        /* part of a sector */
+        if(cdrom_read_sectors((char *)bounce, sector + 150, 1) < 0)
+            return -1;
+
+        n = 2048 - off < req->left ? 2048 - off : req->left;
+        memcpy(req->buf, bounce + off, n);
+        aread_head = sector + 1;
+    }
+    else {
+        n = req->left / 2048;
+        n = n > ISO_AREAD_CHUNK ? ISO_AREAD_CHUNK : n;
+
+        if(cdrom_read_sectors(req->buf, sector + 150, n) < 0)
+            return -1;
+
+        aread_head = sector + n;
+        n *= 2048;
+    }
+
+    req->buf = (uint8 *)req->buf + n;
+    req->pos += n;
+    req->left -= n;
+    return 0;
+}
+
+/* The I/O thread */
+static void aread_thread(void *p) {
+    iso_req_t *req;
+    int rv, done;
+
+    thd_mutex_lock(&aread_mutex);
+
+    for(;;) {
+        while(!aread_queue && !aread_sweep && !aread_quit)
+            thd_cond_wait(&aread_cond, &aread_mutex);
+
+        if(aread_quit)
+            break;
+
+        req = aread_pick();
+        thd_mutex_unlock(&aread_mutex);
+
+        rv = req->left ? aread_chunk(req) : 0;
+
+        thd_mutex_lock(&aread_mutex);
+
+        done = rv < 0 || !req->left;
+
+        if(!iso_elevator) {
+            /* served from the front of the queue until it is done */
+            if(done && !(aread_queue = req->next))
+                aread_tail = NULL;
+        }
+        else if(done || ++req->run >= ISO_AREAD_BATCH) {
+            /* out of this sweep, and into the next if there is more */
+            aread_sweep = req->next;
+
+            if(!done) {
+                req->run = 0;
+                req->next = NULL;
+
+                if(aread_tail)
+                    aread_tail->next = req;
+                else
+                    aread_queue = req;
+
+                aread_tail = req;
+            }
+        }
+
+        if(done) {
+            thd_mutex_unlock(&aread_mutex);
+
+            if(rv < 0)
+                req->result = -1;
+
+            /* the request is the caller's again once done is set */
+            if(req->callback)
+                req->callback(req);
+
+            thd_mutex_lock(&aread_mutex);
+            req->done = 1;
+            thd_cond_broadcast(&aread_done);
+        }
+    }
+
+    thd_mutex_unlock(&aread_mutex);
+}
+
 /* Put everything together */
 static vfs_handler vh = {
     0, 0,       /* In-kernel, no cacheing */
@@ -623,6 +964,16 @@ int fs_iso9660_init() {
     /* Init thread mutexes */
     thd_mutex_reset(&cache_mutex);
     thd_mutex_reset(&fh_mutex);
+    thd_mutex_reset(&aread_mutex);
+    thd_cond_reset(&aread_cond);
+    thd_cond_reset(&aread_done);
+
+    /* Start the I/O thread for asynchronous reads */
+    aread_queue = aread_tail = aread_sweep = NULL;
+    aread_quit = 0;
+
+    if(!(aread_thd = thd_create(aread_thread, NULL)))
+        return -1;
 
     /* Allocate cache block space */
     for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
@@ -638,6 +989,13 @@ int fs_iso9660_init() {
 int fs_iso9660_shutdown() {
     int i;
 
+    /* Stop the I/O thread; anything still queued is dropped */
+    thd_mutex_lock(&aread_mutex);
+    aread_quit = 1;
+    thd_cond_signal(&aread_cond);
+    thd_mutex_unlock(&aread_mutex);
+    thd_wait(aread_thd);
+
     /* Dealloc cache block space */
     for(i = 0; i < NUM_CACHE_BLOCKS; i++)
         free(cache[i]);
@@ -683,73 +1041,737 @@ void read_dir(uint32 extent, uint32 size) {
 }
 
 
-void main() {
-    fs_iso9660_init();
+/********************************************************************************/
+/* Disc layout. A trace of file reads is played against a model of the
+   GD-ROM, first with the files where the image has them and then in an
+   order worked out from the trace. */
+
+/* GD-ROM model. The drive spins at a constant angular velocity, so more
+   sectors pass under the head per turn towards the outside. The high
+   density area starts at LBA 45000 and runs from a radius of about 33mm
+   to 58mm, on a 0.84 micron track pitch. A seek costs a fixed settling
+   time plus a part that grows with the square root of the distance, and
+   then the drive waits for the sector to come round. Reads that start
+   within a turn ahead of the last one are streamed through instead. These
+   are estimates, good for comparing layouts rather than exact timings. */
+#define GD_HD_LBA       45000
+#define GD_HD_SECTORS   504150
+#define GD_R0           33.0        /* mm */
+#define GD_R1           58.0
+#define GD_PITCH        0.00084
+#define GD_RPS          40.0        /* 2400 rpm */
+#define GD_SEEK_MIN     0.015       /* seconds */
+#define GD_SEEK_FULL    0.200
+#define GD_COMMAND      0.0005
+
+typedef struct {
+    double  time;           /* Seconds since the start */
+    uint32  head;           /* Sector under the head */
+    int     seeks;
+} gd_state_t;
+
+static double gd_radius(uint32 lba) {
+    double k = (GD_R1 * GD_R1 - GD_R0 * GD_R0) / GD_HD_SECTORS;
+
+    if(lba < GD_HD_LBA)
+        lba = GD_HD_LBA;
+
+    return sqrt(GD_R0 * GD_R0 + (lba - GD_HD_LBA) * k);
+}
+
+/* Turns of the spiral from the start of the high density area; the
+   fraction is the angle the sector sits at */
+static double gd_turns(uint32 lba) {
+    return (gd_radius(lba) - GD_R0) / GD_PITCH;
+}
 
-    /*
-    {
-    uint32  fd, size, t;
-    char    buf[667];
-
-    printf("Opening file /escape.txt\n");
-    fd = iso_open("/escape.txt", O_RDONLY);
-    if (fd == 0) {
-        printf("Couldn't open file\n");
-        return;
-    }
-    size = iso_total(fd);
-    printf("fd is %d, size is %08lx\n", fd, size);
-
-    while (size > 0) {
-        int r;
-        r = iso_read(fd, buf, 666);
-        if (r < 0) {
-            printf("Read error\n");
-            return;
+static void gd_reset(gd_state_t *gd, uint32 lba) {
+    gd->head = lba;
+    gd->time = gd_turns(lba) / GD_RPS;
+    gd->seeks = 0;
+}
+
+/* Reads count sectors from lba. The disc's angle is the time in turns. */
+static void gd_read(gd_state_t *gd, uint32 lba, uint32 count) {
+    double ahead, wait;
+
+    ahead = gd_turns(lba) - gd_turns(gd->head);
+
+    if(lba >= gd->head && ahead < 1.0) {
+        /* the drive just keeps reading */
+        gd->time += ahead / GD_RPS;
+    }
+    else {
+        gd->time += GD_COMMAND + GD_SEEK_MIN + (GD_SEEK_FULL - GD_SEEK_MIN) *
+                    sqrt(fabs(gd_radius(lba) - gd_radius(gd->head)) / (GD_R1 - GD_R0));
+        wait = gd_turns(lba) - gd->time * GD_RPS;
+        gd->time += (wait - floor(wait)) / GD_RPS;
+        gd->seeks++;
+    }
+
+    gd->time += (gd_turns(lba + count) - gd_turns(lba)) / GD_RPS;
+    gd->head = lba + count;
+}
+
+/* Every file on the image */
+typedef struct {
+    char    path[MAX_FN_LEN];   /* Without the leading /, lowercased */
+    char    isopath[MAX_FN_LEN]; /* As the directories have it */
+    uint32  extent;
+    uint32  sectors;
+    int     first;          /* First trace read from it, or -1 */
+} layout_file_t;
+
+/* One read from the trace, in sectors from the start of a file */
+typedef struct {
+    int     file;
+    uint32  sector;
+    uint32  count;
+} trace_read_t;
+
+static layout_file_t *files;
+static int nfiles, files_alloc;
+
+/* Where a sector on the image sits on the disc; a plain image would be
+   burnt at the start of the high density area */
+static uint32 disc_lba(uint32 extent) {
+    return image_lba ? extent : extent + GD_HD_LBA;
+}
+
+/* Adds the files under a directory, with their paths from the root */
+static int add_files(uint32 extent, uint32 size, const char *dir) {
+    uint8   buf[2048];
+    char    name[MAX_FN_LEN], path[MAX_FN_LEN], isopath[MAX_FN_LEN];
+    char    *p;
+    iso_dirent_t *de;
+    int     i, c;
+
+    for(; size > 0; extent++, size -= size > 2048 ? 2048 : size) {
+        if((c = bread(extent)) < 0)
+            return -1;
+
+        /* the cache block won't last through the subdirectories */
+        memcpy(buf, cache[c]->data, 2048);
+
+        for(i = 0; i < 2048 && i < size; i += de->length) {
+            de = (iso_dirent_t *)(buf + i);
+
+            if(!de->length)
+                break;
+
+            /* . and .. */
+            if(de->name_len == 1 && (uint8)de->name[0] <= 1)
+                continue;
+
+            strncpy(name, de->name, de->name_len);
+            name[de->name_len] = 0;
+
+            if((p = strchr(name, ';')))
+                *p = 0;
+
+            /* mkisofs gives names without an extension a trailing . */
+            if(*name && name[strlen(name) - 1] == '.')
+                name[strlen(name) - 1] = 0;
+
+            snprintf(isopath, sizeof(isopath), "%s%s%s", dir, *dir ? "/" : "",
+                     name);
+            strcpy(path, isopath);
+            fn_postprocess(path);
+
+            if(de->flags & 2) {
+                if(add_files(iso_733(de->extent), iso_733(de->size),
+                             isopath) < 0)
+                    return -1;
+
+                continue;
+            }
+
+            if(nfiles == files_alloc) {
+                files_alloc = files_alloc ? files_alloc * 2 : 256;
+                files = realloc(files, files_alloc * sizeof(layout_file_t));
+            }
+
+            strcpy(files[nfiles].path, path);
+            strcpy(files[nfiles].isopath, isopath);
+            files[nfiles].extent = iso_733(de->extent);
+            files[nfiles].sectors = (iso_733(de->size) + 2047) / 2048;
+            files[nfiles].first = -1;
+            nfiles++;
         }
-        buf[r] = 0;
-        printf("%s", buf);
-        if (strstr(buf, "Let the party")) {
-            t = 0;
+    }
+
+    return 0;
+}
+
+static int cmp_file_path(const void *a, const void *b) {
+    return strcasecmp(((const layout_file_t *)a)->path,
+                      ((const layout_file_t *)b)->path);
+}
+
+/* Reads a trace: one read per line, as a path and optionally the offset
+   and length in bytes, the rest of the file by default. Paths may start
+   with /cd/ as they would under KOS. */
+static trace_read_t *read_trace(const char *fn, int *count) {
+    trace_read_t *tr = NULL;
+    layout_file_t key, *f;
+    char    line[1024], path[MAX_FN_LEN], *p;
+    unsigned long off, len, size;
+    int     n = 0, alloc = 0, fields, lineno = 0;
+    FILE    *fp;
+
+    if(!(fp = fopen(fn, "r"))) {
+        perror(fn);
+        return NULL;
+    }
+
+    while(fgets(line, sizeof(line), fp)) {
+        lineno++;
+        off = 0;
+        len = 0;
+        fields = sscanf(line, "%255s %lu %lu", path, &off, &len);
+
+        if(fields < 1 || path[0] == '#')
+            continue;
+
+        p = path;
+
+        if(!strncmp(p, "/cd/", 4))
+            p += 4;
+
+        while(*p == '/')
+            p++;
+
+        strcpy(key.path, p);
+        f = bsearch(&key, files, nfiles, sizeof(layout_file_t), cmp_file_path);
+
+        if(!f) {
+            fprintf(stderr, "%s:%d: %s is not on the image\n", fn, lineno, path);
+            continue;
+        }
+
+        size = f->sectors * 2048;
+
+        if(off >= size)
+            continue;
+
+        if(fields < 3 || off + len > size)
+            len = size - off;
+
+        if(!len)
+            continue;
+
+        if(n == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            tr = realloc(tr, alloc * sizeof(trace_read_t));
+        }
+
+        tr[n].file = f - files;
+        tr[n].sector = off / 2048;
+        tr[n].count = (off + len - 1) / 2048 - off / 2048 + 1;
+
+        if(f->first < 0)
+            f->first = n;
+
+        n++;
+    }
+
+    fclose(fp);
+    *count = n;
+    return tr;
+}
+
+/* Plays the trace against the model with each file i starting at
+   where[i], and returns the time it takes */
+static double simulate(const trace_read_t *tr, int ntr, const uint32 *where,
+                       int *seeks) {
+    gd_state_t gd;
+    int i;
+
+    gd_reset(&gd, disc_lba(root_extent));
+
+    for(i = 0; i < ntr; i++)
+        gd_read(&gd, disc_lba(where[tr[i].file]) + tr[i].sector, tr[i].count);
+
+    if(seeks)
+        *seeks = gd.seeks;
+
+    return gd.time;
+}
+
+/* Lays the files out one after another from start, in the given order */
+static void place(const int *order, uint32 start, uint32 *where) {
+    int i;
+
+    for(i = 0; i < nfiles; i++) {
+        where[order[i]] = start;
+        start += files[order[i]].sectors;
+    }
+}
+
+static int cmp_first_read(const void *a, const void *b) {
+    const layout_file_t *fa = files + *(const int *)a, *fb = files + *(const int *)b;
+
+    if((fa->first < 0) != (fb->first < 0))
+        return fa->first < 0 ? 1 : -1;
+
+    if(fa->first != fb->first)
+        return fa->first < fb->first ? -1 : 1;
+
+    return fa->extent < fb->extent ? -1 : fa->extent > fb->extent;
+}
+
+/* Works out a better file order for the trace: the files it reads in the
+   order it first reads them, then swapping neighbours while that helps.
+   The files it doesn't read either go after them or, since the outside of
+   the disc is faster, before them; whichever is quicker. */
+static double optimize(const trace_read_t *tr, int ntr, int *order, uint32 start,
+                       uint32 *where) {
+    int     i, j, t, nread, pass, improved, *alt;
+    double  best, cur;
+
+    for(i = 0; i < nfiles; i++)
+        order[i] = i;
+
+    qsort(order, nfiles, sizeof(int), cmp_first_read);
+
+    for(nread = 0; nread < nfiles && files[order[nread]].first >= 0; nread++)
+        ;
+
+    place(order, start, where);
+    best = simulate(tr, ntr, where, NULL);
+
+    for(pass = 0, improved = 1; improved && pass < 8; pass++) {
+        improved = 0;
+
+        for(i = 0; i + 1 < nread; i++) {
+            t = order[i];
+            order[i] = order[i + 1];
+            order[i + 1] = t;
+            place(order, start, where);
+            cur = simulate(tr, ntr, where, NULL);
+
+            if(cur < best - 1e-9) {
+                best = cur;
+                improved = 1;
+            }
+            else {
+                order[i + 1] = order[i];
+                order[i] = t;
+            }
+        }
+    }
+
+    /* Try the unread files in front */
+    alt = malloc(nfiles * sizeof(int));
+
+    for(i = nread, j = 0; i < nfiles; i++)
+        alt[j++] = order[i];
+
+    for(i = 0; i < nread; i++)
+        alt[j++] = order[i];
+
+    place(alt, start, where);
+    cur = simulate(tr, ntr, where, NULL);
+
+    if(cur < best) {
+        best = cur;
+        memcpy(order, alt, nfiles * sizeof(int));
+    }
+
+    free(alt);
+    place(order, start, where);
+    return best;
+}
+
+/* Finds the file an image path was made from under the directory prefix
+   (the current one if it's empty). mkisofs matches the sort file against
+   the paths it was given, so they have to be the host's, case and all,
+   while the image only has the ISO 9660 names. */
+static int host_path(const char *prefix, const char *isopath, char *out) {
+    char    comp[MAX_FN_LEN];
+    const char *p, *e;
+    struct dirent *d;
+    DIR     *dir;
+    size_t  len;
+
+    snprintf(out, MAX_FN_LEN, "%s", prefix);
+
+    for(p = isopath; *p; p = *e ? e + 1 : e) {
+        if(!(e = strchr(p, '/')))
+            e = p + strlen(p);
+
+        snprintf(comp, sizeof(comp), "%.*s", (int)(e - p), p);
+
+        if(!(dir = opendir(*out ? out : ".")))
+            return -1;
+
+        while((d = readdir(dir)) && strcasecmp(d->d_name, comp))
+            ;
+
+        len = strlen(out);
+
+        if(d)
+            snprintf(out + len, MAX_FN_LEN - len, "%s%s",
+                     len && out[len - 1] != '/' ? "/" : "",
+                     d->d_name);
+
+        closedir(dir);
+
+        if(!d)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Writes a sort file for mkisofs -sort: files with higher weights go
+   first on the image. Files that aren't found under prefix go in with
+   their names from the image, which mkisofs may not match. */
+static int write_sort(const char *fn, const char *prefix, const int *order) {
+    FILE    *fp;
+    char    path[MAX_FN_LEN];
+    int     i;
+
+    if(!(fp = fopen(fn, "w"))) {
+        perror(fn);
+        return -1;
+    }
+
+    for(i = 0; i < nfiles; i++) {
+        if(host_path(prefix, files[order[i]].isopath, path) < 0) {
+            snprintf(path, sizeof(path), "%s%s%s", prefix,
+                     *prefix && prefix[strlen(prefix) - 1] != '/' ? "/" : "",
+                     files[order[i]].isopath);
+            fprintf(stderr, "%s: not found, written as on the image\n", path);
+        }
+
+        fprintf(fp, "%s %d\n", path, nfiles - i);
+    }
+
+    if(fclose(fp)) {
+        perror(fn);
+        return -1;
+    }
+
+    return 0;
+}
+
+int layout(const char *tracefn, const char *sortfn, const char *prefix) {
+    trace_read_t *tr;
+    uint32  *where, start = 0xffffffff, sectors = 0;
+    int     *order, i, ntr, seeks;
+    double  t;
+
+    if(init_percd() < 0 || add_files(root_extent, root_size, "") < 0) {
+        fprintf(stderr, "can't read the image's directories\n");
+        return -1;
+    }
+
+    if(!nfiles) {
+        fprintf(stderr, "no files on the image\n");
+        return -1;
+    }
+
+    qsort(files, nfiles, sizeof(layout_file_t), cmp_file_path);
+
+    if(!(tr = read_trace(tracefn, &ntr)))
+        return -1;
+
+    where = malloc(nfiles * sizeof(uint32));
+    order = malloc(nfiles * sizeof(int));
+
+    for(i = 0; i < nfiles; i++) {
+        where[i] = files[i].extent;
+
+        if(files[i].extent < start)
+            start = files[i].extent;
+    }
+
+    for(i = 0; i < ntr; i++)
+        sectors += tr[i].count;
+
+    printf("%d files, %d reads of %lu sectors\n", nfiles, ntr,
+           (unsigned long)sectors);
+
+    t = simulate(tr, ntr, where, &seeks);
+    printf("current layout:   %8.3f s, %d seeks\n", t, seeks);
+
+    optimize(tr, ntr, order, start, where);
+    t = simulate(tr, ntr, where, &seeks);
+    printf("optimized layout: %8.3f s, %d seeks\n", t, seeks);
+
+    if(sortfn && write_sort(sortfn, prefix, order) < 0)
+        return -1;
+
+    free(order);
+    free(where);
+    free(tr);
+    return 0;
+}
+
+/********************************************************************************/
+/* Replay. Streams files concurrently through the asynchronous reader, one
+   thread each, while the reads that reach the disc are played against the
+   GD-ROM model, and checks the data against iso_read(). */
+
+typedef struct {
+    const char  *path;
+    uint32      fd, size, chunk;
+    int         depth;          /* Requests kept in flight */
+    uint8       *data;
+    double      maxwait, totalwait;
+    int         nreqs, failed;
+} stream_t;
+
+/* One request in flight, and the model time it went in at */
+typedef struct {
+    iso_req_t   req;
+    stream_t    *s;
+    double      submitted;
+} stream_req_t;
+
+/* How much faster than the model the reads go. They do take time, so
+   that the streams keep the queue full the way they would with a real
+   drive rather than finding every read done as soon as it's asked for. */
+#define REPLAY_SPEEDUP  20.0
+
+static gd_state_t   replay_gd;
+static thd_mutex_t  replay_mutex;
+
+static void replay_access(uint32 sector, uint32 cnt) {
+    double t;
+
+    thd_mutex_lock(&replay_mutex);
+    t = replay_gd.time;
+    gd_read(&replay_gd, disc_lba(sector - 150), cnt);
+    t = replay_gd.time - t;
+    thd_mutex_unlock(&replay_mutex);
+
+    usleep((useconds_t)(t * 1000000.0 / REPLAY_SPEEDUP));
+}
+
+static double replay_now() {
+    double t;
+
+    thd_mutex_lock(&replay_mutex);
+    t = replay_gd.time;
+    thd_mutex_unlock(&replay_mutex);
+    return t;
+}
+
+static void stream_done(iso_req_t *req) {
+    stream_req_t *sr = (stream_req_t *)req->data;
+    double wait = replay_now() - sr->submitted;
+
+    /* only this stream's thread submits its requests, and only one
+       callback runs at a time */
+    if(wait > sr->s->maxwait)
+        sr->s->maxwait = wait;
+
+    sr->s->totalwait += wait;
+    sr->s->nreqs++;
+
+    if(req->result < 0)
+        sr->s->failed = 1;
+}
+
+static void stream_thread(void *p) {
+    stream_t *s = (stream_t *)p;
+    stream_req_t *slots;
+    uint32 pos;
+    int i;
+
+    slots = calloc(s->depth, sizeof(stream_req_t));
+
+    for(pos = 0, i = 0; pos < s->size; pos += s->chunk, i = (i + 1) % s->depth) {
+        if(slots[i].s && iso_wait(&slots[i].req) < 0)
+            s->failed = 1;
+
+        slots[i].s = s;
+        slots[i].req.fd = s->fd;
+        slots[i].req.buf = s->data + pos;
+        slots[i].req.pos = pos;
+        slots[i].req.bytes = s->chunk;
+        slots[i].req.callback = stream_done;
+        slots[i].req.data = slots + i;
+        slots[i].submitted = replay_now();
+
+        if(iso_submit(&slots[i].req) < 0) {
+            s->failed = 1;
+            slots[i].s = NULL;
+            break;
         }
-        size -= r;
     }
-    printf("\nFile read is done\n");
-    iso_close(fd); */
 
-    {
-        uint32      fd, t;
-        dirent_t    *de;
+    for(i = 0; i < s->depth; i++) {
+        if(slots[i].s && iso_wait(&slots[i].req) < 0)
+            s->failed = 1;
+    }
+
+    free(slots);
+}
+
+/* Each stream is given as path[:chunk[:depth]], chunk in bytes */
+int replay(int nstreams, char **specs) {
+    stream_t    *st;
+    kthread_t   **thds;
+    uint8       *check;
+    char        *p;
+    int         i, mode, bad = 0;
+    uint32      got;
+
+    if(init_percd() < 0)
+        return -1;
+
+    st = calloc(nstreams, sizeof(stream_t));
+    thds = calloc(nstreams, sizeof(kthread_t *));
+    thd_mutex_reset(&replay_mutex);
+
+    for(i = 0; i < nstreams; i++) {
+        st[i].path = specs[i];
+        st[i].chunk = 65536;
+        st[i].depth = 2;
 
-        printf("Opening /demos");
-        fd = iso_open("/music/mc2/entries/rookie", O_RDONLY | O_DIR);
+        if((p = strchr(specs[i], ':'))) {
+            *p++ = 0;
+            st[i].chunk = strtoul(p, &p, 0);
 
-        if(fd == 0) {
-            printf("Couldn't open file\n");
-            return;
+            if(*p == ':')
+                st[i].depth = atoi(p + 1);
         }
 
-        printf("Scanning dir:\n");
+        if(!st[i].chunk || st[i].depth < 1) {
+            fprintf(stderr, "bad stream %s\n", specs[i]);
+            return -1;
+        }
 
-        while((de = iso_readdir(fd))) {
-            printf("%s\t%d\n", de->name, de->size);
+        if(!(st[i].fd = iso_open(st[i].path, O_RDONLY))) {
+            fprintf(stderr, "can't open %s\n", st[i].path);
+            return -1;
+        }
+
+        st[i].size = iso_total(st[i].fd);
+        st[i].data = malloc(st[i].size + 1);
+    }
+
+    for(mode = 0; mode < 2; mode++) {
+        iso_elevator = mode;
+        aread_seeks = 0;
+        gd_reset(&replay_gd, disc_lba(root_extent));
+        replay_active = 1;
+
+        for(i = 0; i < nstreams; i++) {
+            memset(st[i].data, 0, st[i].size);
+            st[i].maxwait = st[i].totalwait = 0.0;
+            st[i].nreqs = st[i].failed = 0;
+            thds[i] = thd_create(stream_thread, st + i);
+        }
 
-            if(!strcmp(de->name, "R_WAR.ZIP")) {
-                t = 0;
+        for(i = 0; i < nstreams; i++)
+            thd_wait(thds[i]);
+
+        replay_active = 0;
+        printf("%s: %.3f s on the GD-ROM, %d seeks\n",
+               mode ? "elevator" : "in order", replay_gd.time, (int)aread_seeks);
+
+        for(i = 0; i < nstreams; i++) {
+            /* the same data through the synchronous reader */
+            check = malloc(st[i].size + 1);
+            iso_seek(st[i].fd, 0, SEEK_SET);
+            got = iso_read(st[i].fd, check, st[i].size);
+
+            if(st[i].failed || got != st[i].size
+                    || memcmp(check, st[i].data, st[i].size)) {
+                printf("  %s: data mismatch\n", st[i].path);
+                bad = 1;
             }
+
+            printf("  %-24s %5d reads, wait %.3f s at most, %.3f s on average\n",
+                   st[i].path, st[i].nreqs, st[i].maxwait,
+                   st[i].nreqs ? st[i].totalwait / st[i].nreqs : 0.0);
+            free(check);
         }
+    }
 
-        iso_close(fd);
+    for(i = 0; i < nstreams; i++) {
+        iso_close(st[i].fd);
+        free(st[i].data);
     }
+
+    free(thds);
+    free(st);
+    return bad ? -1 : 0;
 }
 
+static void usage() {
+    printf("usage: isotest [image [dir]]\n");
+    printf("       isotest -l <image> <trace> [sort file [prefix]]\n");
+    printf("       isotest -r <image> <path[:chunk[:depth]]> [path..]\n\n");
+    printf("With no -l, lists a directory on the image (default /dev/scd0).\n\n");
+    printf("-l plays a trace of file reads against a model of the GD-ROM and\n");
+    printf("reports how long they take as the image is laid out, and with the\n");
+    printf("files in an order worked out from the trace. That order is written\n");
+    printf("to the sort file for mkisofs -sort as the paths of the files under\n");
+    printf("prefix, the directory the image was made from (default: the current\n");
+    printf("one), matched without regard to case.\n");
+    printf("The trace has one read per line: a path on the disc, and optionally\n");
+    printf("the offset and length in bytes; without them, the whole file.\n\n");
+    printf("-r streams the files at once through the asynchronous reader, each\n");
+    printf("in chunk byte requests (default 65536) with depth of them in flight\n");
+    printf("(default 2), first in submission order and then elevator order. It\n");
+    printf("reports the time and seeks on the GD-ROM model and how long requests\n");
+    printf("waited, and checks the data against iso_read().\n");
+}
 
+int main(int argc, char **argv) {
+    uint32      fd;
+    dirent_t    *de;
 
+    fs_iso9660_init();
 
+    if(argc > 1 && !strcmp(argv[1], "-l")) {
+        if(argc < 4) {
+            usage();
+            return 1;
+        }
 
+        if(image_open(argv[2]) < 0)
+            return 1;
 
+        return layout(argv[3], argc > 4 ? argv[4] : NULL,
+                      argc > 5 ? argv[5] : "") < 0;
+    }
 
+    if(argc > 1 && !strcmp(argv[1], "-r")) {
+        if(argc < 4) {
+            usage();
+            return 1;
+        }
+
+        if(image_open(argv[2]) < 0)
+            return 1;
+
+        return replay(argc - 3, argv + 3) < 0;
+    }
+
+    if(argc > 1 && argv[1][0] == '-') {
+        usage();
+        return argv[1][1] != 'h';
+    }
+
+    if(argc > 1 && image_open(argv[1]) < 0)
+        return 1;
 
+    fd = iso_open(argc > 2 ? argv[2] : "/", O_RDONLY | O_DIR);
 
+    if(fd == 0) {
+        printf("Couldn't open directory\n");
+        return 1;
+    }
 
+    while((de = iso_readdir(fd)))
+        printf("%s\t%d\n", de->name, de->size);
 
+    iso_close(fd);
+    return 0;
+}
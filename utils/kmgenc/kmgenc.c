@@ -12,164 +12,101 @@
 
    The following options are available:
    - Twiddling (or no)
-   - Mipmaps (or no)
+   - Mipmaps (or no), filtered in linear light
    - VQ encoding (or no)
 
    Any combination of these attributes may be selected for the final
    output file. Note that input textures must be a power of 2 on each
    side, though they may not necessarily need to be square. VQ'd textures
-   need to be square (supposedly).
+   need to be square (supposedly). Stride (non-twiddled) textures only
+   need a width that is a multiple of 32, such as 640x480 video frames.
 
    The following output formats are available as well:
    - RGB565
    - ARGB4444
    - ARGB1555
+   - 4bpp and 8bpp paletted, with an ARGB8888 palette
+   - YUV422, for photographic images and video frames
 
    The ARGB formats are not particularly useful unless you're using
    a source PNG with an alpha channel. If you select an RGB format with
    such a file, the alpha channel will be silently ignored (you may get
-   background noise depending on your PNG creation program).
+   background noise depending on your PNG creation program). The paletted
+   formats keep alpha in the palette and ignore the ARGB options.
 
 
-   XXX
-   Note: this is pretty darned unfinished and needs to be combined with
-   vqenc to be complete. For now (since vqenc outputs KMGs as well) I've
-   just put in the basic twiddling operations.
+   The encoding itself lives in libdctex; this is the command line for it.
 
 */
 
-#include "kmgenc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dctex.h"
 
 int use_twiddle = 1;
 int use_verbose = 1;
 int use_debug = 1;
 int use_alpha = 0;
+int use_pal = 0;
+int use_threads = 0;
+int use_mipmap = 0;
+int use_yuv = 0;
+int use_batch = 0;
 
-/* Linear/iterative twiddling algorithm from Marcus' tatest */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
-
-/* This twiddling code is copied from pvr_texture.c, and the original
-   algorithm was written by Vincent Penne. */
-static void twiddle(image_t * src, uint16 * output) {
-    int w = src->w;
-    int h = src->h;
-    int min = MIN(w, h);
-    int mask = min - 1;
-    uint16 * pixels = (uint16 *)src->data;
-    uint16 * vtex = output;
-    int x, y, yout;
-
-    for(y = 0; y < h; y++) {
-        // yout = ((h - 1) - y);
-        yout = y;
-
-        for(x = 0; x < w; x++) {
-            vtex[TWIDOUT(x & mask, yout & mask) +
-                 (x / min + yout / min)*min * min] = pixels[y * w + x];
-        }
-    }
-}
-
-static void convert_to_16(image_t * img) {
-    int i;
-    fcolor_t fc;
-    uint16 * out;
-
-    out = malloc(img->w * img->h * 2);
-
-    for(i = 0; i < img->w * img->h; i++) {
-        get_fcolor_32(&fc, img->data + i * img->bpp);
-        LIMITFC(fc);
-
-        switch(use_alpha) {
-            case 0:
-                out[i] = le16(PACK565(fc.r, fc.g, fc.b));
-                break;
-            case 1:
-                out[i] = le16(PACK4444(fc.a, fc.r, fc.g, fc.b));
-                break;
-            case 2:
-                out[i] = le16(PACK1555(fc.a, fc.r, fc.g, fc.b));
-                break;
-        }
-    }
-
-    img->bpp = 2;
-    free(img->data);
-    img->data = (uint8 *)out;
-}
-
-static int save(const char *filename, image_t *img) {
-    FILE    *fp;
-    kmg_header_t    hdr;
-    uint16      * tmp = NULL;
-    int     fmt, cnt;
-
-    fp = fopen(filename, "wb");
-
-    if(fp == NULL) {
-        fprintf(stderr, "FATAL: cannot create %s\n", filename);
-        return -errno;
-    }
-
-    memset(&hdr, 0, sizeof(hdr));
-    hdr.magic = le32(KMG_MAGIC);
-    hdr.version = le32(KMG_VERSION);
-    hdr.platform = le32(KMG_PLAT_DC);
+/* the library settings matching the command line */
+static void get_params(dctex_params_t *p) {
+    dctex_default_params(p);
 
     switch(use_alpha) {
         case 0:
-            fmt = KMG_DCFMT_RGB565;
+            p->format = KMG_DCFMT_RGB565;
             break;
         case 1:
-            fmt = KMG_DCFMT_ARGB4444;
+            p->format = KMG_DCFMT_ARGB4444;
             break;
         case 2:
-            fmt = KMG_DCFMT_ARGB1555;
+            p->format = KMG_DCFMT_ARGB1555;
             break;
-        default:
-            exit(-1);
     }
 
-    if(use_twiddle)
-        fmt |= KMG_DCFMT_TWIDDLED;
+    if(use_pal)
+        p->format = use_pal == 4 ? KMG_DCFMT_4BPP_PAL : KMG_DCFMT_8BPP_PAL;
+    else if(use_yuv)
+        p->format = KMG_DCFMT_YUV422;
 
-    hdr.format = le32(fmt);
-    hdr.width = le32(img->w);
-    hdr.height = le32(img->h);
-    cnt = img->w * img->h * 2;
-    hdr.byte_count = le32(cnt);
+    p->twiddle = use_twiddle;
+    p->mipmap = use_mipmap;
+    p->kmg = 1;
 
-    if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
-        fprintf(stderr, "FATAL: can't write KMG header to %s\n", filename);
-        goto loser;
-    }
+    /* batch mode already keeps every core busy with a frame each */
+    p->threads = use_batch ? 1 : use_threads;
+    p->log = stdout;
+    p->verbose = use_verbose;
+}
 
-    /* Twiddle the image into a temp buffer */
-    tmp = malloc(cnt);
-    twiddle(img, tmp);
+static int write_file(const char *filename, dctex_buffer_t *buf) {
+    FILE    *fp;
+
+    fp = fopen(filename, "wb");
 
-    /* Write it out */
-    if(fwrite(tmp, cnt, 1, fp) != 1) {
+    if(fp == NULL) {
+        fprintf(stderr, "FATAL: cannot create %s\n", filename);
+        return -errno;
+    }
+
+    if(fwrite(buf->data, buf->size, 1, fp) != 1) {
         fprintf(stderr, "FATAL: can't write KMG data to %s\n", filename);
-        goto loser;
+        fclose(fp);
+        unlink(filename);
+        return -1;
     }
 
-    free(tmp);
     fclose(fp);
     return 0;
-
-loser:
-
-    if(tmp)
-        free(tmp);
-
-    fclose(fp);
-    unlink(filename);
-    return -1;
 }
 
 
@@ -178,29 +115,19 @@ static void banner(const char *progname) {
     printf("\n");
     printf("Options:\n");
     // printf("\t-t, --twiddle\tcreate twiddled textures\n");
-    // printf("\t-m, --mipmap\tcreate mipmapped textures (EXPERIMENTAL)\n");
+    printf("\t-s, --stride\tcreate stride (non-twiddled) textures, any width\n");
+    printf("\t\t\tthat is a multiple of 32\n");
+    printf("\t-m, --mipmap\tcreate mipmapped textures (square only)\n");
     printf("\t-v, --verbose\tverbose\n");
     printf("\t-d, --debug\tshow debug information\n");
     // printf("\t-q, --highq\thigher quality (much slower)\n");
     printf("\t-a4, --argb4444\tuse alpha channel (and output ARGB4444)\n");
     printf("\t-a1, --argb1555\tuse alpha channel (and output ARGB1555)\n");
-}
-
-static int valid_size(int x) {
-    if(x < 2 || x > 1024)
-        return 0;
-
-    while(x) {
-        int bit = (x & 1);
-        x >>= 1;
-
-        if(x && bit) {
-            /* more than one bit in image */
-            return 0;
-        }
-    }
-
-    return 1;
+    printf("\t-p4, --pal4bpp\toutput 4bpp paletted (16 colors)\n");
+    printf("\t-p8, --pal8bpp\toutput 8bpp paletted (256 colors)\n");
+    printf("\t-y, --yuv422\toutput YUV422 (for photos and video frames)\n");
+    printf("\t-b, --batch\tencode the images in parallel, one per thread\n");
+    printf("\t--threads=n\tnumber of threads to use (default: all cores)\n");
 }
 
 static const char *figure_outfilename(const char *f, const char *newext) {
@@ -242,6 +169,8 @@ static void destroy_image(image_t *image) {
 static int encode(const char *infile) {
     int     ok;
     image_t     image;
+    dctex_params_t  params;
+    dctex_buffer_t  out;
     const char  *outfile;
 
     if(use_verbose) {
@@ -253,7 +182,15 @@ static int encode(const char *infile) {
         return -EINVAL;
     }
 
-    if(valid_size(image.w) == 0 || valid_size(image.h) == 0) {
+    get_params(&params);
+
+    if(use_mipmap && image.w != image.h) {
+        fprintf(stderr, "%s is not a square image, mipmaps need one\n", infile);
+        destroy_image(&image);
+        return -EINVAL;
+    }
+
+    if(dctex_check(&image, &params) < 0) {
         fprintf(stderr, "image dimensions for %s are not valid, see manual\n", infile);
         destroy_image(&image);
         return -EINVAL;
@@ -263,27 +200,103 @@ static int encode(const char *infile) {
 
     if(outfile == NULL) {
         fprintf(stderr, "memory allocation failed for %s\n", infile);
+        destroy_image(&image);
         return -ENOMEM;
     }
 
-    /* Convert the input image to a 16-bit image according to parameters */
-    convert_to_16(&image);
+    ok = dctex_encode(&image, &params, &out);
 
-    /* Save it */
-    ok = save(outfile, &image);
+    if(ok < 0)
+        fprintf(stderr, "memory allocation failed for %s\n", infile);
+    else
+        ok = write_file(outfile, &out);
 
+    dctex_free(&out);
     destroy_image(&image);
 
-    printf("\n");
+    if(use_batch)
+        printf("%s\n", outfile);
+    else
+        printf("\n");
+
+    free((char *)outfile);
     return ok;
 }
 
+typedef struct batch {
+    char **files;
+    int nfiles;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+} batch_t;
+
+static void *batch_worker(void *arg) {
+    batch_t *b = (batch_t *)arg;
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+
+        if(i >= b->nfiles)
+            break;
+
+        if(encode(b->files[i]) < 0) {
+            pthread_mutex_lock(&b->lock);
+            b->failed++;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/* Encodes a frame sequence or any other large set of images, handing the
+   next image to whichever thread is free. Each thread decodes, converts,
+   quantizes and twiddles its own image. */
+static int encode_batch(char **files, int nfiles) {
+    batch_t b;
+    pthread_t tid[64];
+    int i, n;
+
+    b.files = files;
+    b.nfiles = nfiles;
+    b.next = 0;
+    b.failed = 0;
+    pthread_mutex_init(&b.lock, NULL);
+
+    n = use_threads < nfiles ? use_threads : nfiles;
+
+    if(n > 64)
+        n = 64;
+
+    for(i = 1; i < n; i++) {
+        if(pthread_create(&tid[i], NULL, batch_worker, &b) != 0)
+            break;
+    }
+
+    n = i;
+    batch_worker(&b);
+
+    for(i = 1; i < n; i++)
+        pthread_join(tid[i], NULL);
+
+    pthread_mutex_destroy(&b.lock);
+
+    if(b.failed)
+        fprintf(stderr, "%d of %d images failed\n", b.failed, nfiles);
+
+    return b.failed ? -1 : 0;
+}
+
 static int process_long_options(char *arg) {
-    /* if (! strcmp(arg, "mipmap"))
+    if(! strcmp(arg, "mipmap"))
         use_mipmap = 1;
-    else if (! strcmp(arg, "twiddle"))
-        use_twiddle = 1;
-    else */ if(! strcmp(arg, "debug"))
+    /* else if (! strcmp(arg, "twiddle"))
+        use_twiddle = 1; */
+    else if(! strcmp(arg, "debug"))
         use_debug = 1;
     else if(! strcmp(arg, "verbose"))
         use_verbose = 1;
@@ -291,6 +304,18 @@ static int process_long_options(char *arg) {
         use_hq = 1; */
     else if(! strcmp(arg, "alpha"))
         use_alpha = 1;
+    else if(! strcmp(arg, "pal4bpp"))
+        use_pal = 4;
+    else if(! strcmp(arg, "pal8bpp"))
+        use_pal = 8;
+    else if(! strcmp(arg, "yuv422"))
+        use_yuv = 1;
+    else if(! strcmp(arg, "stride"))
+        use_twiddle = 0;
+    else if(! strcmp(arg, "batch"))
+        use_batch = 1;
+    else if(! strncmp(arg, "threads=", 8) && atoi(arg + 8) > 0)
+        use_threads = atoi(arg + 8);
     else
         return -EINVAL;
 
@@ -303,9 +328,9 @@ static int process_option(char *arg) {
 
     switch(*arg) {
 
-            /* case 'm':
-                use_mipmap = 1;
-                return 0; */
+        case 'm':
+            use_mipmap = 1;
+            return 0;
 
             /* case 't':
                 use_twiddle = 1;
@@ -335,6 +360,30 @@ static int process_option(char *arg) {
 
             return 0;
 
+        case 'y':
+            use_yuv = 1;
+            return 0;
+
+        case 's':
+            use_twiddle = 0;
+            return 0;
+
+        case 'b':
+            use_batch = 1;
+            return 0;
+
+        case 'p':
+            arg++;
+
+            if(*arg == '4')
+                use_pal = 4;
+            else if(*arg == '8')
+                use_pal = 8;
+            else
+                return -EINVAL;
+
+            return 0;
+
         case '-':
             return process_long_options(arg + 1);
     }
@@ -367,6 +416,30 @@ static int process(int argc, char *argv[]) {
         return -EINVAL;
     }
 
+    /* the 1x1 level of a 4bpp mipmap is half a byte; not laid out here */
+    if(use_mipmap && use_pal == 4) {
+        fprintf(stderr, "mipmaps are not supported for 4bpp paletted output\n");
+        return -EINVAL;
+    }
+
+    if(use_yuv && (use_pal || use_mipmap)) {
+        fprintf(stderr, "YUV422 output can't be paletted or mipmapped\n");
+        return -EINVAL;
+    }
+
+    if(!use_twiddle && (use_pal || use_mipmap)) {
+        fprintf(stderr, "stride textures can't be paletted or mipmapped\n");
+        return -EINVAL;
+    }
+
+    if(use_threads == 0)
+        use_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(use_batch) {
+        use_verbose = 0;
+        return encode_batch(argv + arg, argc - arg) < 0 ? 1 : 0;
+    }
+
     while(arg < argc) {
         /* ordinary image */
         encode(argv[arg]);
@@ -0,0 +1,577 @@
+/* KallistiOS ##version##
+
+   dctex.c
+   Copyright (C)2003 Dan Potter
+   Portions Copyright (C)2002 Gil Megidish
+
+   The kmgenc half of libdctex: 16-bit, YUV422 and paletted textures,
+   mipmaps filtered in linear light, twiddling and the KMG header. VQ
+   textures are handed on to vq.c.
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include "dctex_internal.h"
+
+/* 1024x1024 down to 1x1 */
+#define MAX_LEVELS  11
+
+/* sRGB decoding table and a finer table for encoding linear light; only
+   written once, through gamma_once */
+#define GAMMA_STEPS 4096
+static float srgb_to_linear[256];
+static uint8 linear_to_srgb[GAMMA_STEPS + 1];
+static pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
+
+// A single color value
+typedef struct fcolor {
+    float a;
+    float r;
+    float g;
+    float b;
+} fcolor_t;
+
+// A few useful macros for color manipulation
+#define PACK4444(a, r, g, b) ( \
+                               ( (((int)((a)*15))) << 12) | \
+                               ( (((int)((r)*15))) << 8) | \
+                               ( (((int)((g)*15))) << 4) | \
+                               ( (((int)((b)*15))) << 0) )
+
+#define PACK1555(a, r, g, b) ( \
+                               ( (a) ? 0x8000 : 0x0000) | \
+                               ( (((int)((r)*31))) << 10) | \
+                               ( (((int)((g)*31))) << 5) | \
+                               ( (((int)((b)*31))) << 0) )
+
+#define PACK565(r, g, b) ( \
+                           ( (((int)((r)*31))) << 11) | \
+                           ( (((int)((g)*63))) << 5) | \
+                           ( (((int)((b)*31))) << 0) )
+
+#define LIMITFC(x) do { \
+        (x).a = LIMIT((x).a, 0.0f, 1.0f); \
+        (x).r = LIMIT((x).r, 0.0f, 1.0f); \
+        (x).g = LIMIT((x).g, 0.0f, 1.0f); \
+        (x).b = LIMIT((x).b, 0.0f, 1.0f); \
+    } while (0)
+
+static inline void get_fcolor_32(fcolor_t *c, const uint8 *pixels) {
+    c->a = pixels[0] / 255.0f;
+    c->r = pixels[1] / 255.0f;
+    c->g = pixels[2] / 255.0f;
+    c->b = pixels[3] / 255.0f;
+}
+
+void dctex_default_params(dctex_params_t *p) {
+    memset(p, 0, sizeof(*p));
+    p->format = KMG_DCFMT_RGB565;
+    p->twiddle = 1;
+    p->kmg = 1;
+    p->threads = 1;
+    p->refine = 0.001;
+}
+
+void dctex_free(dctex_buffer_t *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+}
+
+static int valid_size(int x) {
+    if(x < 2 || x > 1024)
+        return 0;
+
+    while(x) {
+        int bit = (x & 1);
+        x >>= 1;
+
+        if(x && bit) {
+            /* more than one bit in image */
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Stride textures only need a row length the PVR can step over: a
+   multiple of 32 texels, up to 1024 */
+static int valid_stride(int x) {
+    return x >= 32 && x <= 1024 && !(x & 31);
+}
+
+static int is_stride(const dctex_params_t *p) {
+    return !p->twiddle && !p->vq && !p->mipmap
+           && p->format != KMG_DCFMT_4BPP_PAL && p->format != KMG_DCFMT_8BPP_PAL;
+}
+
+int dctex_check(const image_t *img, const dctex_params_t *p) {
+    if(img->bpp != 4 || img->stride != img->w * 4)
+        return -EINVAL;
+
+    if(is_stride(p) && valid_stride(img->w)) {
+        if(img->h < 1 || img->h > 1024)
+            return -EINVAL;
+    }
+    else if(!valid_size(img->w) || !valid_size(img->h))
+        return -EINVAL;
+
+    if(p->mipmap && img->w != img->h)
+        return -EINVAL;
+
+    switch(p->format) {
+        case KMG_DCFMT_RGB565:
+        case KMG_DCFMT_ARGB4444:
+        case KMG_DCFMT_ARGB1555:
+            return 0;
+
+        case KMG_DCFMT_YUV422:
+            return p->vq || p->mipmap ? -EINVAL : 0;
+
+        case KMG_DCFMT_4BPP_PAL:
+            /* the 1x1 level of a 4bpp mipmap is half a byte; not laid
+               out here */
+            if(p->mipmap)
+                return -EINVAL;
+
+            /* fall through */
+        case KMG_DCFMT_8BPP_PAL:
+            /* the PVR only takes twiddled paletted textures */
+            return p->vq || !p->twiddle ? -EINVAL : 0;
+    }
+
+    return -EINVAL;
+}
+
+uint8 *dctex_alloc(dctex_buffer_t *out, const dctex_params_t *p,
+                   const image_t *img, int fmt, int byte_count) {
+    kmg_header_t    hdr;
+    int     hdr_size = p->kmg ? sizeof(hdr) : 0;
+
+    out->size = hdr_size + byte_count;
+    out->data = calloc(out->size, 1);
+
+    if(out->data == NULL)
+        return NULL;
+
+    if(p->kmg) {
+        if(p->twiddle)
+            fmt |= KMG_DCFMT_TWIDDLED;
+
+        if(p->mipmap)
+            fmt |= KMG_DCFMT_MIPMAP;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = le32(KMG_MAGIC);
+        hdr.version = le32(KMG_VERSION);
+        hdr.platform = le32(KMG_PLAT_DC);
+        hdr.format = le32(fmt);
+        hdr.width = le32(img->w);
+        hdr.height = le32(img->h);
+        hdr.byte_count = le32(byte_count);
+        memcpy(out->data, &hdr, sizeof(hdr));
+    }
+
+    return out->data + hdr_size;
+}
+
+/* This twiddling code is copied from pvr_texture.c, and the original
+   algorithm was written by Vincent Penne. */
+void dctex_twiddle16(const uint16 *src, int w, int h, uint16 *output) {
+    int min = MIN(w, h);
+    int mask = min - 1;
+    int x, y, yout;
+
+    for(y = 0; y < h; y++) {
+        // yout = ((h - 1) - y);
+        yout = y;
+
+        for(x = 0; x < w; x++) {
+            output[TWIDOUT(x & mask, yout & mask) +
+                   (x / min + yout / min)*min * min] = src[y * w + x];
+        }
+    }
+}
+
+/* Paletted textures are always twiddled; in 4bpp the even texel of
+   each pair goes in the low nibble. */
+static void twiddle_indices(const image_t *src, int bits, const uint8 *indices,
+                            uint8 *output) {
+    int w = src->w;
+    int h = src->h;
+    int min = MIN(w, h);
+    int mask = min - 1;
+    int x, y, t;
+
+    for(y = 0; y < h; y++) {
+        for(x = 0; x < w; x++) {
+            t = TWIDOUT(x & mask, y & mask) + (x / min + y / min) * min * min;
+
+            if(bits == 8)
+                output[t] = indices[y * w + x];
+            else
+                output[t >> 1] |= indices[y * w + x] << ((t & 1) * 4);
+        }
+    }
+}
+
+static void init_gamma(void) {
+    int i;
+    double c;
+
+    for(i = 0; i < 256; i++) {
+        c = i / 255.0;
+        srgb_to_linear[i] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+    }
+
+    for(i = 0; i <= GAMMA_STEPS; i++) {
+        c = (double)i / GAMMA_STEPS;
+        c = c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+        linear_to_srgb[i] = (uint8)(c * 255.0 + 0.5);
+    }
+}
+
+/* Loads an ARGB image as premultiplied linear light, four floats per
+   texel, so that box filtering is plain averaging. */
+static float * to_linear(const image_t * img) {
+    int i;
+    float a, * out;
+    const uint8 * p;
+
+    out = malloc(img->w * img->h * 4 * sizeof(float));
+
+    if(out == NULL)
+        return NULL;
+
+    for(i = 0; i < img->w * img->h; i++) {
+        p = img->data + i * img->bpp;
+        a = p[0] / 255.0f;
+        out[i * 4 + 0] = a;
+        out[i * 4 + 1] = srgb_to_linear[p[1]] * a;
+        out[i * 4 + 2] = srgb_to_linear[p[2]] * a;
+        out[i * 4 + 3] = srgb_to_linear[p[3]] * a;
+    }
+
+    return out;
+}
+
+static void from_linear(const float * src, image_t * img) {
+    int i, c, v;
+    float a;
+    uint8 * p;
+
+    for(i = 0; i < img->w * img->h; i++) {
+        p = img->data + i * img->bpp;
+        a = src[i * 4];
+        p[0] = (uint8)(a * 255.0f + 0.5f);
+
+        for(c = 1; c < 4; c++) {
+            v = a > 0.0f ? (int)(src[i * 4 + c] / a * GAMMA_STEPS + 0.5f) : 0;
+            p[c] = linear_to_srgb[LIMIT(v, 0, GAMMA_STEPS)];
+        }
+    }
+}
+
+/* 2x2 box filter on premultiplied texels. The rows are walked as flat
+   float arrays with no dependencies between texels, so the compiler can
+   vectorize the inner loop. */
+static void downsample(const float * restrict src, int w, int h, float * restrict dst) {
+    int x, y, dw = w / 2;
+    const float * r0, * r1;
+    float * out;
+
+    for(y = 0; y < h / 2; y++) {
+        r0 = src + (y * 2) * w * 4;
+        r1 = r0 + w * 4;
+        out = dst + y * dw * 4;
+
+        for(x = 0; x < dw * 4; x++) {
+            int t = (x / 4) * 8 + (x % 4);
+            out[x] = 0.25f * (r0[t] + r0[t + 4] + r1[t] + r1[t + 4]);
+        }
+    }
+}
+
+/* Builds the full chain down to 1x1 in levels[1..], returning the number
+   of levels including the base one in levels[0], which shares the data
+   of img. Only levels[1..] need to be freed. */
+static int build_mipmaps(const image_t * img, image_t * levels) {
+    int n, w;
+    float * cur, * next;
+
+    pthread_once(&gamma_once, init_gamma);
+
+    levels[0] = *img;
+    n = 1;
+
+    cur = to_linear(img);
+
+    if(cur == NULL)
+        return -ENOMEM;
+
+    for(w = img->w / 2; w >= 1; w /= 2, n++) {
+        next = malloc(w * w * 4 * sizeof(float));
+        levels[n].w = levels[n].h = w;
+        levels[n].bpp = 4;
+        levels[n].stride = w * 4;
+        levels[n].data = malloc(w * w * 4);
+
+        if(next == NULL || levels[n].data == NULL) {
+            free(next);
+            free(cur);
+
+            for(; n > 0; n--)
+                free(levels[n].data);
+
+            return -ENOMEM;
+        }
+
+        downsample(cur, w * 2, w * 2, next);
+        from_linear(next, &levels[n]);
+        free(cur);
+        cur = next;
+    }
+
+    free(cur);
+    return n;
+}
+
+static void destroy_mipmaps(image_t * levels, int nlevels) {
+    int i;
+
+    for(i = 1; i < nlevels; i++)
+        free(levels[i].data);
+}
+
+static void convert_to_16(const image_t * img, int format, uint16 * out) {
+    int i;
+    fcolor_t fc;
+
+    for(i = 0; i < img->w * img->h; i++) {
+        get_fcolor_32(&fc, img->data + i * img->bpp);
+        LIMITFC(fc);
+
+        switch(format) {
+            case KMG_DCFMT_RGB565:
+                out[i] = le16(PACK565(fc.r, fc.g, fc.b));
+                break;
+            case KMG_DCFMT_ARGB4444:
+                out[i] = le16(PACK4444(fc.a, fc.r, fc.g, fc.b));
+                break;
+            case KMG_DCFMT_ARGB1555:
+                out[i] = le16(PACK1555(fc.a, fc.r, fc.g, fc.b));
+                break;
+        }
+    }
+}
+
+/* BT.601 full range in 16.16 fixed point, the same conversion the PVR
+   undoes when it samples a YUV422 texture */
+#define YUV_Y(r, g, b)  ( (19595 * (r) + 38470 * (g) + 7471 * (b) + 32768) >> 16 )
+#define YUV_U(r, g, b)  ( (-11059 * (r) - 21709 * (g) + 32768 * (b) + (128 << 16) + 32768) >> 16 )
+#define YUV_V(r, g, b)  ( (32768 * (r) - 27439 * (g) - 5329 * (b) + (128 << 16) + 32768) >> 16 )
+
+/* Two texels that follow each other in memory share one U and one V, the
+   first texel of the pair holding U and the second V. Twiddled, those are
+   vertical neighbours, so the chroma is taken from the average of rows
+   2n and 2n+1 and sits halfway between them. Every texel of a row pair
+   is independent of the others, so the loop vectorizes. */
+static void convert_to_yuv422_twiddled(const image_t * img, uint16 * out) {
+    int x, y, r, g, b, u, v;
+    const uint8 * p0, * p1;
+    uint16 * o0, * o1;
+
+    for(y = 0; y < img->h; y += 2) {
+        p0 = img->data + y * img->stride;
+        p1 = p0 + img->stride;
+        o0 = out + y * img->w;
+        o1 = o0 + img->w;
+
+        for(x = 0; x < img->w; x++) {
+            r = p0[x * 4 + 1] + p1[x * 4 + 1];
+            g = p0[x * 4 + 2] + p1[x * 4 + 2];
+            b = p0[x * 4 + 3] + p1[x * 4 + 3];
+
+            /* sums of two texels, so halve the offset and round */
+            u = (YUV_U(r, g, b) + 128 + 1) >> 1;
+            v = (YUV_V(r, g, b) + 128 + 1) >> 1;
+            u = LIMIT(u, 0, 255);
+            v = LIMIT(v, 0, 255);
+
+            o0[x] = le16((YUV_Y(p0[x * 4 + 1], p0[x * 4 + 2], p0[x * 4 + 3]) << 8) | u);
+            o1[x] = le16((YUV_Y(p1[x * 4 + 1], p1[x * 4 + 2], p1[x * 4 + 3]) << 8) | v);
+        }
+    }
+}
+
+/* Not twiddled, the texels of a pair are neighbours in a row, so the
+   chroma is the average of texels 2n and 2n+1 and sits between them.
+   This is the layout of stride textures such as video frames. */
+static void convert_to_yuv422_linear(const image_t * img, uint16 * out) {
+    int x, y, r, g, b, u, v;
+    const uint8 * p;
+    uint16 * o;
+
+    for(y = 0; y < img->h; y++) {
+        p = img->data + y * img->stride;
+        o = out + y * img->w;
+
+        for(x = 0; x < img->w; x += 2, p += 8) {
+            r = p[1] + p[5];
+            g = p[2] + p[6];
+            b = p[3] + p[7];
+
+            u = (YUV_U(r, g, b) + 128 + 1) >> 1;
+            v = (YUV_V(r, g, b) + 128 + 1) >> 1;
+            u = LIMIT(u, 0, 255);
+            v = LIMIT(v, 0, 255);
+
+            o[x] = le16((YUV_Y(p[1], p[2], p[3]) << 8) | u);
+            o[x + 1] = le16((YUV_Y(p[5], p[6], p[7]) << 8) | v);
+        }
+    }
+}
+
+/* levels[0] is the base image, followed by any smaller mipmap levels */
+static int encode_16(image_t *levels, int nlevels, const dctex_params_t *p,
+                     dctex_buffer_t *out) {
+    uint16      *data, *tmp;
+    int     cnt, i, ofs;
+
+    cnt = nlevels > 1 ? MIPMAP_PAD_16BPP : 0;
+
+    for(i = 0; i < nlevels; i++)
+        cnt += levels[i].w * levels[i].h * 2;
+
+    data = (uint16 *)dctex_alloc(out, p, &levels[0], p->format, cnt);
+    tmp = malloc(levels[0].w * levels[0].h * 2);
+
+    if(data == NULL || tmp == NULL) {
+        free(tmp);
+        dctex_free(out);
+        return -ENOMEM;
+    }
+
+    /* Convert and twiddle the levels, smallest first */
+    ofs = nlevels > 1 ? MIPMAP_PAD_16BPP / 2 : 0;
+
+    for(i = nlevels - 1; i >= 0; i--) {
+        if(p->format == KMG_DCFMT_YUV422 && p->twiddle)
+            convert_to_yuv422_twiddled(&levels[i], tmp);
+        else if(p->format == KMG_DCFMT_YUV422)
+            convert_to_yuv422_linear(&levels[i], tmp);
+        else
+            convert_to_16(&levels[i], p->format, tmp);
+
+        if(p->twiddle)
+            dctex_twiddle16(tmp, levels[i].w, levels[i].h, data + ofs);
+        else
+            memcpy(data + ofs, tmp, levels[i].w * levels[i].h * 2);
+
+        ofs += levels[i].w * levels[i].h;
+    }
+
+    free(tmp);
+    return 0;
+}
+
+/* All levels share one palette, so they are quantized together */
+static int encode_paletted(image_t *levels, int nlevels, const dctex_params_t *p,
+                           dctex_buffer_t *out) {
+    image_t     all;
+    uint32      palette[256];
+    uint8       *indices, *data;
+    int     i, bits, npal, cnt, texels, ofs;
+
+    bits = p->format == KMG_DCFMT_4BPP_PAL ? 4 : 8;
+    npal = 1 << bits;
+    texels = 0;
+
+    for(i = 0; i < nlevels; i++)
+        texels += levels[i].w * levels[i].h;
+
+    cnt = (nlevels > 1 ? MIPMAP_PAD_8BPP : 0) + texels * bits / 8;
+    indices = malloc(texels);
+    data = dctex_alloc(out, p, &levels[0], p->format, npal * 4 + cnt);
+
+    /* one long row holding the texels of every level */
+    all.w = texels;
+    all.h = 1;
+    all.bpp = 4;
+    all.stride = texels * 4;
+    all.data = malloc(texels * 4);
+
+    if(indices == NULL || data == NULL || all.data == NULL)
+        goto nomem;
+
+    for(i = 0, ofs = 0; i < nlevels; i++) {
+        memcpy(all.data + ofs * 4, levels[i].data, levels[i].w * levels[i].h * 4);
+        ofs += levels[i].w * levels[i].h;
+    }
+
+    i = dctex_quantize(&all, npal, p->threads, palette, indices);
+
+    if(i < 0)
+        goto nomem;
+
+    if(p->log != NULL && p->verbose)
+        fprintf(p->log, "%d colors.. ", i);
+
+    for(i = 0; i < npal; i++)
+        ((uint32 *)data)[i] = le32(palette[i]);
+
+    /* twiddle the levels smallest first; 4bpp has no mipmaps, so every
+       level starts on a byte */
+    data += npal * 4;
+    ofs = nlevels > 1 ? MIPMAP_PAD_8BPP : 0;
+
+    for(i = nlevels - 1; i >= 0; i--) {
+        texels -= levels[i].w * levels[i].h;
+        twiddle_indices(&levels[i], bits, indices + texels, data + ofs);
+        ofs += levels[i].w * levels[i].h * bits / 8;
+    }
+
+    free(all.data);
+    free(indices);
+    return 0;
+
+nomem:
+    dctex_free(out);
+    free(all.data);
+    free(indices);
+    return -ENOMEM;
+}
+
+int dctex_encode(const image_t *img, const dctex_params_t *p, dctex_buffer_t *out) {
+    image_t     levels[MAX_LEVELS];
+    int     nlevels, rv;
+
+    out->data = NULL;
+    out->size = 0;
+
+    if(dctex_check(img, p) < 0)
+        return -EINVAL;
+
+    if(p->vq)
+        return dctex_encode_vq(img, p, out);
+
+    if(p->mipmap) {
+        nlevels = build_mipmaps(img, levels);
+
+        if(nlevels < 0)
+            return nlevels;
+    }
+    else {
+        levels[0] = *img;
+        nlevels = 1;
+    }
+
+    if(p->format == KMG_DCFMT_4BPP_PAL || p->format == KMG_DCFMT_8BPP_PAL)
+        rv = encode_paletted(levels, nlevels, p, out);
+    else
+        rv = encode_16(levels, nlevels, p, out);
+
+    destroy_mipmaps(levels, nlevels);
+    return rv;
+}
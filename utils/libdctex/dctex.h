@@ -0,0 +1,77 @@
+/* KallistiOS ##version##
+
+   dctex.h
+
+   Texture encoding core of vqenc, kmgenc and dcbumpgen, usable in-process.
+   Images come in as ARGB bytes in memory (as get_image() returns them)
+   and encoded textures go out in memory buffers; nothing is kept in
+   globals, so any number of textures can be encoded at once from
+   different threads, each call using its own dctex_params_t.
+*/
+
+#ifndef __DCTEX_H
+#define __DCTEX_H
+
+#include <stdio.h>
+#include "get_image.h"
+
+#define NEED_KOS_TYPES
+#include "kmg.h"
+
+typedef struct dctex_params {
+    /* KMG_DCFMT_RGB565, KMG_DCFMT_ARGB4444, KMG_DCFMT_ARGB1555,
+       KMG_DCFMT_YUV422, KMG_DCFMT_4BPP_PAL or KMG_DCFMT_8BPP_PAL */
+    int format;
+
+    int twiddle;        /* twiddle the texels (or VQ indices) */
+    int mipmap;         /* add mipmaps, square images only */
+    int vq;             /* VQ compress, 16-bit ARGB/RGB formats only */
+    int kmg;            /* start the output with a KMG header */
+    int threads;        /* threads to use for one texture, at least 1 */
+
+    /* VQ codebook training */
+    int hq;             /* three placement passes per split */
+    int sample;         /* train on this percentage of the quads, 0 = all */
+    int sample_check;   /* with sample, also train on all and compare */
+    double refine;      /* stop refining below this relative gain, 0 = off */
+
+    /* progress and reports go here when verbose; NULL is silent */
+    FILE *log;
+    int verbose;
+    int debug;
+} dctex_params_t;
+
+/* An encoded texture or codebook, allocated by the library */
+typedef struct dctex_buffer {
+    uint8 *data;
+    int size;
+} dctex_buffer_t;
+
+/* Fills in the defaults: twiddled RGB565 KMG on one thread */
+void dctex_default_params(dctex_params_t *p);
+
+/* Checks that img can be encoded with p: both sides a power of two from
+   2 to 1024, square when mipmapped, and a format p allows. A 16-bit or
+   YUV422 texture that is neither twiddled, mipmapped nor VQ may instead
+   be a stride texture, any width that is a multiple of 32 up to 1024 and
+   any height up to 1024. Returns 0 or -EINVAL. */
+int dctex_check(const image_t *img, const dctex_params_t *p);
+
+/* Encodes one texture into out. img must be 4 bytes per pixel with no
+   padding between rows and is left untouched. Returns 0, -EINVAL or
+   -ENOMEM. */
+int dctex_encode(const image_t *img, const dctex_params_t *p, dctex_buffer_t *out);
+
+/* VQ encodes n textures with one codebook trained over all of them. The
+   codebook is written to cb and the indices of image i to out[i]; the
+   codebook followed by the indices is exactly a regular VQ texture. */
+int dctex_encode_shared(const image_t *imgs, int n, const dctex_params_t *p,
+                        dctex_buffer_t *cb, dctex_buffer_t *out);
+
+void dctex_free(dctex_buffer_t *buf);
+
+/* Twiddles a w x h texture of 16-bit texels; rectangles become a row or
+   column of squares */
+void dctex_twiddle16(const uint16 *src, int w, int h, uint16 *out);
+
+#endif  /* __DCTEX_H */
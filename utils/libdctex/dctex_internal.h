@@ -0,0 +1,76 @@
+/* KallistiOS ##version##
+
+   dctex_internal.h
+
+   Helpers shared between the parts of libdctex.
+*/
+
+#ifndef __DCTEX_INTERNAL_H
+#define __DCTEX_INTERNAL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "dctex.h"
+
+#define LIMIT(x, low, high) (x) < low ? low : (x) > high ? high : (x)
+
+/* mipmapped textures start with the 1x1 level, padded up to where the
+   2x2 level would begin if the 1x1 one was 2x2 texels too; VQ indices
+   only need a single byte since there is no 1x1 index map */
+#define MIPMAP_PAD_16BPP    6
+#define MIPMAP_PAD_8BPP     3
+#define MIPMAP_PAD_VQ       1
+
+/* bytes in a VQ codebook: 256 codes of 2x2 16-bit texels */
+#define VQ_CODEBOOK_SIZE    2048
+
+/* Linear/iterative twiddling algorithm from Marcus' tatest */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+#define MIN(a, b) ( (a)<(b)? (a):(b) )
+
+/* Endian fixing; the test folds to a constant, so there is no state */
+static inline int is_le(void) {
+    const uint32 test = 0x12345678;
+    return *(const uint8 *)&test == 0x78;
+}
+
+static inline uint16 le16(uint16 x) {
+    if(is_le())
+        return x;
+    else
+        return ((x << 8) & 0xff00) | ((x >> 8) & 0x00ff);
+}
+
+static inline uint32 le32(uint32 x) {
+    if(is_le())
+        return x;
+    else
+        return ((x << 24) & 0xff000000) |
+               ((x << 8) & 0x00ff0000) |
+               ((x >> 8) & 0x0000ff00) |
+               ((x >> 24) & 0x000000ff);
+}
+
+/* dctex.c */
+
+/* Allocates out with room for an optional KMG header and byte_count
+   bytes of data, writes the header and returns where the data goes */
+uint8 *dctex_alloc(dctex_buffer_t *out, const dctex_params_t *p,
+                   const image_t *img, int fmt, int byte_count);
+
+/* quantize.c */
+
+/* Reduces an image to at most npal colors (16 or 256) on the given number
+   of threads. The palette is stored as ARGB8888 and indices gets one
+   entry per pixel. Returns the number of palette entries used. */
+int dctex_quantize(const image_t *img, int npal, int threads, uint32 *palette,
+                   uint8 *indices);
+
+/* vq.c */
+
+int dctex_encode_vq(const image_t *img, const dctex_params_t *p, dctex_buffer_t *out);
+
+#endif  /* __DCTEX_INTERNAL_H */
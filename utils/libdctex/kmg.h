@@ -52,7 +52,8 @@ typedef struct kmg_header {
 #define KMG_PLAT_GBA	2
 #define KMG_PLAT_PS2	3
 
-/* Format specifiers for DC */
+/* Format specifiers for DC. The paletted formats start with the palette,
+   16 or 256 ARGB8888 entries, followed by the (twiddled) indices. */
 #define KMG_DCFMT_4BPP_PAL	0x01	/* Paletted formats */
 #define KMG_DCFMT_8BPP_PAL	0x02
 #define KMG_DCFMT_RGB565	0x03	/* True-color formats */
@@ -65,6 +66,7 @@ typedef struct kmg_header {
 #define KMG_DCFMT_VQ		0x0100	/* VQ-encoded (incl codebook) */
 #define KMG_DCFMT_TWIDDLED	0x0200	/* Pre-twiddled */
 #define KMG_DCFMT_MIPMAP	0x0400	/* Includes mipmaps */
+#define KMG_DCFMT_VQ_SHARED	0x0800	/* VQ indices only, codebook kept separately */
 
 #ifdef _arch_dreamcast
 
@@ -0,0 +1,395 @@
+/* KallistiOS ##version##
+
+   quantize.c
+
+   Color quantizer for the paletted KMG formats. The distinct colors of
+   the image are split into boxes by median cut, the average of each box
+   becomes a palette entry, and a few k-means passes then move the
+   entries to the centers of the colors that map to them. The k-means
+   passes are spread over several threads; each thread sums into its own
+   slice and the slices are merged in order, so the palette does not
+   depend on the number of threads.
+*/
+
+#include <pthread.h>
+#include "dctex_internal.h"
+
+/* k-means passes after median cut */
+#define KMEANS_PASSES   4
+
+/* fixed slices of the color list, shared out between the threads */
+#define QUANT_PARTS     64
+#define MAX_THREADS     QUANT_PARTS
+
+typedef struct qcolor {
+    uint32 argb;
+    uint32 count;
+} qcolor_t;
+
+typedef struct qbox {
+    int first;
+    int n;
+    double score;
+} qbox_t;
+
+/* running sums of the colors mapped to one palette entry */
+typedef struct qsum {
+    double c[4];
+    double count;
+} qsum_t;
+
+typedef struct qjob {
+    qcolor_t *colors;
+    int ncolors;
+    uint32 *palette;
+    int npal;
+    uint8 *map;
+    qsum_t *sums;
+    int first;
+    int step;
+} qjob_t;
+
+#define CH(argb, c) ( ((argb) >> (24 - (c) * 8)) & 0xff )
+
+static int cmp_argb(const void *a, const void *b) {
+    uint32 x = *(const uint32 *)a, y = *(const uint32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+#define CMP_CHANNEL(name, c) \
+    static int name(const void *a, const void *b) { \
+        return (int)CH(((const qcolor_t *)a)->argb, c) - \
+               (int)CH(((const qcolor_t *)b)->argb, c); \
+    }
+
+CMP_CHANNEL(cmp_a, 0)
+CMP_CHANNEL(cmp_r, 1)
+CMP_CHANNEL(cmp_g, 2)
+CMP_CHANNEL(cmp_b, 3)
+
+static int (*cmp_channel[4])(const void *, const void *) = {
+    cmp_a, cmp_r, cmp_g, cmp_b
+};
+
+/* weighted variance of a box along each channel; returns the channel
+   with the widest spread and stores the total in box->score */
+static int box_spread(qcolor_t *colors, qbox_t *box) {
+    int i, c, widest;
+    double sum[4], sq[4], n, v, best;
+
+    memset(sum, 0, sizeof(sum));
+    memset(sq, 0, sizeof(sq));
+    n = 0.0;
+
+    for(i = box->first; i < box->first + box->n; i++) {
+        for(c = 0; c < 4; c++) {
+            v = CH(colors[i].argb, c);
+            sum[c] += v * colors[i].count;
+            sq[c] += v * v * colors[i].count;
+        }
+
+        n += colors[i].count;
+    }
+
+    widest = 0;
+    best = -1.0;
+    box->score = 0.0;
+
+    for(c = 0; c < 4; c++) {
+        v = sq[c] - sum[c] * sum[c] / n;
+        box->score += v;
+
+        if(v > best) {
+            best = v;
+            widest = c;
+        }
+    }
+
+    return widest;
+}
+
+/* splits boxes at the weighted median of their widest channel until
+   there are npal of them, largest spread first */
+static int median_cut(qcolor_t *colors, int ncolors, qbox_t *boxes, int npal) {
+    int i, nboxes, big, c, half;
+    uint32 total, seen;
+    qbox_t *b;
+
+    nboxes = 1;
+    boxes[0].first = 0;
+    boxes[0].n = ncolors;
+    box_spread(colors, &boxes[0]);
+
+    while(nboxes < npal) {
+        big = -1;
+
+        for(i = 0; i < nboxes; i++) {
+            if(boxes[i].n > 1 && (big < 0 || boxes[i].score > boxes[big].score))
+                big = i;
+        }
+
+        if(big < 0)
+            break;
+
+        b = &boxes[big];
+        c = box_spread(colors, b);
+        qsort(colors + b->first, b->n, sizeof(qcolor_t), cmp_channel[c]);
+
+        total = 0;
+
+        for(i = b->first; i < b->first + b->n; i++)
+            total += colors[i].count;
+
+        /* keep at least one color on each side */
+        seen = 0;
+
+        for(half = 1; half < b->n - 1; half++) {
+            seen += colors[b->first + half - 1].count;
+
+            if(seen * 2 >= total)
+                break;
+        }
+
+        boxes[nboxes].first = b->first + half;
+        boxes[nboxes].n = b->n - half;
+        b->n = half;
+        box_spread(colors, b);
+        box_spread(colors, &boxes[nboxes]);
+        nboxes++;
+    }
+
+    return nboxes;
+}
+
+static int nearest(uint32 *palette, int npal, uint32 argb) {
+    int i, c, best, d, dist, bestdist;
+
+    best = 0;
+    bestdist = 0x7fffffff;
+
+    for(i = 0; i < npal; i++) {
+        dist = 0;
+
+        for(c = 0; c < 4 && dist < bestdist; c++) {
+            d = (int)CH(argb, c) - (int)CH(palette[i], c);
+            dist += d * d;
+        }
+
+        if(dist < bestdist) {
+            bestdist = dist;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static void *assign_worker(void *arg) {
+    qjob_t *job = (qjob_t *)arg;
+    int part, i, c, start, end, idx;
+    qsum_t *s;
+
+    for(part = job->first; part < QUANT_PARTS; part += job->step) {
+        start = (int)((long long)job->ncolors * part / QUANT_PARTS);
+        end = (int)((long long)job->ncolors * (part + 1) / QUANT_PARTS);
+
+        for(i = start; i < end; i++) {
+            idx = nearest(job->palette, job->npal, job->colors[i].argb);
+            job->map[i] = idx;
+
+            if(job->sums == NULL)
+                continue;
+
+            s = &job->sums[part * 256 + idx];
+
+            for(c = 0; c < 4; c++)
+                s->c[c] += (double)CH(job->colors[i].argb, c) * job->colors[i].count;
+
+            s->count += job->colors[i].count;
+        }
+    }
+
+    return NULL;
+}
+
+/* maps every color to its nearest palette entry on all threads;
+   with sums, also gathers per-part sums for moving the entries */
+static void assign(qcolor_t *colors, int ncolors, uint32 *palette, int npal,
+                   uint8 *map, qsum_t *sums, int threads) {
+    int i;
+    pthread_t tid[MAX_THREADS];
+    qjob_t jobs[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    for(i = 0; i < threads; i++) {
+        jobs[i].colors = colors;
+        jobs[i].ncolors = ncolors;
+        jobs[i].palette = palette;
+        jobs[i].npal = npal;
+        jobs[i].map = map;
+        jobs[i].sums = sums;
+        jobs[i].first = i;
+        jobs[i].step = threads;
+        started[i] = (i > 0 && pthread_create(&tid[i], NULL, assign_worker, &jobs[i]) == 0);
+    }
+
+    for(i = 0; i < threads; i++) {
+        if(!started[i])
+            assign_worker(&jobs[i]);
+    }
+
+    for(i = 1; i < threads; i++) {
+        if(started[i])
+            pthread_join(tid[i], NULL);
+    }
+}
+
+static uint32 mean_color(double *c, double count) {
+    uint32 argb = 0;
+    int i, v;
+
+    for(i = 0; i < 4; i++) {
+        v = (int)(c[i] / count + 0.5);
+        v = LIMIT(v, 0, 255);
+        argb |= (uint32)v << (24 - i * 8);
+    }
+
+    return argb;
+}
+
+/* finds the index of a color in the sorted color list */
+static int lookup(qcolor_t *colors, int ncolors, uint32 argb) {
+    int lo, hi, mid;
+
+    lo = 0;
+    hi = ncolors - 1;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if(colors[mid].argb < argb)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+int dctex_quantize(const image_t *img, int npal, int threads, uint32 *palette, uint8 *indices) {
+    int i, c, p, pass, npix, ncolors, nboxes;
+    uint32 *pixels;
+    qcolor_t *colors = NULL;
+    qbox_t *boxes = NULL;
+    qsum_t *sums = NULL, total[256];
+    uint8 *map = NULL;
+    const uint8 *src;
+    int rv = -ENOMEM;
+
+    if(threads < 1)
+        threads = 1;
+    else if(threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    npix = img->w * img->h;
+    pixels = (uint32 *)malloc(npix * sizeof(uint32));
+
+    if(pixels == NULL)
+        return -ENOMEM;
+
+    /* gather the distinct colors and how often they're used */
+    for(i = 0; i < npix; i++) {
+        src = img->data + i * img->bpp;
+        pixels[i] = ((uint32)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+    }
+
+    qsort(pixels, npix, sizeof(uint32), cmp_argb);
+
+    colors = (qcolor_t *)malloc(npix * sizeof(qcolor_t));
+
+    if(colors == NULL)
+        goto out;
+
+    ncolors = 0;
+
+    for(i = 0; i < npix; i++) {
+        if(ncolors > 0 && colors[ncolors - 1].argb == pixels[i]) {
+            colors[ncolors - 1].count++;
+        }
+        else {
+            colors[ncolors].argb = pixels[i];
+            colors[ncolors].count = 1;
+            ncolors++;
+        }
+    }
+
+    boxes = (qbox_t *)malloc(npal * sizeof(qbox_t));
+    map = (uint8 *)malloc(ncolors);
+    sums = (qsum_t *)malloc(QUANT_PARTS * 256 * sizeof(qsum_t));
+
+    if(boxes == NULL || map == NULL || sums == NULL)
+        goto out;
+
+    nboxes = median_cut(colors, ncolors, boxes, npal);
+
+    for(i = 0; i < nboxes; i++) {
+        memset(&total[0], 0, sizeof(qsum_t));
+
+        for(p = boxes[i].first; p < boxes[i].first + boxes[i].n; p++) {
+            for(c = 0; c < 4; c++)
+                total[0].c[c] += (double)CH(colors[p].argb, c) * colors[p].count;
+
+            total[0].count += colors[p].count;
+        }
+
+        palette[i] = mean_color(total[0].c, total[0].count);
+    }
+
+    /* unused entries stay black */
+    for(i = nboxes; i < npal; i++)
+        palette[i] = 0;
+
+    /* median cut reorders the list; sort it back for lookup() */
+    qsort(colors, ncolors, sizeof(qcolor_t), cmp_argb);
+
+    /* with no more colors than entries the palette is already exact */
+    for(pass = 0; pass < (ncolors > npal ? KMEANS_PASSES : 0); pass++) {
+        memset(sums, 0, QUANT_PARTS * 256 * sizeof(qsum_t));
+        assign(colors, ncolors, palette, nboxes, map, sums, threads);
+
+        memset(total, 0, sizeof(total));
+
+        for(p = 0; p < QUANT_PARTS; p++) {
+            for(i = 0; i < nboxes; i++) {
+                for(c = 0; c < 4; c++)
+                    total[i].c[c] += sums[p * 256 + i].c[c];
+
+                total[i].count += sums[p * 256 + i].count;
+            }
+        }
+
+        for(i = 0; i < nboxes; i++) {
+            if(total[i].count > 0.0)
+                palette[i] = mean_color(total[i].c, total[i].count);
+        }
+    }
+
+    assign(colors, ncolors, palette, nboxes, map, NULL, threads);
+
+    /* the pixels were sorted above, so look each one up again */
+    for(i = 0; i < npix; i++) {
+        src = img->data + i * img->bpp;
+        indices[i] = map[lookup(colors, ncolors, ((uint32)src[0] << 24) |
+                                (src[1] << 16) | (src[2] << 8) | src[3])];
+    }
+
+    rv = nboxes;
+
+out:
+    free(sums);
+    free(map);
+    free(boxes);
+    free(colors);
+    free(pixels);
+    return rv;
+}
@@ -0,0 +1,1241 @@
+/* KallistiOS ##version##
+
+   vq.c
+   Copyright (C)2002 Gil Megidish
+
+   The vqenc half of libdctex: trains a 256 entry codebook of 2x2 texel
+   quads over an image (and its mipmaps, or a whole set of images) and
+   stores each quad as the index of its closest code.
+
+   This code is based on the work of Jonas Norberg, you can find more info at
+   http://www.acc.umu.se/~bedev/software/vq/
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "dctex_internal.h"
+#include "vq_internal.h"
+#include "vq_types.h"
+
+/* placement is split into a fixed number of parts, each with its own
+ * statistics, so the trained codebook does not depend on the thread count
+ */
+#define PLACE_PARTS 64
+#define MAX_THREADS PLACE_PARTS
+
+/* sampled training never draws fewer quads than this (16 per code) */
+#define MIN_SAMPLES 4096
+
+/* upper limit of refinement rounds after the codebook is full */
+#define MAX_REFINE 50
+
+#define PACK1555(a, r, g, b) ( (a ? 0x8000 : 0) | ((r>>3)<<10) | ((g>>3)<<5) | ((b >>3)))
+#define PACK4444(a, r, g, b) ( ((a>>4) << 12) | ((r>>4)<<8) | ((g>>4)<<4) | ((b>>4)) )
+#define PACK565(r, g, b) (((r>>3)<<11) | ((g>>2)<<5) | ((b>>3)))
+
+/* progress output, only when verbose */
+#define VLOG(p, ...) do { \
+        if((p)->verbose && (p)->log != NULL) \
+            fprintf((p)->log, __VA_ARGS__); \
+    } while (0)
+
+static void reset_code(code_t *c) {
+    clear_quad(&c->pos_sum);
+    c->pos_count = 0;
+    c->max_dist = 0.0;
+}
+
+static void reset_codebook(context_t *cb) {
+    int i;
+    code_t *e;
+
+    e = cb->codes;
+
+    for(i = 0; i < cb->in_use; i++) {
+        reset_code(e);
+        e++;
+    }
+}
+
+
+static double quad_length(fquad_t *q) {
+    int i;
+    float total;
+
+    total = 0.0;
+
+    for(i = 0; i < 4; i++) {
+        total += (q->p[i].a * q->p[i].a);
+        total += (q->p[i].r * q->p[i].r);
+        total += (q->p[i].g * q->p[i].g);
+        total += (q->p[i].b * q->p[i].b);
+    }
+
+    return sqrt(total);
+}
+
+static int quads_in_map(int res) {
+    int across;
+
+    across = (1 << (res + 1));
+    return (across * across) >> 2;
+}
+
+/* squared distance between two quads, giving up once it reaches limit */
+static double partial_dist(fquad_t *a, fquad_t *b, double limit) {
+    int i;
+    double total, d;
+
+    total = 0.0;
+
+    for(i = 0; i < 4 && total < limit; i++) {
+        d = a->p[i].a - b->p[i].a;
+        total += d * d;
+        d = a->p[i].r - b->p[i].r;
+        total += d * d;
+        d = a->p[i].g - b->p[i].g;
+        total += d * d;
+        d = a->p[i].b - b->p[i].b;
+        total += d * d;
+    }
+
+    return total;
+}
+
+/* the full distance, summed the same way as the pruned search in find2(),
+ * so refinement compares its bounds against exactly the same numbers
+ */
+static double delta_e(fquad_t *a, fquad_t *b) {
+    return sqrt(partial_dist(a, b, 1e30));
+}
+
+/* returns the closest (most similar) codebook entry to the given quad */
+static int find(context_t *cb, fquad_t *q) {
+    int code, close_entry;
+    double close_dist;
+
+    close_entry = 0;
+    close_dist = delta_e(&cb->codes[0].value, q);
+
+    for(code = 1; code < cb->in_use; code++) {
+
+        /* hope not to get sued for this variable's name */
+        double d;
+
+        d = delta_e(&cb->codes[code].value, q);
+
+        if(d < close_dist) {
+            close_entry = code;
+            close_dist = d;
+
+            if(d < 0.0001) {
+                /* close enough */
+                return close_entry;
+            }
+        }
+
+    }
+
+    return close_entry;
+}
+
+/* like find(), also returning the distances to the closest and the
+ * second closest entry; codes already further away than the second
+ * closest are dropped before all their components are summed
+ */
+static int find2(context_t *cb, fquad_t *q, double *best, double *second) {
+    int code, close_entry;
+    double d, b2, s2;
+
+    close_entry = 0;
+    b2 = partial_dist(&cb->codes[0].value, q, 1e30);
+    s2 = 1e30;
+
+    for(code = 1; code < cb->in_use; code++) {
+        d = partial_dist(&cb->codes[code].value, q, s2);
+
+        if(d < b2) {
+            s2 = b2;
+            b2 = d;
+            close_entry = code;
+        }
+        else if(d < s2) {
+            s2 = d;
+        }
+    }
+
+    *best = sqrt(b2);
+    *second = sqrt(s2);
+    return close_entry;
+}
+
+/* assigns each quad its closest code; this is the costly part, so it is
+ * what the parts run at once
+ */
+static void place(context_t *cb, fquad_t *quads, uint8 *indices, int nquads) {
+    int i;
+
+    for(i = 0; i < nquads; i++)
+        indices[i] = find(cb, &quads[i]);
+}
+
+/* adds the quads of a segment to the statistics of the codes they were
+ * assigned; always done in order on one thread, as the float sums then
+ * come out the same whatever the thread count
+ */
+static void gather(context_t *cb, fquad_t *quads, uint8 *indices,
+                   int nquads) {
+    int i;
+    code_t *e;
+    double dist;
+    fquad_t *that;
+
+    that = quads;
+
+    for(i = 0; i < nquads; i++) {
+        /* find averages of all codebook entries */
+        e = &cb->codes[indices[i]];
+
+        add_quad(&e->pos_sum, that);
+        e->pos_count++;
+
+        /* see if we have something better in hand */
+        dist = delta_e(&e->value, that);
+
+        if(dist > e->max_dist) {
+            e->max_dist = dist;
+            copy_quad(&e->max_dist_vec, that);
+        }
+
+        that++;
+    }
+}
+
+/* moves each code to the average of its quads and drops unused codes;
+ * remap[] receives the new position of every old code index
+ */
+static void clean_codebook(context_t *cb, uint8 *remap) {
+    int i;
+    code_t * e;
+
+    for(i = 0; i < 256; i++)
+        remap[i] = i;
+
+    i = 0;
+
+    while(i < cb->in_use) {
+        e = &cb->codes[i];
+
+        if(e->pos_count > 0) {
+            /* code has been used */
+            div_quad(&e->pos_sum, (float)e->pos_count);
+            copy_quad(&e->value, &e->pos_sum);
+            i++;
+        }
+        else {
+            /* never been used, fill the hole with the last code
+             * and look at this slot again
+             */
+            cb->in_use--;
+            *e = cb->codes[cb->in_use];
+            e->index = i;
+            remap[cb->in_use] = i;
+        }
+    }
+}
+
+/* add new quad to codebook */
+static int add_to_codebook(context_t *cb, fquad_t *q) {
+    int index;
+
+    index = cb->in_use;
+    reset_code(&cb->codes[index]);
+    copy_quad(&cb->codes[index].value, q);
+
+    cb->codes[index].index = index;
+
+    /* update sequencial id */
+    cb->in_use++;
+    return index;
+}
+
+/* based on the statistics, split the entries in the codebook table */
+static void split(context_t *cb) {
+    int     i, elements;
+    code_t  *e;
+    fquad_t new_element;
+
+    e = cb->codes;
+    elements = cb->in_use;
+
+    for(i = 0; i < elements; i++) {
+        if(e->pos_count > 1) {
+
+            fquad_t diff;
+            float len;
+
+            sub_quad(&diff, &e->max_dist_vec, &e->value);
+            len = quad_length(&diff) * 256.0f;
+            div_quad(&diff, len);
+
+            copy_quad(&new_element, &e->value);
+            add_quad(&new_element, &diff);
+
+            sub_quad(&e->value, &e->value, &diff);
+        }
+        else {
+            /* some elements were not used, so we'll
+             * merge those with a black (zero) quad and hope
+             * some other quad will find it useful.
+             */
+            copy_quad(&new_element, &e->value);
+            div_quad(&new_element, 2.0);
+        }
+
+        add_to_codebook(cb, &new_element);
+        /* fixme: remove those that are <= 0 */
+        e++;
+    }
+}
+
+static int new_context(context_t *cb) {
+    reset_code(&cb->codes[0]);
+    clear_quad(&cb->codes[0].value);
+    cb->codes[0].index = 0;
+
+    /* only one color supported, and it's black */
+    cb->in_use = 1;
+    return 0;
+}
+
+static uint16 pack(fcolor_t *c, int format) {
+    int a, r, g, b;
+
+    a = LIMIT(c->a, 0, 255);
+    r = LIMIT(c->r, 0, 255);
+    g = LIMIT(c->g, 0, 255);
+    b = LIMIT(c->b, 0, 255);
+
+    if(format == KMG_DCFMT_ARGB4444)
+        return PACK4444(a, r, g, b);
+    else if(format == KMG_DCFMT_ARGB1555)
+        return PACK1555(a, r, g, b);
+    else
+        return PACK565(r, g, b);
+}
+
+static void copy_codebook(context_t *cb, int format, uint16 *codebook) {
+    int     i;
+    code_t  *e;
+
+    e = cb->codes;
+
+    for(i = 0; i < cb->in_use; i++) {
+        /* even the codebook is twiddled! */
+        *codebook++ = le16(pack(&e->value.p[0], format));
+        *codebook++ = le16(pack(&e->value.p[2], format));
+        *codebook++ = le16(pack(&e->value.p[1], format));
+        *codebook++ = le16(pack(&e->value.p[3], format));
+        e++;
+    }
+
+    /* what's left stays zero */
+}
+
+static int divide(int *ptr, int stride, int x, int y, int blocksize, int seq) {
+    int before;
+
+    before = seq;
+
+    switch(blocksize) {
+        case 1:
+            /* cant divide anymore */
+            ptr[seq++] = y * stride + x;
+            break;
+
+        default:
+            blocksize = blocksize >> 1;
+            seq += divide(ptr, stride, x, y, blocksize, seq);
+            seq += divide(ptr, stride, x, y + blocksize, blocksize, seq);
+            seq += divide(ptr, stride, x + blocksize, y, blocksize, seq);
+            seq += divide(ptr, stride, x + blocksize, y + blocksize, blocksize, seq);
+            break;
+    }
+
+    return (seq - before);
+}
+
+/* rectangular maps are twiddled as a row or column of squares
+ * the size of the shorter side, stored one after the other
+ */
+static int *twiddle_twiddle(int width, int height) {
+    int i, length;
+    int *ptr = (int *)malloc(sizeof(int) * width * height);
+
+    if(ptr == NULL)
+        return NULL;
+
+    length = width < height ? width : height;
+
+    /* divide and conquer */
+    for(i = 0; i < width * height; i += length * length) {
+        if(width > height)
+            divide(ptr, width, i / length, 0, length, i);
+        else
+            divide(ptr, width, 0, i / length, length, i);
+    }
+
+    return ptr;
+}
+static void write_linear(uint8 *out, mipmap_t *m, int res) {
+    memcpy(out, m->index[res], m->qw[res] * m->qh[res]);
+}
+
+static int write_twiddled(uint8 *out, mipmap_t *m, int res) {
+    int *twiddled;
+    int i, nquads;
+    uint8 *index;
+
+    nquads = m->qw[res] * m->qh[res];
+    twiddled = twiddle_twiddle(m->qw[res], m->qh[res]);
+
+    if(twiddled == NULL)
+        return -ENOMEM;
+
+    index = m->index[res];
+
+    for(i = 0; i < nquads; i++)
+        out[i] = index[twiddled[i]];
+
+    free(twiddled);
+    return 0;
+}
+
+/* bytes of index data write_indices() stores for m */
+static int index_bytes(mipmap_t *m, const dctex_params_t *p) {
+    int res, bytes;
+
+    bytes = p->mipmap ? MIPMAP_PAD_VQ : 0;
+
+    for(res = 0; res < MAX_MIPMAP; res++) {
+        if(m->map[res] != NULL) {
+            bytes += m->qw[res] * m->qh[res];
+        }
+    }
+
+    return bytes;
+}
+
+/* stores the quad indices from the last placement, smallest map first */
+static int write_indices(uint8 *out, mipmap_t *m, const dctex_params_t *p) {
+    int res;
+
+    /* dummy byte (0) must be included in square mipmaps */
+    if(p->mipmap)
+        *out++ = '\0';
+
+    for(res = 0; res < MAX_MIPMAP; res++) {
+        /* write each valid map down, if output is required
+         * as twiddled, mess it up before storing it
+         */
+        if(m->map[res] != NULL) {
+            if(p->twiddle) {
+                if(write_twiddled(out, m, res) < 0)
+                    return -ENOMEM;
+            }
+            else
+                write_linear(out, m, res);
+
+            out += m->qw[res] * m->qh[res];
+        }
+    }
+
+    return 0;
+}
+
+static int mipmap_index(int s) {
+    int mip;
+
+    /* already assuming size is valid, so no funky business */
+    mip = 0;
+
+    /* no 1x1 bitmaps */
+    s >>= 2;
+
+    while(s) {
+        s >>= 1;
+        mip++;
+    }
+
+    return mip;
+}
+
+static fquad_t *create_map(int res, const image_t *im, const dctex_params_t *p) {
+    int x, y;
+    int nquads;
+    fquad_t *q, *qt;
+
+    if(p->debug && p->log != NULL) {
+        fprintf(p->log, "create_map(%d)\n", res);
+    }
+
+    nquads = (im->w / 2) * (im->h / 2);
+    q = (fquad_t *)malloc(nquads * sizeof(fquad_t));
+
+    if(q == NULL)
+        return NULL;
+
+    qt = q;
+
+    for(y = 0; y < im->h; y += 2) {
+        /* warning, ugly code coming up */
+        for(x = 0; x < im->w; x += 2) {
+            get_color(&qt->p[0], im->data + (y * im->stride) + (x * 4));
+            get_color(&qt->p[1], im->data + (y * im->stride) + ((x + 1) * 4));
+            get_color(&qt->p[2], im->data + ((y + 1)*im->stride) + (x * 4));
+            get_color(&qt->p[3], im->data + ((y + 1)*im->stride) + ((x + 1) * 4));
+            qt++;
+        }
+    }
+
+    return q;
+}
+
+static void destroy_mipmap(mipmap_t *m) {
+    int i;
+
+    for(i = 0; i < MAX_MIPMAP; i++) {
+        if(m->map[i]) {
+            free(m->map[i]);
+            m->map[i] = NULL;
+        }
+
+        if(m->index[i]) {
+            free(m->index[i]);
+            m->index[i] = NULL;
+        }
+    }
+}
+
+static fquad_t *create_downscaled_map(int res, fquad_t *oneup,
+                                      const dctex_params_t *p) {
+    int y, x, nquads, qw;
+    fquad_t *q, *larger, tmp;
+
+    if(p->debug && p->log != NULL) {
+        fprintf(p->log, "create_downscaled_map(%d %p)\n", res, (void *)oneup);
+    }
+
+    /* each quad in the lower resolution is an average of
+     * four quads in the higher resolution map.
+     */
+
+    qw = 1 << res;
+    nquads = quads_in_map(res);
+    q = (fquad_t *)malloc(sizeof(fquad_t) * nquads);
+
+    if(q == NULL)
+        return NULL;
+
+    for(y = 0; y < qw; y++) {
+        for(x = 0; x < qw; x++) {
+            /* clear temporary quad */
+            clear_quad(&tmp);
+
+            larger = &oneup[y * 2 * qw * 2 + x * 2];
+            sum_colors(&tmp.p[0], &larger->p[0]);
+            sum_colors(&tmp.p[0], &larger->p[1]);
+            sum_colors(&tmp.p[0], &larger->p[2]);
+            sum_colors(&tmp.p[0], &larger->p[3]);
+            div_colors(&tmp.p[0], 4.0f);
+
+            larger = &oneup[y * 2 * qw * 2 + x * 2 + 1];
+            sum_colors(&tmp.p[1], &larger->p[0]);
+            sum_colors(&tmp.p[1], &larger->p[1]);
+            sum_colors(&tmp.p[1], &larger->p[2]);
+            sum_colors(&tmp.p[1], &larger->p[3]);
+            div_colors(&tmp.p[1], 4.0f);
+
+            larger = &oneup[(y * 2 + 1) * qw * 2 + x * 2];
+            sum_colors(&tmp.p[2], &larger->p[0]);
+            sum_colors(&tmp.p[2], &larger->p[1]);
+            sum_colors(&tmp.p[2], &larger->p[2]);
+            sum_colors(&tmp.p[2], &larger->p[3]);
+            div_colors(&tmp.p[2], 4.0f);
+
+            larger = &oneup[(y * 2 + 1) * qw * 2 + x * 2 + 1];
+            sum_colors(&tmp.p[3], &larger->p[0]);
+            sum_colors(&tmp.p[3], &larger->p[1]);
+            sum_colors(&tmp.p[3], &larger->p[2]);
+            sum_colors(&tmp.p[3], &larger->p[3]);
+            div_colors(&tmp.p[3], 4.0f);
+
+            copy_quad(&q[y * qw + x], &tmp);
+        }
+    }
+
+    return q;
+}
+
+static int build_mipmap(mipmap_t *m, const image_t *i, const dctex_params_t *p) {
+    int size;
+    int image_res;
+
+    VLOG(p, "o");
+
+    /* paranoia, so later you can use destory_mipmap safely */
+    memset(m, '\0', sizeof(*m));
+
+    /* rectangular maps take the slot of their longer side */
+    image_res = mipmap_index(i->w > i->h ? i->w : i->h);
+
+    m->map[image_res] = create_map(image_res, i, p);
+    m->qw[image_res] = i->w / 2;
+    m->qh[image_res] = i->h / 2;
+
+    if(m->map[image_res] == NULL)
+        return -ENOMEM;
+
+    if(p->mipmap) {
+        /* create maps in lower resolution */
+        size = image_res - 1;
+
+        while(size >= 0) {
+            m->map[size] = create_downscaled_map(size, m->map[size + 1], p);
+            m->qw[size] = m->qh[size] = 1 << size;
+
+            if(m->map[size] == NULL)
+                return -ENOMEM;
+
+            size--;
+        }
+    }
+
+    for(size = 0; size < MAX_MIPMAP; size++) {
+        if(m->map[size] != NULL) {
+            m->index[size] = (uint8 *)calloc(m->qw[size] * m->qh[size], 1);
+
+            if(m->index[size] == NULL)
+                return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+/* handles quads [from, to) of a segment for one part */
+typedef void (*part_fn)(context_t *cb, segment_t *seg, int from, int to,
+                        code_t *stats, double *err);
+
+typedef struct place_job_t {
+    context_t *cb;
+    trainset_t *set;
+    part_fn fn;
+    code_t *stats;
+    double *err;
+    int first;
+    int step;
+} place_job_t;
+
+static void place_range(context_t *cb, segment_t *seg, int from, int to,
+                        code_t *stats, double *err) {
+    place(cb, seg->quads + from, seg->indices + from, to - from);
+}
+
+/* one Lloyd assignment step. seg->lower holds a lower bound on the
+ * distance from each quad to every code but its own; while the exact
+ * distance to its own code stays below it, the quad keeps its code
+ * without searching the codebook
+ */
+static void refine_range(context_t *cb, segment_t *seg, int from, int to,
+                         code_t *stats, double *err) {
+    int i, idx;
+    double dist, second;
+    fquad_t *that;
+
+    for(i = from; i < to; i++) {
+        that = &seg->quads[i];
+        idx = seg->indices[i];
+        dist = delta_e(&cb->codes[idx].value, that);
+
+        if(dist > seg->lower[i]) {
+            idx = find2(cb, that, &dist, &second);
+            seg->indices[i] = idx;
+            seg->lower[i] = second;
+        }
+
+        add_quad(&stats[idx].pos_sum, that);
+        stats[idx].pos_count++;
+        *err += dist * dist;
+    }
+}
+
+/* runs fn over one part; parts are fixed slices of the training set,
+ * which may cross segment boundaries
+ */
+static void place_part(place_job_t *job, int part) {
+    int s, base, start, end, from, to;
+    trainset_t *set = job->set;
+    segment_t *seg;
+
+    start = (int)((long long)set->total * part / PLACE_PARTS);
+    end = (int)((long long)set->total * (part + 1) / PLACE_PARTS);
+    base = 0;
+
+    for(s = 0; s < set->nsegs && base < end; s++) {
+        seg = &set->segs[s];
+        from = (start > base ? start : base) - base;
+        to = (end < base + seg->nquads ? end : base + seg->nquads) - base;
+
+        if(from < to)
+            job->fn(job->cb, seg, from, to,
+                    job->stats ? job->stats + part * 256 : NULL,
+                    job->err ? job->err + part : NULL);
+
+        base += seg->nquads;
+    }
+}
+
+static void *place_worker(void *arg) {
+    place_job_t *job = (place_job_t *)arg;
+    int part;
+
+    for(part = job->first; part < PLACE_PARTS; part += job->step)
+        place_part(job, part);
+
+    return NULL;
+}
+
+/* runs fn over the whole training set on all threads; stats, if given,
+ * receives PLACE_PARTS codebooks worth of statistics, err one sum per part
+ */
+static void run_parts(context_t *cb, trainset_t *set, part_fn fn,
+                      code_t *stats, double *err, int nthreads) {
+    int i;
+    pthread_t threads[MAX_THREADS];
+    place_job_t jobs[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    for(i = 0; i < nthreads; i++) {
+        jobs[i].cb = cb;
+        jobs[i].set = set;
+        jobs[i].fn = fn;
+        jobs[i].stats = stats;
+        jobs[i].err = err;
+        jobs[i].first = i;
+        jobs[i].step = nthreads;
+        started[i] = (i > 0 &&
+                      pthread_create(&threads[i], NULL, place_worker, &jobs[i]) == 0);
+    }
+
+    /* this thread takes the first share, and any share
+     * whose thread could not be started
+     */
+    for(i = 0; i < nthreads; i++) {
+        if(!started[i])
+            place_worker(&jobs[i]);
+    }
+
+    for(i = 1; i < nthreads; i++) {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+static int place_quads(context_t *cb, trainset_t *set, const dctex_params_t *p) {
+    int j, k, s;
+    uint8 remap[256];
+
+    /* scan all quads for the closest codebook index entry */
+    run_parts(cb, set, place_range, NULL, NULL, p->threads);
+
+    /* gather three times to get better quality;
+     * this is not required for most of textures
+     */
+
+    reset_codebook(cb);
+
+    for(j = 0; j < (p->hq ? 3 : 1); j++) {
+        for(s = 0; s < set->nsegs; s++)
+            gather(cb, set->segs[s].quads, set->segs[s].indices,
+                   set->segs[s].nquads);
+    }
+
+    clean_codebook(cb, remap);
+
+    /* keep the recorded indices pointing at the same codes */
+    for(s = 0; s < set->nsegs; s++) {
+        for(k = 0; k < set->segs[s].nquads; k++)
+            set->segs[s].indices[k] = remap[set->segs[s].indices[k]];
+    }
+
+    return 0;
+}
+
+/* Lloyd iterations on the full codebook, starting from the current
+ * assignment, until the distortion improves by less than p->refine
+ * (relative) or no code moves any more
+ */
+static int refine(context_t *cb, trainset_t *set, const dctex_params_t *p) {
+    int i, part, s, round, base;
+    code_t *stats, *st;
+    double err[PLACE_PARTS];
+    double total, last, shift, max_shift;
+    float *lower;
+    fquad_t old;
+
+    stats = (code_t *)malloc(PLACE_PARTS * 256 * sizeof(code_t));
+    lower = (float *)calloc(set->total, sizeof(float));
+
+    if(stats == NULL || lower == NULL) {
+        free(stats);
+        free(lower);
+        return -ENOMEM;
+    }
+
+    /* no bounds yet, so the first round searches for every quad */
+    base = 0;
+
+    for(s = 0; s < set->nsegs; s++) {
+        set->segs[s].lower = lower + base;
+        base += set->segs[s].nquads;
+    }
+
+    last = 0.0;
+
+    for(round = 0; round < MAX_REFINE; round++) {
+        for(i = 0; i < PLACE_PARTS * 256; i++)
+            reset_code(&stats[i]);
+
+        memset(err, '\0', sizeof(err));
+        run_parts(cb, set, refine_range, stats, err, p->threads);
+
+        /* move every used code to the average of its quads */
+        max_shift = 0.0;
+
+        for(i = 0; i < cb->in_use; i++) {
+            reset_code(&cb->codes[i]);
+
+            for(part = 0; part < PLACE_PARTS; part++) {
+                st = &stats[part * 256 + i];
+                add_quad(&cb->codes[i].pos_sum, &st->pos_sum);
+                cb->codes[i].pos_count += st->pos_count;
+            }
+
+            if(cb->codes[i].pos_count == 0)
+                continue;
+
+            copy_quad(&old, &cb->codes[i].value);
+            div_quad(&cb->codes[i].pos_sum, (float)cb->codes[i].pos_count);
+            copy_quad(&cb->codes[i].value, &cb->codes[i].pos_sum);
+            shift = delta_e(&old, &cb->codes[i].value);
+
+            if(shift > max_shift)
+                max_shift = shift;
+        }
+
+        total = 0.0;
+
+        for(part = 0; part < PLACE_PARTS; part++)
+            total += err[part];
+
+        VLOG(p, ".");
+
+        /* nothing moved, every cluster has converged */
+        if(max_shift == 0.0)
+            break;
+
+        if(round > 0 && last - total <= last * p->refine)
+            break;
+
+        last = total;
+
+        /* no other code got closer than the furthest any code moved */
+        for(i = 0; i < set->total; i++)
+            lower[i] -= max_shift;
+    }
+
+    for(s = 0; s < set->nsegs; s++)
+        set->segs[s].lower = NULL;
+
+    free(lower);
+    free(stats);
+    return 0;
+}
+
+/* adds every mipmap level of m to the training set */
+static int add_to_trainset(trainset_t *set, mipmap_t *m) {
+    int res;
+    segment_t *segs;
+
+    for(res = 0; res < MAX_MIPMAP; res++) {
+        if(m->map[res] == NULL)
+            continue;
+
+        segs = (segment_t *)realloc(set->segs, (set->nsegs + 1) * sizeof(segment_t));
+
+        if(segs == NULL)
+            return -ENOMEM;
+
+        set->segs = segs;
+        segs[set->nsegs].quads = m->map[res];
+        segs[set->nsegs].indices = m->index[res];
+        segs[set->nsegs].nquads = m->qw[res] * m->qh[res];
+        segs[set->nsegs].lower = NULL;
+        set->total += m->qw[res] * m->qh[res];
+        set->nsegs++;
+    }
+
+    return 0;
+}
+
+static void destroy_trainset(trainset_t *set) {
+    free(set->segs);
+    memset(set, '\0', sizeof(*set));
+}
+
+/* small deterministic generator, so sampled training gives the same
+ * codebook on every host
+ */
+static unsigned int sample_rand(unsigned int *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+/* draws pct percent of the quads of every segment, but at least
+ * MIN_SAMPLES in all, into a single new segment: each segment is cut
+ * into as many runs as it gets samples, the edges of the runs worked out
+ * exactly so any percentage is honoured, and one random quad is taken
+ * out of each run
+ */
+static int build_sample(trainset_t *sample, trainset_t *set, int pct) {
+    int s, i, n, k, m, start, len;
+    long long num, den;
+    unsigned int seed;
+    segment_t *seg, *out;
+
+    memset(sample, '\0', sizeof(*sample));
+
+    /* the sampled fraction is num / den */
+    num = pct;
+    den = 100;
+
+    if(set->total * num < MIN_SAMPLES * den) {
+        num = MIN_SAMPLES;
+        den = set->total;
+    }
+
+    if(num >= den)
+        return 0;
+
+    n = 0;
+
+    for(s = 0; s < set->nsegs; s++)
+        n += (set->segs[s].nquads * num + den - 1) / den;
+
+    out = (segment_t *)calloc(1, sizeof(segment_t));
+
+    if(out == NULL)
+        return -ENOMEM;
+
+    sample->segs = out;
+    sample->nsegs = 1;
+    out->quads = (fquad_t *)malloc(n * sizeof(fquad_t));
+    out->indices = (uint8 *)calloc(n, 1);
+
+    if(out->quads == NULL || out->indices == NULL)
+        return -ENOMEM;
+
+    seed = 1;
+
+    for(s = 0; s < set->nsegs; s++) {
+        seg = &set->segs[s];
+        m = (seg->nquads * num + den - 1) / den;
+
+        for(k = 0; k < m; k++) {
+            start = (long long)k * seg->nquads / m;
+            len = (long long)(k + 1) * seg->nquads / m - start;
+
+            i = start + sample_rand(&seed) % len;
+            copy_quad(&out->quads[out->nquads++], &seg->quads[i]);
+        }
+    }
+
+    sample->total = out->nquads;
+    return 0;
+}
+
+static void destroy_sample(trainset_t *sample) {
+    if(sample->segs != NULL) {
+        free(sample->segs[0].quads);
+        free(sample->segs[0].indices);
+    }
+
+    destroy_trainset(sample);
+}
+
+/* mean squared error per color component of the last placement */
+static double distortion(context_t *cb, trainset_t *set) {
+    int s, i;
+    double d, total;
+    segment_t *seg;
+
+    total = 0.0;
+
+    for(s = 0; s < set->nsegs; s++) {
+        seg = &set->segs[s];
+
+        for(i = 0; i < seg->nquads; i++) {
+            d = delta_e(&cb->codes[seg->indices[i]].value, &seg->quads[i]);
+            total += d * d;
+        }
+    }
+
+    return set->total > 0 ? total / (set->total * 16.0) : 0.0;
+}
+
+static double seconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* grows the codebook from a single black code to 256 entries; with
+ * sampling the codebook is fitted to a subset and only the last
+ * placement assigns every quad
+ */
+static int grow(context_t *cb, trainset_t *set, const dctex_params_t *p,
+                int sample_pct) {
+    int i;
+    trainset_t sample, *fit;
+
+    if(sample_pct > 0) {
+        if(build_sample(&sample, set, sample_pct) < 0) {
+            destroy_sample(&sample);
+            return -ENOMEM;
+        }
+    }
+    else
+        memset(&sample, '\0', sizeof(sample));
+
+    fit = sample.total > 0 ? &sample : set;
+
+    if(fit != set) {
+        VLOG(p, "(sampled %d of %d quads) ", fit->total, set->total);
+    }
+
+    new_context(cb);
+
+    /* feed all quads (all resolutions) */
+    if(place_quads(cb, fit, p) < 0)
+        goto nomem;
+
+    /* starting with one codebook entry, split 7 times */
+    for(i = 1; i <= 7; i++) {
+        VLOG(p, "o");
+
+        split(cb);
+
+        if(place_quads(cb, fit, p) < 0)
+            goto nomem;
+    }
+
+    /* the last split fills the codebook; one more placement assigns
+     * every quad its final code, which is written out as-is
+     */
+    split(cb);
+
+    if(p->refine > 0.0) {
+        if(place_quads(cb, fit, p) < 0 || refine(cb, fit, p) < 0)
+            goto nomem;
+    }
+
+    if(fit != set || p->refine == 0.0) {
+        if(place_quads(cb, set, p) < 0)
+            goto nomem;
+    }
+
+    VLOG(p, "\n");
+
+    destroy_sample(&sample);
+    return 0;
+
+nomem:
+    destroy_sample(&sample);
+    return -ENOMEM;
+}
+
+/* trains cb on set; with sample_check the sampled training is compared
+ * against training on everything, and the report goes to the log even
+ * when not verbose
+ */
+static int train(context_t *cb, trainset_t *set, const dctex_params_t *p) {
+    double t, full_time, full_err, err;
+
+    if(p->sample == 0 || !p->sample_check)
+        return grow(cb, set, p, p->sample);
+
+    /* train on everything first, so the sampled run leaves its
+     * indices behind for saving
+     */
+    t = seconds();
+
+    if(grow(cb, set, p, 0) < 0)
+        return -ENOMEM;
+
+    full_time = seconds() - t;
+    full_err = distortion(cb, set);
+    t = seconds();
+
+    if(grow(cb, set, p, p->sample) < 0)
+        return -ENOMEM;
+
+    t = seconds() - t;
+    err = distortion(cb, set);
+
+    if(p->log == NULL)
+        return 0;
+
+    fprintf(p->log, "full training: mse %.2f (%.2f dB) in %.2fs\n", full_err,
+            10.0 * log10(255.0 * 255.0 / full_err), full_time);
+    fprintf(p->log, "%d%% sample:    mse %.2f (%.2f dB) in %.2fs, %+.1f%% distortion\n",
+            p->sample, err, 10.0 * log10(255.0 * 255.0 / err), t,
+            full_err > 0.0 ? (err - full_err) * 100.0 / full_err : 0.0);
+    return 0;
+}
+
+/* the caller's parameters, with the thread count clamped for run_parts() */
+static void vq_params(dctex_params_t *vp, const dctex_params_t *p) {
+    *vp = *p;
+    vp->vq = 1;
+
+    if(vp->threads < 1)
+        vp->threads = 1;
+    else if(vp->threads > MAX_THREADS)
+        vp->threads = MAX_THREADS;
+
+    /* a full sample is no sample */
+    if(vp->sample >= 100)
+        vp->sample = 0;
+}
+
+int dctex_encode_vq(const image_t *img, const dctex_params_t *params,
+                    dctex_buffer_t *out) {
+    int     ok;
+    uint8       *data;
+    dctex_params_t  p;
+    mipmap_t    mipmap;
+    context_t   context;
+    trainset_t  set;
+
+    vq_params(&p, params);
+    memset(&set, '\0', sizeof(set));
+
+    ok = build_mipmap(&mipmap, img, &p);
+
+    if(ok == 0)
+        ok = add_to_trainset(&set, &mipmap);
+
+    if(ok == 0)
+        ok = train(&context, &set, &p);
+
+    if(ok == 0) {
+        data = dctex_alloc(out, &p, img, p.format | KMG_DCFMT_VQ,
+                           VQ_CODEBOOK_SIZE + index_bytes(&mipmap, &p));
+
+        if(data == NULL) {
+            ok = -ENOMEM;
+        }
+        else {
+            copy_codebook(&context, p.format, (uint16 *)data);
+            ok = write_indices(data + VQ_CODEBOOK_SIZE, &mipmap, &p);
+        }
+    }
+
+    if(ok < 0)
+        dctex_free(out);
+
+    destroy_trainset(&set);
+    destroy_mipmap(&mipmap);
+    return ok;
+}
+
+/* trains a single codebook over the quads of every image, so a set of
+ * similar textures can ship one codebook and an index buffer per texture
+ */
+int dctex_encode_shared(const image_t *imgs, int n, const dctex_params_t *params,
+                        dctex_buffer_t *cb, dctex_buffer_t *out) {
+    int     i, ok, built;
+    uint8       *data;
+    dctex_params_t  p;
+    mipmap_t    *mipmaps;
+    context_t   context;
+    trainset_t  set;
+
+    vq_params(&p, params);
+    memset(&set, '\0', sizeof(set));
+    memset(cb, '\0', sizeof(*cb));
+    memset(out, '\0', n * sizeof(*out));
+
+    /* a texture set is all or nothing */
+    for(i = 0; i < n; i++) {
+        if(dctex_check(&imgs[i], &p) < 0)
+            return -EINVAL;
+    }
+
+    mipmaps = (mipmap_t *)calloc(n, sizeof(mipmap_t));
+
+    if(mipmaps == NULL)
+        return -ENOMEM;
+
+    ok = 0;
+
+    for(built = 0; built < n && ok == 0; built++) {
+        ok = build_mipmap(&mipmaps[built], &imgs[built], &p);
+
+        if(ok == 0)
+            ok = add_to_trainset(&set, &mipmaps[built]);
+    }
+
+    if(ok == 0) {
+        VLOG(&p, "training shared codebook on %d quads.. ", set.total);
+        ok = train(&context, &set, &p);
+    }
+
+    if(ok == 0) {
+        cb->size = VQ_CODEBOOK_SIZE;
+        cb->data = (uint8 *)calloc(cb->size, 1);
+
+        if(cb->data == NULL)
+            ok = -ENOMEM;
+        else
+            copy_codebook(&context, p.format, (uint16 *)cb->data);
+    }
+
+    for(i = 0; i < n && ok == 0; i++) {
+        data = dctex_alloc(&out[i], &p, &imgs[i],
+                           p.format | KMG_DCFMT_VQ | KMG_DCFMT_VQ_SHARED,
+                           index_bytes(&mipmaps[i], &p));
+
+        if(data == NULL)
+            ok = -ENOMEM;
+        else
+            ok = write_indices(data, &mipmaps[i], &p);
+    }
+
+    if(ok < 0) {
+        dctex_free(cb);
+
+        for(i = 0; i < n; i++)
+            dctex_free(&out[i]);
+    }
+
+    destroy_trainset(&set);
+
+    for(i = 0; i < built; i++)
+        destroy_mipmap(&mipmaps[i]);
+
+    free(mipmaps);
+    return ok;
+}
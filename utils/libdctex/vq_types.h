@@ -27,6 +27,13 @@ typedef struct fquad_t {
 typedef struct mipmap_t {
     /* each map represents quads of a different resolution */
     fquad_t *map[MAX_MIPMAP];
+
+    /* codebook entry each quad was assigned by the last placement */
+    uint8 *index[MAX_MIPMAP];
+
+    /* size of each map in quads; only square maps have mipmaps */
+    int qw[MAX_MIPMAP];
+    int qh[MAX_MIPMAP];
 } mipmap_t;
 
 typedef struct code_t {
@@ -49,4 +56,21 @@ typedef struct context_t {
     code_t codes[256];
 } context_t;
 
+/* a run of quads the codebook is trained on, with their indices */
+typedef struct segment_t {
+    fquad_t *quads;
+    uint8 *indices;
+    int nquads;
+
+    /* distance bounds used while refining, NULL otherwise */
+    float *lower;
+} segment_t;
+
+/* all quads of all mipmap levels of all images sharing a codebook */
+typedef struct trainset_t {
+    segment_t *segs;
+    int nsegs;
+    int total;
+} trainset_t;
+
 #endif
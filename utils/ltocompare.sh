@@ -0,0 +1,66 @@
+#!/bin/sh
+
+# ltocompare.sh
+# Builds an examples tree twice, once normally and once with the LTO specs
+# profile from "setup.sh --lto", and compares the section sizes of every ELF.
+# Needs a KOS environment (environ.sh) to be sourced first.
+
+usage() {
+	echo 'ltocompare.sh [<examples dir>] [<report file>]'
+}
+
+if [ $# -gt 2 ]; then
+	usage
+	exit 1
+fi
+
+exdir=${1:-$(dirname $0)/../examples}
+report=${2:-ltocompare.txt}
+make_tool=${KOS_MAKE:-make}
+size_tool=${KOS_SIZE:-$(echo "${KOS_OBJCOPY}" | sed -e "s/objcopy$/size/")}
+lto_flags="-specs=dreamcast-sh-lto.specs"
+
+if [ "x${KOS_BASE}" = "x" ]; then
+	echo "KOS environment is not set up, source environ.sh first"
+	exit 1
+fi
+
+# Build the tree with extra flags and record "<elf> <text> <data> <bss>"
+# @param[in] $1 extra compile and link flags
+# @param[in] $2 output record file
+build_sizes() {
+	$make_tool -C $exdir clean > /dev/null 2>&1
+	KOS_CFLAGS="$KOS_CFLAGS $1" KOS_LDFLAGS="$KOS_LDFLAGS $1" \
+		$make_tool -C $exdir > $2.log 2>&1
+	if [ $? -ne 0 ]; then
+		echo "build failed with \"$1\", comparing what was built (see $2.log)"
+	fi
+	find $exdir -name '*.elf' | sort | xargs $size_tool 2> /dev/null | \
+		awk 'NR > 1 { print $6, $1, $2, $3 }' > $2
+}
+
+echo "Building $exdir without LTO..."
+build_sizes "" /tmp/ltocmp_base$$
+echo "Building $exdir with LTO..."
+build_sizes "$lto_flags" /tmp/ltocmp_lto$$
+$make_tool -C $exdir clean > /dev/null 2>&1
+
+# Only programs that built both ways are compared
+join /tmp/ltocmp_base$$ /tmp/ltocmp_lto$$ | awk '
+	function pct(a, b) { return a > 0 ? (b - a) * 100.0 / a : 0 }
+	BEGIN {
+		printf "%-50s %9s %9s %8s %9s %9s %8s\n", "program", "text", "lto text", "delta", "data+bss", "lto", "delta"
+	}
+	{
+		printf "%-50s %9d %9d %7.1f%% %9d %9d %7.1f%%\n", $1, $2, $5, pct($2, $5), $3 + $4, $6 + $7, pct($3 + $4, $6 + $7)
+		text += $2; ltotext += $5; mem += $3 + $4; ltomem += $6 + $7
+		if ($5 < $2) smaller++
+		n++
+	}
+	END {
+		printf "%-50s %9d %9d %7.1f%% %9d %9d %7.1f%%\n", "total", text, ltotext, pct(text, ltotext), mem, ltomem, pct(mem, ltomem)
+		printf "%d of %d programs have smaller code with LTO\n", smaller, n
+	}' | tee $report
+
+rm -f /tmp/ltocmp_base$$ /tmp/ltocmp_lto$$
+echo "Build logs: /tmp/ltocmp_base$$.log /tmp/ltocmp_lto$$.log"
@@ -11,13 +11,16 @@
 /****************************** LINUX SPECIFIC CODE ***********************************/
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 
-typedef unsigned char uint8;
-typedef unsigned short uint16;
-typedef unsigned long uint32;
-typedef signed char int8;
-typedef signed short int16;
-typedef signed long int32;
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
 
 /* KOS VFS prims */
 #define O_RDONLY 0
@@ -56,6 +59,7 @@ void thd_mutex_unlock(int *p) { }
 /* #include <kallisti/stdtypes.h> */
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 /* Header definitions from Linux ROMFS documentation; all integer quantities are
    expressed in big-endian notation. Unfortunately the ROMFS guys were being
@@ -78,6 +82,14 @@ typedef struct {
     char    filename[16];       /* File name (zero-terminated) */
 } romdisk_file_t;
 
+/* A regular file with this in spec_info was stored compressed by genromfs
+   --compress. Its data starts with the uncompressed size, the block size
+   and a table with the offset of each block from the start of the data
+   (plus one for the end of the last), all big endian like the headers.
+   Blocks are deflated separately; one whose stored length equals its
+   uncompressed length was stored as it is. */
+#define ROMFH_ZLIB 0x7a6c6962
+
 
 /* Util function to reverse the byte order of a uint32 */
 static uint32 ntohl_32(const void *data) {
@@ -102,12 +114,31 @@ static struct {
     int     dir;        /* >0 if a directory */
     uint32      ptr;        /* Current read position in bytes */
     uint32      size;       /* Length of file in bytes */
+    uint32      zblock;     /* Block size if compressed, otherwise 0 */
     /* dirent_t dirent; */  /* A static dirent to pass back to clients */
 } fh[MAX_RD_FILES];
 
 /* Mutex for file handles */
 static thd_mutex_t fh_mutex;
 
+/* Blocks of compressed files are inflated into this cache, which is shared
+   by all the handles. Entries are found by the file's data offset, which
+   stays valid after a close since the image never changes. */
+#define RD_ZCACHE 4
+static struct {
+    uint32      index;      /* fh index of the file, 0 if unused */
+    uint32      block;      /* Block number within the file */
+    uint32      used;       /* Last use, the oldest gets replaced */
+    uint32      size;       /* Bytes in this block */
+    uint32      alloc;      /* Bytes allocated for data */
+    uint8       *data;
+} zcache[RD_ZCACHE];
+
+static uint32 zcache_clock;
+
+/* Mutex for the block cache */
+static thd_mutex_t zcache_mutex;
+
 /* Given a filename and a starting romdisk directory listing (byte offset),
    search for the entry in the directory and return the byte offset to its
    entry. */
@@ -147,7 +178,7 @@ static uint32 romdisk_find_object(const char *fn, int fnlen, int dir, uint32 off
         }
 
         /* Check filename */
-        if(!strncmp(fhdr->filename, fn, fnlen)) {
+        if(!strncmp(fhdr->filename, fn, fnlen) && !fhdr->filename[fnlen]) {
             /* Match: return this index */
             return i;
         }
@@ -281,10 +312,129 @@ uint32 romdisk_open(const char *fn, int mode) {
     fh[fd].dir = 0;
     fh[fd].ptr = 0;
     fh[fd].size = ntohl_32(&fhdr->size);
+    fh[fd].zblock = 0;
+
+    if(ntohl_32(&fhdr->spec_info) == ROMFH_ZLIB) {
+        fh[fd].size = ntohl_32(romdisk_image + fh[fd].index);
+        fh[fd].zblock = ntohl_32(romdisk_image + fh[fd].index + 4);
+    }
 
     return fd;
 }
 
+/* Inflate one block of a compressed file to dst; returns its size or -1 */
+static int romdisk_inflate(uint32 fd, uint32 block, uint8 *dst) {
+    const uint8 *data = romdisk_image + fh[fd].index;
+    uint32      start, end, len;
+    uLongf      outlen;
+
+    start = ntohl_32(data + 8 + block * 4);
+    end = ntohl_32(data + 12 + block * 4);
+    len = fh[fd].size - block * fh[fd].zblock;
+
+    if(len > fh[fd].zblock)
+        len = fh[fd].zblock;
+
+    if(end - start == len) {
+        memcpy(dst, data + start, len);
+        return len;
+    }
+
+    outlen = len;
+
+    if(uncompress(dst, &outlen, data + start, end - start) != Z_OK
+            || outlen != len)
+        return -1;
+
+    return len;
+}
+
+/* Find a block of a compressed file in the cache, inflating it into the
+   least recently used entry if it isn't there. Call with zcache_mutex
+   held; returns the entry or -1. */
+static int romdisk_zcache(uint32 fd, uint32 block) {
+    int     i, victim = 0, len;
+    uint8   *data;
+
+    for(i = 0; i < RD_ZCACHE; i++) {
+        if(zcache[i].index == fh[fd].index && zcache[i].block == block) {
+            zcache[i].used = ++zcache_clock;
+            return i;
+        }
+
+        if(zcache[i].used < zcache[victim].used)
+            victim = i;
+    }
+
+    if(zcache[victim].alloc < fh[fd].zblock) {
+        data = realloc(zcache[victim].data, fh[fd].zblock);
+
+        if(data == NULL)
+            return -1;
+
+        zcache[victim].data = data;
+        zcache[victim].alloc = fh[fd].zblock;
+    }
+
+    zcache[victim].index = 0;
+    len = romdisk_inflate(fd, block, zcache[victim].data);
+
+    if(len < 0)
+        return -1;
+
+    zcache[victim].index = fh[fd].index;
+    zcache[victim].block = block;
+    zcache[victim].size = len;
+    zcache[victim].used = ++zcache_clock;
+
+    return victim;
+}
+
+/* Read from a compressed file. Whole blocks are inflated straight into the
+   caller's buffer; partial ones go through the cache so that small reads
+   don't inflate the same block over and over. */
+static ssize_t romdisk_read_z(uint32 fd, uint8 *buf, size_t bytes) {
+    size_t  done = 0, n;
+    uint32  block, offset;
+    int     c;
+
+    thd_mutex_lock(&zcache_mutex);
+
+    while(done < bytes) {
+        block = fh[fd].ptr / fh[fd].zblock;
+        offset = fh[fd].ptr % fh[fd].zblock;
+
+        if(offset == 0 && bytes - done >= fh[fd].zblock) {
+            c = romdisk_inflate(fd, block, buf + done);
+
+            if(c < 0)
+                break;
+
+            n = c;
+        }
+        else {
+            c = romdisk_zcache(fd, block);
+
+            if(c < 0)
+                break;
+
+            n = zcache[c].size - offset;
+
+            if(n > bytes - done)
+                n = bytes - done;
+
+            memcpy(buf + done, zcache[c].data + offset, n);
+        }
+
+        fh[fd].ptr += n;
+        done += n;
+    }
+
+    thd_mutex_unlock(&zcache_mutex);
+
+    return done || bytes == 0 ? (ssize_t)done : -1;
+}
+
 /* Close a file or directory */
 void romdisk_close(uint32 fd) {
     /* Check that the fd is valid */
@@ -296,8 +446,6 @@ void romdisk_close(uint32 fd) {
 
 /* Read from a file */
 ssize_t romdisk_read(uint32 fd, void *buf, size_t bytes) {
-    int rv = 0, toread, thissect, c;
-
     /* Check that the fd is valid */
     if(fd >= MAX_RD_FILES || fh[fd].index == 0)
         return -1;
@@ -306,6 +454,9 @@ ssize_t romdisk_read(uint32 fd, void *buf, size_t bytes) {
     if((fh[fd].ptr + bytes) > fh[fd].size)
         bytes = fh[fd].size - fh[fd].ptr;
 
+    if(fh[fd].zblock)
+        return romdisk_read_z(fd, buf, bytes);
+
     /* Copy out the requested amount */
     memcpy(buf, romdisk_image + fh[fd].index + fh[fd].ptr, bytes);
     fh[fd].ptr += bytes;
@@ -313,8 +464,11 @@ ssize_t romdisk_read(uint32 fd, void *buf, size_t bytes) {
     return bytes;
 }
 
-/* Seek elsewhere in a file */
+/* Seek elsewhere in a file. Positions in compressed files are in the
+   uncompressed data; the block is only inflated by the next read. */
 off_t romdisk_seek(uint32 fd, off_t offset, int whence) {
+    off_t   pos;
+
     /* Check that the fd is valid */
     if(fd >= MAX_RD_FILES || fh[fd].index == 0)
         return -1;
@@ -322,19 +476,24 @@ off_t romdisk_seek(uint32 fd, off_t offset, int whence) {
     /* Update current position according to arguments */
     switch(whence) {
         case SEEK_SET:
-            fh[fd].ptr = offset;
+            pos = offset;
+            break;
         case SEEK_CUR:
-            fh[fd].ptr += offset;
+            pos = fh[fd].ptr + offset;
+            break;
         case SEEK_END:
-            fh[fd].ptr = fh[fd].size + offset;
+            pos = fh[fd].size + offset;
+            break;
         default:
             return -1;
     }
 
     /* Check bounds */
-    if(fh[fd].ptr < 0) fh[fd].ptr = 0;
+    if(pos < 0) pos = 0;
 
-    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
+    if(pos > fh[fd].size) pos = fh[fd].size;
+
+    fh[fd].ptr = pos;
 
     return fh[fd].ptr;
 }
@@ -355,6 +514,23 @@ size_t romdisk_total(uint32 fd) {
     return fh[fd].size;
 }
 
+/* Get at a file's data in place, without copying it out. Returns a pointer
+   into the image and sets *size to the file's length; the data stays valid
+   for as long as the romdisk is mounted, even after the file is closed.
+   The data of every file starts 16 byte aligned, or on the -a/-A boundary
+   genromfs was given, counting from the start of the image, so the image
+   has to be loaded at least that aligned itself. Compressed files can't be
+   mapped and return NULL; read them instead. */
+const void *romdisk_mmap(uint32 fd, size_t *size) {
+    if(fd >= MAX_RD_FILES || fh[fd].index == 0 || fh[fd].zblock)
+        return NULL;
+
+    if(size)
+        *size = fh[fd].size;
+
+    return romdisk_image + fh[fd].index;
+}
+
 /* Read a directory entry */
 dirent_t *romdisk_readdir(uint32 fd) {
     /*  int     i, c;
@@ -393,7 +569,7 @@ int fs_romdisk_init(uint8 *img) {
     romdisk_hdr = (romdisk_hdr_t *)romdisk_image;
 
     if(strncmp(romdisk_image, "-rom1fs-", 8)) {
-        printf("Rom disk image at 0x%x is not a ROMFS image\r\n", img);
+        printf("Rom disk image at %p is not a ROMFS image\r\n", img);
         return -1;
     }
 
@@ -438,8 +614,13 @@ int fs_romdisk_init(uint8 *img) {
     /* Mark the first as active so we can have an error FD of zero */
     fh[0].index = -1;
 
+    /* Nothing cached yet */
+    memset(zcache, 0, sizeof(zcache));
+    zcache_clock = 0;
+
     /* Init thread mutexes */
     thd_mutex_reset(&fh_mutex);
+    thd_mutex_reset(&zcache_mutex);
 
     /* Register with VFS */
     return fs_handler_add("/rd", &vh);
@@ -447,6 +628,14 @@ int fs_romdisk_init(uint8 *img) {
 
 /* De-init the file system */
 int fs_romdisk_shutdown() {
+    int i;
+
+    for(i = 0; i < RD_ZCACHE; i++) {
+        free(zcache[i].data);
+        zcache[i].data = NULL;
+        zcache[i].alloc = 0;
+    }
+
     return fs_handler_remove(&vh);
 }
 
@@ -456,54 +645,328 @@ int fs_romdisk_shutdown() {
 
 /********************************************************************************/
 
-void init() {
-    char *img;
+static char *image_data;
+static long image_size;
+
+/* File data in the image is aligned to what genromfs was asked for; this
+   keeps any -a/-A value up to a page aligned in memory too */
+#define IMAGE_ALIGN 4096
+
+int init(const char *fn) {
     FILE *f;
-    int  size;
 
-    f = fopen("romdisk2.img", "r");
+    f = fopen(fn, "rb");
 
-    if(!f) return;
+    if(!f) {
+        printf("Couldn't open %s\n", fn);
+        return -1;
+    }
 
     fseek(f, 0, SEEK_END);
-    size = ftell(f);
+    image_size = ftell(f);
     fseek(f, 0, SEEK_SET);
-    img = malloc(size);
-    fread(img, size, 1, f);
+    if(posix_memalign((void **)&image_data, IMAGE_ALIGN, image_size)) {
+        fclose(f);
+        return -1;
+    }
+
+    fread(image_data, image_size, 1, f);
     fclose(f);
 
-    fs_romdisk_init(img);
+    return fs_romdisk_init((uint8 *)image_data);
+}
+
+/* Files found in the image for the benchmark */
+static char **bench_files;
+static int bench_count;
+static uint32 bench_stored;
+
+/* Collect the regular files under the directory whose entries start at i */
+static void bench_walk(uint32 i, const char *path) {
+    romdisk_file_t  *fhdr;
+    uint32          ni, type;
+    char            *name;
+
+    while(i != 0) {
+        fhdr = (romdisk_file_t *)(romdisk_image + i);
+        ni = ntohl_32(&fhdr->next_header);
+        type = ni & 7;
+        i = ni & 0xfffffff0;
+
+        if(!strcmp(fhdr->filename, ".") || !strcmp(fhdr->filename, ".."))
+            continue;
+
+        name = malloc(strlen(path) + strlen(fhdr->filename) + 2);
+        sprintf(name, "%s/%s", path, fhdr->filename);
+
+        if(type == 1) {
+            bench_walk(ntohl_32(&fhdr->spec_info), name);
+            free(name);
+        }
+        else if(type == 2) {
+            bench_files = realloc(bench_files,
+                                  (bench_count + 1) * sizeof(char *));
+            bench_files[bench_count++] = name;
+            bench_stored += ntohl_32(&fhdr->size);
+        }
+        else
+            free(name);
+    }
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read every file in the image start to end in 4K chunks, then make small
+   reads at random places, and report how fast both went. The checksum is
+   over everything read, so a raw and a compressed image of the same tree
+   have to give the same one. */
+int bench(int passes) {
+    static uint8    buf[4096];
+    uint32          fd, total = 0, sum = 1, size;
+    double          t, seq, rnd;
+    int             i, p, r, reads = 0;
+
+    t = bench_now();
+
+    for(p = 0; p < passes; p++) {
+        for(i = 0; i < bench_count; i++) {
+            if((fd = romdisk_open(bench_files[i], O_RDONLY)) == 0) {
+                printf("Couldn't open %s\n", bench_files[i]);
+                return -1;
+            }
+
+            while((r = romdisk_read(fd, buf, sizeof(buf))) > 0) {
+                if(p == 0)
+                    sum = adler32(sum, buf, r);
+
+                total += r;
+            }
+
+            romdisk_close(fd);
+        }
+    }
+
+    seq = bench_now() - t;
+
+    srand(1);
+    t = bench_now();
+
+    for(p = 0; p < passes; p++) {
+        for(i = 0; i < bench_count; i++) {
+            fd = romdisk_open(bench_files[i], O_RDONLY);
+            size = romdisk_total(fd);
+
+            for(r = 0; size && r < 64; r++, reads++) {
+                romdisk_seek(fd, rand() % size, SEEK_SET);
+                romdisk_read(fd, buf, 256);
+            }
+
+            romdisk_close(fd);
+        }
+    }
+
+    rnd = bench_now() - t;
+
+    printf("\nimage:      %ld bytes, %d files, %lu data bytes stored for %lu\n",
+           image_size, bench_count, (unsigned long)bench_stored,
+           (unsigned long)(total / passes));
+    printf("sequential: %.1f MB/s (checksum %08lx)\n",
+           total / seq / 1048576.0, (unsigned long)sum);
+    printf("random:     %.0f reads/s of 256 bytes\n", reads / rnd);
+
+    return 0;
+}
+
+/* Get at the data of every file the way a loader would, either reading it
+   into a buffer of its own or mapping it in place, and compare the time
+   per file and the memory used. Compressed files can't be mapped, so those
+   are read both times. */
+int bench_mmap(int passes) {
+    uint8           **copies, *buf;
+    const uint8     *ptr;
+    uint32          fd;
+    size_t          size;
+    uintptr_t       addrs = 0;
+    unsigned long   heap = 0;
+    double          t, tcopy, tmap;
+    int             i, p, mapped = 0;
+
+    copies = calloc(bench_count, sizeof(uint8 *));
+
+    /* the old way: allocate and copy; the copies stay around, as a loader's
+       textures and tables would */
+    t = bench_now();
+
+    for(p = 0; p < passes; p++) {
+        for(i = 0; i < bench_count; i++) {
+            if((fd = romdisk_open(bench_files[i], O_RDONLY)) == 0) {
+                printf("Couldn't open %s\n", bench_files[i]);
+                return -1;
+            }
+
+            size = romdisk_total(fd);
+
+            if(size == (size_t)-1 || !(copies[i] = malloc(size ? size : 1))) {
+                printf("Couldn't read %s\n", bench_files[i]);
+                romdisk_close(fd);
+                return -1;
+            }
+
+            romdisk_read(fd, copies[i], size);
+            romdisk_close(fd);
+
+            if(p == 0)
+                heap += size;
+
+            if(p < passes - 1)
+                free(copies[i]);
+        }
+    }
+
+    tcopy = bench_now() - t;
+
+    /* mapped in place */
+    t = bench_now();
+
+    for(p = 0; p < passes; p++) {
+        for(i = 0; i < bench_count; i++) {
+            fd = romdisk_open(bench_files[i], O_RDONLY);
+            ptr = romdisk_mmap(fd, &size);
+
+            if(ptr == NULL) {
+                size = romdisk_total(fd);
+
+                if(size == (size_t)-1 || !(buf = malloc(size ? size : 1))) {
+                    printf("Couldn't read %s\n", bench_files[i]);
+                    romdisk_close(fd);
+                    return -1;
+                }
+
+                romdisk_read(fd, buf, size);
+                free(buf);
+            }
+
+            romdisk_close(fd);
+        }
+    }
+
+    tmap = bench_now() - t;
+
+    /* both have to see the same bytes */
+    for(i = 0; i < bench_count; i++) {
+        fd = romdisk_open(bench_files[i], O_RDONLY);
+        ptr = romdisk_mmap(fd, &size);
+
+        if(ptr != NULL) {
+            if(memcmp(ptr, copies[i], size)) {
+                printf("%s differs when mapped\n", bench_files[i]);
+                return -1;
+            }
+
+            if(size) {
+                addrs |= (uintptr_t)ptr;
+                mapped++;
+            }
+        }
+
+        romdisk_close(fd);
+        free(copies[i]);
+    }
+
+    free(copies);
+
+    printf("\nfiles:  %d, %d of them mapped in place", bench_count, mapped);
+
+    if(mapped)
+        printf(", data aligned to %lu bytes", (unsigned long)(addrs & -addrs));
+
+    printf("\n");
+    printf("copy:   %.2f us per file, %lu bytes allocated\n",
+           tcopy * 1e6 / passes / bench_count, heap);
+    printf("mmap:   %.2f us per file, nothing allocated for mapped files\n",
+           tmap * 1e6 / passes / bench_count);
+
+    return 0;
 }
 
-int main() {
-    init();
+void usage(void) {
+    printf("usage: rdtest [image [file]]\n");
+    printf("       rdtest -b image [passes]\n");
+    printf("       rdtest -m image [passes]\n");
+    printf("\n");
+    printf("Prints a file from a romdisk image (romdisk2.img and\n");
+    printf("/testdir/rdtest.c by default), or with -b reads every file in\n");
+    printf("the image to measure throughput. -m compares reading every\n");
+    printf("file into a buffer against mapping it in place.\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char  *img = "romdisk2.img";
+    const char  *fn = "/testdir/rdtest.c";
+
+    if(argc > 1 && !strcmp(argv[1], "-h")) {
+        usage();
+        return 0;
+    }
+
+    if(argc > 2 && (!strcmp(argv[1], "-b") || !strcmp(argv[1], "-m"))) {
+        int passes = argc > 3 ? atoi(argv[3]) : 10;
+
+        if(init(argv[2]) < 0 || passes < 1)
+            return 1;
+
+        bench_walk(romdisk_files, "");
+
+        if(bench_count == 0) {
+            printf("No files in %s\n", argv[2]);
+            return 1;
+        }
+
+        if(argv[1][1] == 'm')
+            return bench_mmap(passes) < 0 ? 1 : 0;
+
+        return bench(passes) < 0 ? 1 : 0;
+    }
+
+    if(argc > 1)
+        img = argv[1];
+
+    if(argc > 2)
+        fn = argv[2];
+
+    if(init(img) < 0)
+        return 1;
 
     {
         uint32  fd, size;
         char    buf[667];
 
-        printf("Opening file /testdir/rdtest.c\n");
-        fd = romdisk_open("/testdir/rdtest.c", O_RDONLY);
+        printf("Opening file %s\n", fn);
+        fd = romdisk_open(fn, O_RDONLY);
 
         if(fd == 0) {
             printf("Couldn't open file\n");
-            return;
+            return 1;
         }
 
         size = romdisk_total(fd);
-        printf("fd is %d, size is %08lx\n", fd, size);
+        printf("fd is %d, size is %08lx\n", fd, (unsigned long)size);
 
         while(size > 0) {
             int r;
             r = romdisk_read(fd, buf, 666);
 
-            if(r < 0) {
+            if(r <= 0) {
                 printf("Read error\n");
-                return;
+                return 1;
             }
 
-            buf[r] = 0;
-            printf("%s", buf);
+            fwrite(buf, r, 1, stdout);
             size -= r;
         }
 
@@ -535,14 +998,3 @@ int main() {
 
     return 0;
 }
-
-
-
-
-
-
-
-
-
-
-
@@ -3,27 +3,20 @@
    vqenc.c
    Copyright (C)2002 Gil Megidish
 
-   Compresses JPG images into PowerVR supported VQ textures. All images
-   must be squared. Twiddled and mipmapped toggles are supported. I feel
-   dizzy, I think I over-twiddled.
+   Compresses JPG images into PowerVR supported VQ textures. Both sides
+   must be powers of two, and mipmapped images must be squared. Twiddled
+   and mipmapped toggles are supported. I feel dizzy, I think I
+   over-twiddled.
 
-   This code is based on the work of Jonas Norberg, you can find more info at
-   http://www.acc.umu.se/~bedev/software/vq/
+   The encoding itself lives in libdctex; this is the command line for it.
 */
 
 #include <stdio.h>
-#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <unistd.h>
 #include <errno.h>
-#include "get_image.h"
-#include "vq_internal.h"
-#include "vq_types.h"
-
-/* For outputting KMG files */
-#include "kmg.h"
+#include "dctex.h"
 
 static int use_mipmap = 0;
 static int use_twiddle = 0;
@@ -32,365 +25,41 @@ static int use_debug = 0;
 static int use_hq = 0;
 static int use_kmg = 0;
 static int use_alpha = 0;
+static int use_threads = 0;
+static int use_sample = 0;
+static int use_sample_check = 0;
+static double use_refine = 0.001;
+static const char *use_shared = NULL;
 
-#define PACK1555(a, r, g, b) ( (a ? 0x8000 : 0) | ((r>>3)<<10) | ((g>>3)<<5) | ((b >>3)))
-#define PACK4444(a, r, g, b) ( ((a>>4) << 12) | ((r>>4)<<8) | ((g>>4)<<4) | ((b>>4)) )
-#define PACK565(r, g, b) (((r>>3)<<11) | ((g>>2)<<5) | ((b>>3)))
-#define LIMIT(x,low,high) (x) < low ? low : (x) > high ? high : (x);
-
-static void reset_code(code_t *c) {
-    clear_quad(&c->pos_sum);
-    c->pos_count = 0;
-    c->max_dist = 0.0;
-}
-
-static void reset_codebook(context_t *cb) {
-    int i;
-    code_t *e;
-
-    e = cb->codes;
-
-    for(i = 0; i < cb->in_use; i++) {
-        reset_code(e);
-        e++;
-    }
-}
-
-
-static double quad_length(fquad_t *q) {
-    int i;
-    float total;
-
-    total = 0.0;
-
-    for(i = 0; i < 4; i++) {
-        total += (q->p[i].a * q->p[i].a);
-        total += (q->p[i].r * q->p[i].r);
-        total += (q->p[i].g * q->p[i].g);
-        total += (q->p[i].b * q->p[i].b);
-    }
-
-    return sqrt(total);
-}
-
-static int map_width(int res) {
-    int width;
-
-    width = (1 << (res + 1));
-    return width;
-}
+/* libdctex takes at most this many threads per texture */
+#define MAX_THREADS 64
 
-static int quads_in_map(int res) {
-    int across;
-
-    across = (1 << (res + 1));
-    return (across * across) >> 2;
-}
-
-static double delta_e(fquad_t *a, fquad_t *b) {
-    int i;
-    fquad_t sub;
-    double total;
-
-    total = 0.0;
-    sub_quad(&sub, a, b);
-
-    for(i = 0; i < 4; i++) {
-        total += (sub.p[i].a * sub.p[i].a);
-        total += (sub.p[i].r * sub.p[i].r);
-        total += (sub.p[i].g * sub.p[i].g);
-        total += (sub.p[i].b * sub.p[i].b);
-    }
-
-    return sqrt(total);
-}
-
-/* returns the closest (most similar) codebook entry to the given quad */
-static int find(context_t *cb, fquad_t *q) {
-    int code, close_entry;
-    double close_dist;
-
-    close_entry = 0;
-    close_dist = delta_e(&cb->codes[0].value, q);
-
-    for(code = 1; code < cb->in_use; code++) {
-
-        /* hope not to get sued for this variable's name */
-        double d;
-
-        d = delta_e(&cb->codes[code].value, q);
-
-        if(d < close_dist) {
-            close_entry = code;
-            close_dist = d;
-
-            if(d < 0.0001) {
-                /* close enough */
-                return close_entry;
-            }
-        }
-
-    }
-
-    return close_entry;
-}
-
-static void place(context_t *cb, fquad_t *quads, int nquads) {
-    int i, idx;
-    code_t *e;
-    double dist;
-    fquad_t *that;
-
-    that = quads;
-
-    for(i = 0; i < nquads; i++) {
-        /* find averages of all codebook entries */
-        idx = find(cb, that);
-        e = &cb->codes[idx];
-
-        add_quad(&e->pos_sum, that);
-        e->pos_count++;
-
-        /* see if we have something better in hand */
-        dist = delta_e(&e->value, that);
-
-        if(dist > e->max_dist) {
-            e->max_dist = dist;
-            copy_quad(&e->max_dist_vec, that);
-        }
-
-        that++;
-    }
-}
-
-static void clean_codebook(context_t *cb) {
-    int i;
-    code_t * e;
-
-    e = cb->codes;
-
-    for(i = 0; i < cb->in_use; i++) {
-        if(e->pos_count > 0) {
-            /* code has been used */
-            div_quad(&e->pos_sum, (float)e->pos_count);
-            copy_quad(&e->value, &e->pos_sum);
-            e++;
-        }
-        else {
-            /* never been used */
-            *e = cb->codes[cb->in_use - 1];
-            cb->in_use--;
-            e++;
-        }
-    }
-}
-
-/* add new quad to codebook */
-static int add_to_codebook(context_t *cb, fquad_t *q) {
-    int index;
-
-    index = cb->in_use;
-    reset_code(&cb->codes[index]);
-    copy_quad(&cb->codes[index].value, q);
-
-    cb->codes[index].index = index;
-
-    /* update sequencial id */
-    cb->in_use++;
-    return index;
-}
-
-/* based on the statistics, split the entries in the codebook table */
-static void split(context_t *cb) {
-    int     i, elements;
-    code_t  *e;
-    fquad_t new_element;
-
-    e = cb->codes;
-    elements = cb->in_use;
-
-    for(i = 0; i < elements; i++) {
-        if(e->pos_count > 1) {
-
-            fquad_t diff;
-            float len;
-
-            sub_quad(&diff, &e->max_dist_vec, &e->value);
-            len = quad_length(&diff) * 256.0f;
-            div_quad(&diff, len);
-
-            copy_quad(&new_element, &e->value);
-            add_quad(&new_element, &diff);
-
-            sub_quad(&e->value, &e->value, &diff);
-        }
-        else {
-            /* some elements were not used, so we'll
-             * merge those with a black (zero) quad and hope
-             * some other quad will find it useful.
-             */
-            copy_quad(&new_element, &e->value);
-            div_quad(&new_element, 2.0);
-        }
-
-        add_to_codebook(cb, &new_element);
-        /* fixme: remove those that are <= 0 */
-        e++;
-    }
-}
-
-static int new_context(context_t *cb) {
-    reset_code(&cb->codes[0]);
-    clear_quad(&cb->codes[0].value);
-    cb->codes[0].index = 0;
-
-    /* only one color supported, and it's black */
-    cb->in_use = 1;
-    return 0;
-}
-
-static uint16 pack(fcolor_t *c) {
-    int a, r, g, b;
-
-    a = LIMIT(c->a, 0, 255);
-    r = LIMIT(c->r, 0, 255);
-    g = LIMIT(c->g, 0, 255);
-    b = LIMIT(c->b, 0, 255);
+/* the library settings matching the command line */
+static void get_params(dctex_params_t *p) {
+    dctex_default_params(p);
 
     if(use_alpha == 1)
-        return PACK4444(a, r, g, b);
+        p->format = KMG_DCFMT_ARGB4444;
     else if(use_alpha == 2)
-        return PACK1555(a, r, g, b);
-    else
-        return PACK565(r, g, b);
-}
-
-static int INLINE le16(int x) {
-    /* Endian test added by Dan. This is probably not too efficient
-       but it's portable and will get the job done. */
-    unsigned long test = 0x12345678;
-    unsigned char * tp = (unsigned char *)&test;
-
-    if(*tp == 0x78)
-        /* Little endian */
-        return x;
+        p->format = KMG_DCFMT_ARGB1555;
     else
-        /* Big endian */
-        return ((x << 8) & 0xff00) | ((x >> 8) & 0x00ff);
-}
-
-static void copy_codebook(context_t *cb, uint16 *codebook) {
-    int     i;
-    code_t  *e;
-
-    e = cb->codes;
-
-    for(i = 0; i < cb->in_use; i++) {
-        /* even the codebook is twiddled! */
-        *codebook++ = le16(pack(&e->value.p[0]));
-        *codebook++ = le16(pack(&e->value.p[2]));
-        *codebook++ = le16(pack(&e->value.p[1]));
-        *codebook++ = le16(pack(&e->value.p[3]));
-        e++;
-    }
-
-    /* fill up what's left */
-    while(i < 256) {
-        *codebook++ = 0;
-        *codebook++ = 0;
-        *codebook++ = 0;
-        *codebook++ = 0;
-        i++;
-    }
-}
-
-static int divide(int *ptr, int stride, int x, int y, int blocksize, int seq) {
-    int before;
-
-    before = seq;
-
-    switch(blocksize) {
-        case 1:
-            /* cant divide anymore */
-            ptr[seq++] = y * stride + x;
-            break;
-
-        default:
-            blocksize = blocksize >> 1;
-            seq += divide(ptr, stride, x, y, blocksize, seq);
-            seq += divide(ptr, stride, x, y + blocksize, blocksize, seq);
-            seq += divide(ptr, stride, x + blocksize, y, blocksize, seq);
-            seq += divide(ptr, stride, x + blocksize, y + blocksize, blocksize, seq);
-            break;
-    }
-
-    return (seq - before);
-}
-
-static int *twiddle_twiddle(int length) {
-    /* divide and conquer */
-    int *ptr = (int *)malloc(sizeof(int) * length * length);
-
-    if(ptr == NULL)
-        return NULL;
-
-    divide(ptr, length, 0, 0, length, 0);
-    return ptr;
-}
-
-static int write_linear(FILE *out, context_t *cb, mipmap_t *m, int res) {
-    int i, nquads;
-
-    nquads = quads_in_map(res);
-
-    for(i = 0; i < nquads; i++) {
-        uint8 c = find(cb, &m->map[res][i]);
-
-        if(fputc(c, out) == EOF)
-            return -1;
-    }
-
-    return 0;
-}
-
-static int write_twiddled(FILE *out, context_t *cb, mipmap_t *m, int res) {
-    int *twididx, *twiddled;
-    int i, width, nquads;
-    fquad_t *map;
-
-    width = map_width(res);
-    nquads = quads_in_map(res);
-
-    twiddled = twiddle_twiddle(width / 2);
-    twididx = twiddled;
-    map = m->map[res];
-
-    for(i = 0; i < nquads; i++) {
-        uint8 c = find(cb, &map[*twididx++]);
-
-        if(fputc(c, out) == EOF)
-            return -1;
-    }
-
-    free(twiddled);
-    return 0;
-}
-
-static int save_codebook(FILE *out, context_t *cb) {
-    uint16 codebook[256 * 4];
-
-    copy_codebook(cb, codebook);
-
-    if(fwrite(codebook, sizeof(codebook), 1, out) != 1) {
-        /* bummer */
-        return -errno;
-    }
-
-    return 0;
-}
-
-static int save(const char *filename, context_t *cb, mipmap_t *m, image_t *img) {
-    int ok, res;
+        p->format = KMG_DCFMT_RGB565;
+
+    p->vq = 1;
+    p->twiddle = use_twiddle;
+    p->mipmap = use_mipmap;
+    p->kmg = use_kmg;
+    p->threads = use_threads;
+    p->hq = use_hq;
+    p->sample = use_sample;
+    p->sample_check = use_sample_check;
+    p->refine = use_refine;
+    p->log = stdout;
+    p->verbose = use_verbose;
+    p->debug = use_debug;
+}
+
+static int write_file(const char *filename, dctex_buffer_t *buf) {
     FILE    *fp;
 
     fp = fopen(filename, "wb");
@@ -400,83 +69,17 @@ static int save(const char *filename, context_t *cb, mipmap_t *m, image_t *img)
         return -errno;
     }
 
-    if(use_kmg) {
-        kmg_header_t    hdr;
-
-        memset(&hdr, 0, sizeof(hdr));
-        hdr.magic = KMG_MAGIC;
-        hdr.version = KMG_VERSION;
-        hdr.platform = KMG_PLAT_DC;
-
-        if(use_alpha == 1)
-            hdr.format = KMG_DCFMT_ARGB4444 | KMG_DCFMT_VQ;
-        else if(use_alpha == 2)
-            hdr.format = KMG_DCFMT_ARGB1555 | KMG_DCFMT_VQ;
-        else
-            hdr.format = KMG_DCFMT_RGB565 | KMG_DCFMT_VQ;
-
-        if(use_twiddle)
-            hdr.format |= KMG_DCFMT_TWIDDLED;
-
-        if(use_mipmap)
-            hdr.format |= KMG_DCFMT_MIPMAP;
-
-        hdr.width = img->w;
-        hdr.height = img->h;
-        hdr.byte_count = 2048 + (use_mipmap ? 1 : 0);
-
-        for(res = 0; res < MAX_MIPMAP; res++) {
-            if(m->map[res] != NULL) {
-                hdr.byte_count += quads_in_map(res);
-            }
-        }
-
-        if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
-            fprintf(stderr, "FATAL: can't write KMG header to %s\n", filename);
-            goto loser;
-        }
-    }
-
-    if(save_codebook(fp, cb) < 0) {
-        fprintf(stderr, "FATAL: failed writing codebook to %s\n", filename);
-        goto loser;
-    }
-
-    /* dummy byte (0) must be included in square mipmaps */
-    if(use_mipmap) {
-        if(fputc('\0', fp) == EOF) {
-            fprintf(stderr, "FATAL: error writing %s\n", filename);
-            goto loser;
-        }
-    }
-
-    for(res = 0; res < MAX_MIPMAP; res++) {
-        /* write each valid map down, if output is required
-         * as twiddled, mess it up before saving to disk
-         */
-        if(m->map[res] != NULL) {
-            if(use_twiddle)
-                ok = write_twiddled(fp, cb, m, res);
-            else
-                ok = write_linear(fp, cb, m, res);
-
-            if(ok < 0) {
-                fprintf(stderr, "FATAL: error writing index data to %s\n", filename);
-                goto loser;
-            }
-        }
+    if(fwrite(buf->data, buf->size, 1, fp) != 1) {
+        fprintf(stderr, "FATAL: error writing %s\n", filename);
+        fclose(fp);
+        unlink(filename);
+        return -1;
     }
 
     fclose(fp);
     return 0;
-
-loser:
-    fclose(fp);
-    unlink(filename);
-    return -1;
 }
 
-
 static void banner(const char *progname) {
     printf("Usage: %s [options] image1 [image2..]\n", progname);
     printf("\n");
@@ -489,200 +92,16 @@ static void banner(const char *progname) {
     printf("\t-k, --kmg\twrite a KMG for output\n");
     printf("\t-a, --alpha\tuse alpha channel (and output ARGB4444)\n");
     printf("\t-b, --amask\tuse 1-bit alpha mask (and output ARGB1555)\n");
+    printf("\t--shared=name\ttrain one codebook for all images, written to\n");
+    printf("\t\t\tname.vqc, and only indices to each image.vqi\n");
+    printf("\t--threads=n\tnumber of threads for training (default: all cores)\n");
+    printf("\t--sample=pct\ttrain on a stratified pct%% of the quads, then assign\n");
+    printf("\t\t\tall of them once (faster on large images)\n");
+    printf("\t--sample-check\talso train on all quads and report the difference\n");
+    printf("\t--refine=pct\trefine the full codebook until an iteration improves\n");
+    printf("\t\t\tthe error by less than pct%% (default 0.1, 0 = off)\n");
 }
 
-static int mipmap_index(int s) {
-    int mip;
-
-    /* already assuming size is valid, so no funky business */
-    mip = 0;
-
-    /* no 1x1 bitmaps */
-    s >>= 2;
-
-    while(s) {
-        s >>= 1;
-        mip++;
-    }
-
-    return mip;
-}
-
-static int valid_size(int x) {
-    if(x < 2 || x > 1024)
-        return 0;
-
-    while(x) {
-        int bit = (x & 1);
-        x >>= 1;
-
-        if(x && bit) {
-            /* more than one bit in image */
-            return 0;
-        }
-    }
-
-    return 1;
-}
-
-static fquad_t *create_map(int res, image_t *im) {
-    int x, y;
-    int nquads;
-    fquad_t *q, *qt;
-
-    if(use_debug) {
-        printf("create_map(%d)\n", res);
-    }
-
-    nquads = quads_in_map(res);
-    q = (fquad_t *)malloc(nquads * sizeof(fquad_t));
-
-    if(q == NULL)
-        return NULL;
-
-    qt = q;
-
-    for(y = 0; y < im->h; y += 2) {
-        /* warning, ugly code coming up */
-        for(x = 0; x < im->w; x += 2) {
-            get_color(&qt->p[0], im->data + (y * im->stride) + (x * 4));
-            get_color(&qt->p[1], im->data + (y * im->stride) + ((x + 1) * 4));
-            get_color(&qt->p[2], im->data + ((y + 1)*im->stride) + (x * 4));
-            get_color(&qt->p[3], im->data + ((y + 1)*im->stride) + ((x + 1) * 4));
-            qt++;
-        }
-    }
-
-    return q;
-}
-
-static void destroy_mipmap(mipmap_t *m) {
-    int i;
-
-    for(i = 0; i < MAX_MIPMAP; i++) {
-        if(m->map[i]) {
-            free(m->map[i]);
-            m->map[i] = NULL;
-        }
-    }
-}
-
-static fquad_t *create_downscaled_map(int res, fquad_t *oneup) {
-    int y, x, nquads, qw;
-    fquad_t *q, *larger, tmp;
-
-    if(use_debug) {
-        printf("create_downscaled_map(%d %x)\n", res, (unsigned)oneup);
-    }
-
-    /* each quad in the lower resolution is an average of
-     * four quads in the higher resolution map.
-     */
-
-    qw = 1 << res;
-    nquads = quads_in_map(res);
-    q = (fquad_t *)malloc(sizeof(fquad_t) * nquads);
-
-    if(q == NULL)
-        return NULL;
-
-    for(y = 0; y < qw; y++) {
-        for(x = 0; x < qw; x++) {
-            /* clear temporary quad */
-            clear_quad(&tmp);
-
-            larger = &oneup[y * 2 * qw * 2 + x * 2];
-            sum_colors(&tmp.p[0], &larger->p[0]);
-            sum_colors(&tmp.p[0], &larger->p[1]);
-            sum_colors(&tmp.p[0], &larger->p[2]);
-            sum_colors(&tmp.p[0], &larger->p[3]);
-            div_colors(&tmp.p[0], 4.0f);
-
-            larger = &oneup[y * 2 * qw * 2 + x * 2 + 1];
-            sum_colors(&tmp.p[1], &larger->p[0]);
-            sum_colors(&tmp.p[1], &larger->p[1]);
-            sum_colors(&tmp.p[1], &larger->p[2]);
-            sum_colors(&tmp.p[1], &larger->p[3]);
-            div_colors(&tmp.p[1], 4.0f);
-
-            larger = &oneup[(y * 2 + 1) * qw * 2 + x * 2];
-            sum_colors(&tmp.p[2], &larger->p[0]);
-            sum_colors(&tmp.p[2], &larger->p[1]);
-            sum_colors(&tmp.p[2], &larger->p[2]);
-            sum_colors(&tmp.p[2], &larger->p[3]);
-            div_colors(&tmp.p[2], 4.0f);
-
-            larger = &oneup[(y * 2 + 1) * qw * 2 + x * 2 + 1];
-            sum_colors(&tmp.p[3], &larger->p[0]);
-            sum_colors(&tmp.p[3], &larger->p[1]);
-            sum_colors(&tmp.p[3], &larger->p[2]);
-            sum_colors(&tmp.p[3], &larger->p[3]);
-            div_colors(&tmp.p[3], 4.0f);
-
-            copy_quad(&q[y * qw + x], &tmp);
-        }
-    }
-
-    return q;
-}
-
-static int build_mipmap(mipmap_t *m, image_t *i) {
-    int size;
-    int image_res;
-
-    if(use_verbose) {
-        printf("o");
-    }
-
-    /* paranoia, so later you can use destory_mipmap safely */
-    memset(m, '\0', sizeof(*m));
-
-    image_res = mipmap_index(i->w);
-
-    m->map[image_res] = create_map(image_res, i);
-
-    if(m->map[image_res] == NULL)
-        return -ENOMEM;
-
-    if(use_mipmap) {
-        /* create maps in lower resolution */
-        size = image_res - 1;
-
-        while(size >= 0) {
-            m->map[size] = create_downscaled_map(size, m->map[size + 1]);
-            size--;
-        }
-    }
-
-    return 0;
-}
-
-static void place_quads(context_t *cb, mipmap_t *m) {
-    int i, j, quads;
-
-    /* run three times to get better quality;
-     * this is not required for most of textures
-     */
-
-    reset_codebook(cb);
-
-    for(j = 0; j < (use_hq ? 3 : 1); j++) {
-        for(i = 0; i < MAX_MIPMAP; i++) {
-            /* for each mipmap, scan all quads and update
-             * statistics of which quad is the closest to
-             * which codebook index entry
-             */
-            if(m->map[i] != NULL) {
-                quads = quads_in_map(i);
-                place(cb, m->map[i], quads);
-            }
-        }
-    }
-
-    clean_codebook(cb);
-}
-
-
 static const char *figure_outfilename(const char *f, const char *newext) {
     char *newname;
     char *ext;
@@ -719,40 +138,60 @@ static void destroy_image(image_t *image) {
     }
 }
 
-static int encode(const char *infile) {
-    int     i, ok;
-    image_t     image;
-    mipmap_t    mipmap;
-    context_t   context;
-    const char  *outfile;
+/* tells how much VRAM a rectangular texture saves over padding it to
+ * a square; the codebook is the same size either way
+ */
+static void report_savings(const char *infile, image_t *image, int bytes) {
+    int side, padded;
+
+    if(image->w == image->h)
+        return;
+
+    side = image->w > image->h ? image->w : image->h;
+    padded = 2048 + (side / 2) * (side / 2);
+
+    printf("%s: %dx%d takes %d bytes, %d less than padded to %dx%d\n",
+           infile, image->w, image->h, bytes, padded - bytes, side, side);
+}
+
+/* bytes of texture data in buf, leaving out any KMG header */
+static int data_bytes(dctex_buffer_t *buf) {
+    return buf->size - (use_kmg ? (int)sizeof(kmg_header_t) : 0);
+}
 
+/* reads an image and checks it can be encoded */
+static int load_texture(const char *infile, image_t *image, dctex_params_t *p) {
     if(use_verbose) {
         printf("encoding %s.. ", infile);
     }
 
-    if(get_image(infile, &image) < 0) {
+    if(get_image(infile, image) < 0) {
         fprintf(stderr, "failed reading %s\n", infile);
         return -EINVAL;
     }
 
-    /* if (image.bpp != 3) {
-        fprintf(stderr, "not a 24bit image (%d bits)\n", 8 * image.bpp);
-        destroy_image(&image);
-        return -EINVAL;
-    } */
-
-    if(image.w != image.h) {
-        fprintf(stderr, "%s is not a square image\n", infile);
-        destroy_image(&image);
+    if(image->w != image->h && use_mipmap) {
+        fprintf(stderr, "%s is not a square image, mipmaps need one\n", infile);
+        destroy_image(image);
         return -EINVAL;
     }
 
-    if(valid_size(image.w) == 0) {
+    if(dctex_check(image, p) < 0) {
         fprintf(stderr, "image dimensions for %s are not valid, see manual\n", infile);
-        destroy_image(&image);
+        destroy_image(image);
         return -EINVAL;
     }
 
+    return 0;
+}
+
+static int encode(const char *infile) {
+    int     ok;
+    image_t     image;
+    dctex_params_t  params;
+    dctex_buffer_t  out;
+    const char  *outfile;
+
     if(use_kmg)
         outfile = figure_outfilename(infile, "kmg");
     else
@@ -763,32 +202,123 @@ static int encode(const char *infile) {
         return -ENOMEM;
     }
 
-    new_context(&context);
-    build_mipmap(&mipmap, &image);
+    get_params(&params);
+    ok = load_texture(infile, &image, &params);
+
+    if(ok < 0) {
+        free((char *)outfile);
+        return ok;
+    }
+
+    ok = dctex_encode(&image, &params, &out);
+
+    if(ok == 0)
+        ok = write_file(outfile, &out);
+    else
+        fprintf(stderr, "memory allocation failed for %s\n", infile);
+
+    if(ok == 0)
+        report_savings(infile, &image, data_bytes(&out));
+
+    dctex_free(&out);
+    destroy_image(&image);
+    free((char *)outfile);
+    return ok;
+}
+
+/* trains a single codebook over the quads of every image, so a set of
+ * similar textures can ship one codebook and an index file per texture
+ */
+static int encode_shared(const char *name, char *files[], int nfiles) {
+    int     i, ok, loaded, separate, shared;
+    image_t     *images;
+    dctex_buffer_t  cb, *out;
+    dctex_params_t  params;
+    const char  *outfile;
+
+    images = (image_t *)calloc(nfiles, sizeof(image_t));
+    out = (dctex_buffer_t *)calloc(nfiles, sizeof(dctex_buffer_t));
+    memset(&cb, '\0', sizeof(cb));
+    loaded = 0;
+    ok = -ENOMEM;
+
+    if(images == NULL || out == NULL) {
+        fprintf(stderr, "memory allocation failed for %s\n", name);
+        goto out;
+    }
+
+    get_params(&params);
+
+    /* a texture set is all or nothing */
+    for(loaded = 0; loaded < nfiles; loaded++) {
+        ok = load_texture(files[loaded], &images[loaded], &params);
 
-    /* feed all quads (all resolutions) */
-    place_quads(&context, &mipmap);
+        if(ok < 0)
+            goto out;
 
-    /* starting with one codebook entry, split 7 times */
-    for(i = 1; i <= 7; i++) {
         if(use_verbose) {
-            printf("o");
+            printf("\n");
         }
+    }
+
+    ok = dctex_encode_shared(images, nfiles, &params, &cb, out);
 
-        split(&context);
-        place_quads(&context, &mipmap);
+    if(ok < 0) {
+        fprintf(stderr, "memory allocation failed for %s\n", name);
+        goto out;
     }
 
-    split(&context);
+    outfile = figure_outfilename(name, "vqc");
 
-    if(use_verbose) {
-        printf("\n");
+    if(outfile == NULL) {
+        fprintf(stderr, "memory allocation failed for %s\n", name);
+        ok = -ENOMEM;
+        goto out;
     }
 
-    ok = save(outfile, &context, &mipmap, &image);
+    ok = write_file(outfile, &cb);
+    free((char *)outfile);
 
-    destroy_mipmap(&mipmap);
-    destroy_image(&image);
+    if(ok < 0)
+        goto out;
+
+    separate = 0;
+    shared = cb.size;
+
+    for(i = 0; i < nfiles; i++) {
+        outfile = figure_outfilename(files[i], "vqi");
+
+        if(outfile == NULL) {
+            fprintf(stderr, "memory allocation failed for %s\n", files[i]);
+            ok = -ENOMEM;
+            goto out;
+        }
+
+        ok = write_file(outfile, &out[i]);
+        free((char *)outfile);
+
+        if(ok < 0)
+            goto out;
+
+        report_savings(files[i], &images[i], cb.size + data_bytes(&out[i]));
+        separate += cb.size + data_bytes(&out[i]);
+        shared += data_bytes(&out[i]);
+    }
+
+    printf("%s: %d textures, %d bytes with a shared codebook, %d bytes "
+           "with one codebook each (%d saved)\n", name, nfiles, shared,
+           separate, separate - shared);
+
+out:
+    dctex_free(&cb);
+
+    for(i = 0; i < loaded; i++) {
+        dctex_free(&out[i]);
+        destroy_image(&images[i]);
+    }
+
+    free(out);
+    free(images);
     return ok;
 }
 
@@ -809,6 +339,16 @@ static int process_long_options(char *arg) {
         use_alpha = 1;
     else if(! strcmp(arg, "amask"))
         use_alpha = 2;
+    else if(! strncmp(arg, "shared=", 7) && arg[7] != '\0')
+        use_shared = arg + 7;
+    else if(! strncmp(arg, "threads=", 8) && atoi(arg + 8) > 0)
+        use_threads = atoi(arg + 8);
+    else if(! strncmp(arg, "sample=", 7) && atoi(arg + 7) > 0 && atoi(arg + 7) <= 100)
+        use_sample = atoi(arg + 7) < 100 ? atoi(arg + 7) : 0;
+    else if(! strcmp(arg, "sample-check"))
+        use_sample_check = 1;
+    else if(! strncmp(arg, "refine=", 7) && atof(arg + 7) >= 0.0)
+        use_refine = atof(arg + 7) / 100.0;
     else
         return -EINVAL;
 
@@ -885,6 +425,17 @@ static int process(int argc, char *argv[]) {
         return -EINVAL;
     }
 
+    if(use_threads == 0)
+        use_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(use_threads < 1)
+        use_threads = 1;
+    else if(use_threads > MAX_THREADS)
+        use_threads = MAX_THREADS;
+
+    if(use_shared != NULL)
+        return encode_shared(use_shared, argv + arg, argc - arg) < 0 ? 1 : 0;
+
     while(arg < argc) {
         /* ordinary image */
         encode(argv[arg]);